@@ -0,0 +1,80 @@
+/*
+ Measures the sustained SPI byte rate to the MAX3421E with the SPI settings the library
+ was built with, see UHS_SPI_CLOCK, UHS_SPI_MODE and USE_UHS_SPI_EXCLUSIVE in settings.h.
+ Start at the fastest clock and go down until the pattern test passes on every run.
+ No USB device needs to be connected.
+*/
+
+#include <Usb.h>
+
+// Satisfy the IDE, which needs to see the include statment in the ino too.
+#ifdef dobogusinclude
+#include <spi4teensy3.h>
+#endif
+#include <SPI.h>
+
+#define RATE_RUNS 1000 // accesses of each kind
+
+USB Usb;
+
+uint8_t buf[64];
+
+// Write patterns into a register that holds every bit and read them back
+bool patternTest() {
+  static const uint8_t patterns[] = { 0x55, 0x2a, 0x7f, 0x01, 0x40, 0x00 };
+  bool ok = true;
+  for (uint16_t i = 0; i < RATE_RUNS; i++) {
+    uint8_t p = patterns[i % sizeof(patterns)];
+    Usb.regWr(rPERADDR, p);
+    if (Usb.regRd(rPERADDR) != p)
+      ok = false;
+  }
+  Usb.regWr(rPERADDR, 0x00);
+  return ok;
+}
+
+void printRate(const __FlashStringHelper *name, uint32_t bytes, uint32_t us) {
+  Serial.print(name);
+  Serial.print(F(": "));
+  Serial.print((double)bytes * 1000000.0 / us, 0);
+  Serial.println(F(" bytes/s"));
+}
+
+void setup() {
+  Serial.begin(115200);
+#if !defined(__MIPSEL__)
+  while (!Serial); // Wait for serial port to connect - used on Leonardo, Teensy and other boards with built-in USB CDC serial connection
+#endif
+  if (Usb.Init() == -1) {
+    Serial.println(F("OSC did not start"));
+    while (1); // Halt
+  }
+
+  Serial.print(F("SPI clock: "));
+  Serial.print(MAX3421eSpiDefault::clock);
+  Serial.print(F(" Hz, mode "));
+  Serial.print(MAX3421eSpiDefault::mode);
+  Serial.println(MAX3421eSpiDefault::shared ? F(", shared bus") : F(", exclusive bus"));
+  Serial.print(F("Pattern test: "));
+  Serial.println(patternTest() ? F("passed") : F("FAILED"));
+
+  // Each access is the command byte plus the data, SS is toggled once per access
+  uint32_t us = micros();
+  for (uint16_t i = 0; i < RATE_RUNS; i++)
+    Usb.bytesWr(rSNDFIFO, sizeof(buf), buf);
+  printRate(F("FIFO write, 64 bytes"), (uint32_t)RATE_RUNS * (sizeof(buf) + 1), micros() - us);
+
+  us = micros();
+  for (uint16_t i = 0; i < RATE_RUNS; i++)
+    Usb.bytesRd(rRCVFIFO, sizeof(buf), buf);
+  printRate(F("FIFO read, 64 bytes"), (uint32_t)RATE_RUNS * (sizeof(buf) + 1), micros() - us);
+
+  us = micros();
+  for (uint16_t i = 0; i < RATE_RUNS; i++)
+    Usb.regRd(rHIRQ);
+  printRate(F("Register read"), (uint32_t)RATE_RUNS * 2, micros() - us);
+}
+
+void loop() {
+  delay(1000); // Nothing left to do, this also lets the run end in the simulator in extras/sim
+}
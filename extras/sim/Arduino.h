@@ -0,0 +1,166 @@
+/* Copyright (C) 2011 Circuits At Home, LTD. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+Contact information
+-------------------
+
+Circuits At Home, LTD
+Web      :  http://www.circuitsathome.com
+e-mail   :  support@circuitsathome.com
+ */
+/* Arduino core API for host builds against the MAX3421E simulator, see README.md */
+
+#ifndef UHS_SIM_ARDUINO_H
+#define UHS_SIM_ARDUINO_H
+
+#if !defined(UHS_HOST_SIM)
+#error "This Arduino.h is only meant for host builds with UHS_HOST_SIM defined"
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#define PI 3.1415926535897932384626433832795
+#define HALF_PI 1.5707963267948966192313216916398
+#define TWO_PI 6.283185307179586476925286766559
+#define DEG_TO_RAD 0.017453292519943295769236907684886
+#define RAD_TO_DEG 57.295779513082320876798154814105
+
+#ifndef min
+#define min(a,b) ((a)<(b)?(a):(b))
+#endif
+#ifndef max
+#define max(a,b) ((a)>(b)?(a):(b))
+#endif
+#define constrain(amt,low,high) ((amt)<(low)?(low):((amt)>(high)?(high):(amt)))
+
+#define lowByte(w) ((uint8_t) ((w) & 0xff))
+#define highByte(w) ((uint8_t) ((w) >> 8))
+#define bitRead(value, bit) (((value) >> (bit)) & 0x01)
+#define bitSet(value, bit) ((value) |= (1UL << (bit)))
+#define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
+#define bit(b) (1UL << (b))
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+/* Time runs on the simulated clock, see UHSSim::Now() */
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield(void);
+
+/* Pins 10 (SS) and 9 (INT) are wired to the simulated MAX3421E */
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t val);
+int digitalRead(uint8_t pin);
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+void interrupts(void);
+void noInterrupts(void);
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+
+class Print {
+        size_t printNumber(unsigned long n, uint8_t base);
+
+public:
+        virtual ~Print() {
+        };
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t *buffer, size_t size);
+
+        size_t write(const char *str) {
+                return str ? write((const uint8_t *)str, strlen(str)) : 0;
+        };
+        virtual void flush() {
+        };
+
+        size_t print(const __FlashStringHelper *str);
+        size_t print(const char str[]);
+        size_t print(char c);
+        size_t print(unsigned char n, int base = DEC);
+        size_t print(int n, int base = DEC);
+        size_t print(unsigned int n, int base = DEC);
+        size_t print(long n, int base = DEC);
+        size_t print(unsigned long n, int base = DEC);
+        size_t print(double n, int digits = 2);
+
+        size_t println(const __FlashStringHelper *str);
+        size_t println(const char str[]);
+        size_t println(char c);
+        size_t println(unsigned char n, int base = DEC);
+        size_t println(int n, int base = DEC);
+        size_t println(unsigned int n, int base = DEC);
+        size_t println(long n, int base = DEC);
+        size_t println(unsigned long n, int base = DEC);
+        size_t println(double n, int digits = 2);
+        size_t println(void);
+};
+
+class Stream : public Print {
+public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+};
+
+/* Writes to stdout, reads from stdin without blocking */
+class HardwareSerial : public Stream {
+public:
+        void begin(unsigned long baud);
+        void end() {
+        };
+        int available();
+        int read();
+        int peek();
+        size_t write(uint8_t c);
+        using Print::write;
+        void flush();
+
+        operator bool() {
+                return true;
+        };
+};
+
+extern HardwareSerial Serial;
+
+/* The sketch */
+void setup(void);
+void loop(void);
+
+#endif /* UHS_SIM_ARDUINO_H */
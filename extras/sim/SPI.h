@@ -0,0 +1,66 @@
+/* Copyright (C) 2011 Circuits At Home, LTD. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+Contact information
+-------------------
+
+Circuits At Home, LTD
+Web      :  http://www.circuitsathome.com
+e-mail   :  support@circuitsathome.com
+ */
+/* SPI library for host builds, the bus is wired to the simulated MAX3421E */
+
+#ifndef UHS_SIM_SPI_H
+#define UHS_SIM_SPI_H
+
+#include <Arduino.h>
+
+#define SPI_HAS_TRANSACTION 1
+
+#define MSBFIRST 1
+#define LSBFIRST 0
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+class SPISettings {
+public:
+        uint32_t clock;
+
+        SPISettings(uint32_t clock_, uint8_t bitOrder __attribute__((unused)), uint8_t dataMode __attribute__((unused))) : clock(clock_) {
+        };
+};
+
+class SPIClass {
+public:
+        void begin() {
+        };
+
+        void end() {
+        };
+
+        void beginTransaction(SPISettings settings);
+        void endTransaction();
+
+        uint8_t transfer(uint8_t data);
+        void transfer(void *buf, size_t count);
+};
+
+extern SPIClass SPI;
+
+#endif /* UHS_SIM_SPI_H */
@@ -0,0 +1,625 @@
+/* Copyright (C) 2011 Circuits At Home, LTD. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+Contact information
+-------------------
+
+Circuits At Home, LTD
+Web      :  http://www.circuitsathome.com
+e-mail   :  support@circuitsathome.com
+ */
+/* Register-level MAX3421E simulator */
+
+#include "UHS_sim.h"
+
+#define CTRL_IDLE       0
+#define CTRL_DATA_IN    1
+#define CTRL_DATA_OUT   2
+#define CTRL_STATUS     3
+#define CTRL_STALL      4
+
+#define BUS_RESET_NS    50000000ULL     // the MAX3421E drives SE0 for about 50ms
+#define FRAME_NS        1000000ULL
+#define RESUME_NS       20000000ULL     // SIGRSM drives K for 20ms
+#define FS_BIT_NS       83              // 12Mbit/s
+#define LS_BIT_NS       667             // 1.5Mbit/s
+
+/* Virtual device: control pipe and standard requests */
+UHSSimDevice::UHSSimDevice(bool lowspeed_) :
+lowspeed(lowspeed_),
+address(0),
+pendingAddress(0),
+config(0),
+ctrlState(CTRL_IDLE),
+ctrlLen(0),
+ctrlPos(0) {
+        memset(&setup, 0, sizeof(setup));
+}
+
+UHSSimDevice* UHSSimDevice::Route(uint8_t addr) {
+        return (address == addr) ? this : NULL;
+}
+
+void UHSSimDevice::BusReset() {
+        address = 0;
+        pendingAddress = 0;
+        config = 0;
+        ctrlState = CTRL_IDLE;
+        Reset();
+}
+
+uint8_t UHSSimDevice::MaxPacketSize0() {
+        uint16_t len = 0;
+        const uint8_t *dd = GetDescriptor(USB_DESCRIPTOR_DEVICE, 0, &len);
+        return (dd && len > 7 && dd[7]) ? dd[7] : 8;
+}
+
+uint8_t UHSSimDevice::Request(uint8_t *data, uint16_t *len) {
+        uint8_t type = setup.ReqType_u.bmRequestType & 0x60;
+
+        if(type != USB_SETUP_TYPE_STANDARD)
+                return ClassRequest(&setup, data, len);
+
+        switch(setup.bRequest) {
+                case USB_REQUEST_GET_DESCRIPTOR:
+                {
+                        uint16_t dlen = 0;
+                        const uint8_t *desc = GetDescriptor(setup.wVal_u.wValueHi, setup.wVal_u.wValueLo, &dlen);
+                        if(!desc)
+                                return hrSTALL;
+                        if(dlen < *len)
+                                *len = dlen;
+                        memcpy(data, desc, *len);
+                        return hrSUCCESS;
+                }
+                case USB_REQUEST_SET_ADDRESS:
+                        pendingAddress = setup.wVal_u.wValueLo;
+                        return hrSUCCESS;
+                case USB_REQUEST_SET_CONFIGURATION:
+                        config = setup.wVal_u.wValueLo;
+                        SetConfiguration(config);
+                        return hrSUCCESS;
+                case USB_REQUEST_GET_CONFIGURATION:
+                        if(*len > 1)
+                                *len = 1;
+                        data[0] = config;
+                        return hrSUCCESS;
+                case USB_REQUEST_GET_STATUS:
+                        if(*len > 2)
+                                *len = 2;
+                        memset(data, 0, *len);
+                        return hrSUCCESS;
+                case USB_REQUEST_CLEAR_FEATURE:
+                case USB_REQUEST_SET_FEATURE:
+                case USB_REQUEST_SET_INTERFACE:
+                        return hrSUCCESS;
+                default:
+                        return hrSTALL;
+        }
+}
+
+uint8_t UHSSimDevice::Setup(const uint8_t *pkt) {
+        memcpy(&setup, pkt, sizeof(setup));
+        ctrlPos = 0;
+        ctrlLen = 0;
+
+        if(setup.ReqType_u.bmRequestType & 0x80) {
+                // Device to host: the whole answer is prepared now and sent in packets
+                uint16_t len = (setup.wLength > UHS_SIM_CTRL_BUF) ? UHS_SIM_CTRL_BUF : setup.wLength;
+                ctrlState = (Request(ctrlBuf, &len) == hrSUCCESS) ? CTRL_DATA_IN : CTRL_STALL;
+                ctrlLen = len;
+        } else
+                ctrlState = (setup.wLength) ? CTRL_DATA_OUT : CTRL_STATUS;
+        return hrSUCCESS; // SETUP is never NAKed
+}
+
+uint8_t UHSSimDevice::In(uint8_t ep, uint8_t *buf, uint8_t *len) {
+        if(ep)
+                return EpIn(ep, buf, UHS_SIM_FIFO_SIZE, len);
+
+        if(ctrlState == CTRL_STALL)
+                return hrSTALL;
+        if(ctrlState != CTRL_DATA_IN)
+                return hrSTALL;
+
+        uint16_t left = ctrlLen - ctrlPos;
+        uint8_t mps = MaxPacketSize0();
+        *len = (left > mps) ? mps : (uint8_t)left;
+        memcpy(buf, ctrlBuf + ctrlPos, *len);
+        ctrlPos += *len;
+        return hrSUCCESS;
+}
+
+uint8_t UHSSimDevice::Out(uint8_t ep, const uint8_t *buf, uint8_t len) {
+        if(ep)
+                return EpOut(ep, buf, len);
+
+        if(ctrlState != CTRL_DATA_OUT)
+                return hrSTALL;
+        if(ctrlLen + len > UHS_SIM_CTRL_BUF)
+                return hrSTALL;
+        memcpy(ctrlBuf + ctrlLen, buf, len);
+        ctrlLen += len;
+        return hrSUCCESS;
+}
+
+/* Status stage of a host to device request */
+uint8_t UHSSimDevice::StatusIn() {
+        if(ctrlState != CTRL_DATA_OUT && ctrlState != CTRL_STATUS)
+                return hrSTALL;
+
+        uint16_t len = ctrlLen;
+        uint8_t rcode = Request(ctrlBuf, &len);
+        ctrlState = CTRL_IDLE;
+        if(rcode != hrSUCCESS)
+                return rcode;
+
+        if(setup.ReqType_u.bmRequestType == (bmREQ_SET) && setup.bRequest == USB_REQUEST_SET_ADDRESS)
+                address = pendingAddress; // takes effect after the status stage
+        return hrSUCCESS;
+}
+
+/* Status stage of a device to host request */
+uint8_t UHSSimDevice::StatusOut() {
+        if(ctrlState == CTRL_STALL)
+                return hrSTALL;
+        ctrlState = CTRL_IDLE;
+        return hrSUCCESS;
+}
+
+/* Simulator */
+uint64_t UHSSim::now = 0;
+
+UHSSim& UHSSim::Instance(uint8_t chip) {
+        static UHSSim sim(UHS_SIM_SS_PIN, UHS_SIM_INT_PIN);
+        static UHSSim sim2(UHS_SIM_SS_PIN_2, UHS_SIM_INT_PIN_2);
+        return (chip) ? sim2 : sim;
+}
+
+UHSSim::UHSSim(uint8_t ss, uint8_t intr) :
+runUntil(0),
+ssPin(ss),
+intPin(intr),
+spiByteNs(308), // 8 bits at 26MHz
+spiSelectNs(500),
+selected(false),
+cmdDone(false),
+cmd(0),
+root(NULL),
+rootEnabled(false) {
+        memset(faults, 0, sizeof(faults));
+        memset(&stats, 0, sizeof(stats));
+        ChipReset();
+}
+
+void UHSSim::ChipReset() {
+        memset(regs, 0, sizeof(regs));
+        regs[rREVISION >> 3] = 0x13;
+        hrslResult = hrSUCCESS;
+        rcvTog = 0;
+        sndTog = 0;
+        rcvFull = 0;
+        rcvHead = 0;
+        rcvPtr = 0;
+        sndQueued = 0;
+        sndHead = 0;
+        sndPtr = 0;
+        sudPtr = 0;
+        xferPending = false;
+        xferData = false;
+        resetPending = false;
+        resumePending = false;
+        frameStart = now;
+        frameCount = 0;
+        regs[rHIRQ >> 3] = bmSNDBAVIRQ;
+}
+
+void UHSSim::Advance(uint64_t ns) {
+        now += ns;
+}
+
+void UHSSim::Attach(UHSSimDevice *dev) {
+        root = dev;
+        rootEnabled = false;
+        if(dev)
+                dev->BusReset();
+        regs[rHIRQ >> 3] |= bmCONDETIRQ;
+}
+
+void UHSSim::Detach() {
+        Attach(NULL);
+}
+
+bool UHSSim::RemoteWakeup() {
+        Sync();
+        if(!root || SofRunning())
+                return false;
+        regs[rHIRQ >> 3] |= bmRWUIRQ;
+        return true;
+}
+
+bool UHSSim::SofRunning() {
+        return (regs[rMODE >> 3] & bmSOFKAENAB) && !(regs[rUSBCTL >> 3] & bmPWRDOWN);
+}
+
+bool UHSSim::InjectFault(uint8_t addr, uint8_t ep, uint8_t hrslt, uint16_t count) {
+        for(uint8_t i = 0; i < UHS_SIM_MAX_FAULTS; i++) {
+                if(!faults[i].count || (faults[i].addr == addr && faults[i].ep == ep)) {
+                        faults[i].addr = addr;
+                        faults[i].ep = ep;
+                        faults[i].hrslt = hrslt;
+                        faults[i].count = count;
+                        return true;
+                }
+        }
+        return false;
+}
+
+/* CLEAR_FEATURE(ENDPOINT_HALT) ends an injected STALL, like it does on a real device */
+void UHSSim::ClearHalt(uint8_t addr, uint8_t ep) {
+        for(uint8_t i = 0; i < UHS_SIM_MAX_FAULTS; i++)
+                if(faults[i].count && faults[i].addr == addr && faults[i].ep == ep && faults[i].hrslt == hrSTALL)
+                        faults[i].count = 0;
+}
+
+/* J/K state of the bus as the MAX3421E samples it */
+uint8_t UHSSim::BusState() {
+        if(!root)
+                return bmSE0;
+
+        // Full-speed idle is J, low-speed idle is K, both relative to the host speed
+        bool ls = root->IsLowSpeed();
+        if(regs[rMODE >> 3] & bmLOWSPEED)
+                ls = !ls;
+        return (ls) ? bmKSTATUS : bmJSTATUS;
+}
+
+uint64_t UHSSim::PacketNs(uint16_t bytes) {
+        // SYNC, PID, CRC and EOP add about 4 bytes, low-speed packets through a hub are sent at 1.5Mbit/s
+        bool ls = (regs[rMODE >> 3] & bmLOWSPEED) != 0;
+        return (uint64_t)(bytes + 4) * 8 * ((ls) ? LS_BIT_NS : FS_BIT_NS);
+}
+
+/* Applies the events that are due */
+void UHSSim::Sync() {
+        uint8_t &hirq = regs[rHIRQ >> 3];
+
+        if(resetPending && now >= resetDoneAt) {
+                resetPending = false;
+                regs[rHCTL >> 3] &= ~bmBUSRST;
+                hirq |= bmBUSEVENTIRQ;
+                if(root) {
+                        root->BusReset();
+                        rootEnabled = true;
+                }
+                frameStart = now;
+                frameCount = 0;
+        }
+
+        if(regs[rUSBCTL >> 3] & bmPWRDOWN) {
+                stats.pwrDownNs += now - pwrDownAt;
+                pwrDownAt = now;
+        }
+
+        if(resumePending && now >= resumeDoneAt) {
+                resumePending = false;
+                regs[rHCTL >> 3] &= ~bmSIGRSM;
+                hirq |= bmBUSEVENTIRQ;
+        }
+
+        if(xferPending && now >= xferDoneAt) {
+                xferPending = false;
+                hirq |= bmHXFRDNIRQ;
+                if(xferData)
+                        hirq |= bmRCVDAVIRQ;
+                xferData = false;
+        }
+
+        if(SofRunning() && !resetPending && !resumePending) {
+                uint32_t frames = (uint32_t)((now - frameStart) / FRAME_NS);
+                if(frames != frameCount) {
+                        frameCount = frames;
+                        hirq |= bmFRAMEIRQ;
+                }
+        } else {
+                frameStart = now - (now - frameStart) % FRAME_NS;
+                frameCount = 0;
+        }
+}
+
+void UHSSim::Transfer(uint8_t hxfr) {
+        uint8_t token = hxfr & 0xf0;
+        uint8_t ep = hxfr & 0x0f;
+        uint8_t addr = regs[rPERADDR >> 3];
+        uint8_t rcode = hrTIMEOUT;
+        uint16_t wire = 3; // token packet
+
+        stats.xfers++;
+
+        UHSSimDevice *dev = (root && rootEnabled) ? root->Route(addr) : NULL;
+
+        for(uint8_t i = 0; dev && i < UHS_SIM_MAX_FAULTS; i++) {
+                if(faults[i].count && faults[i].addr == addr && faults[i].ep == ep && token != tokSETUP) {
+                        faults[i].count--;
+                        dev = NULL;
+                        rcode = faults[i].hrslt;
+                        break;
+                }
+        }
+
+        if(dev) {
+                switch(token) {
+                        case tokSETUP:
+                                rcode = dev->Setup(sudBuf);
+                                if(sudBuf[0] == (USB_SETUP_HOST_TO_DEVICE | USB_SETUP_TYPE_STANDARD | USB_SETUP_RECIPIENT_ENDPOINT) &&
+                                        sudBuf[1] == USB_REQUEST_CLEAR_FEATURE && sudBuf[2] == USB_FEATURE_ENDPOINT_HALT)
+                                        ClearHalt(addr, sudBuf[4] & 0x0f);
+                                wire += 11;
+                                sudPtr = 0;
+                                rcvTog = 1; // data and status stages start with DATA1
+                                sndTog = 1;
+                                break;
+                        case tokIN:
+                        {
+                                uint8_t len = 0, pkt[UHS_SIM_FIFO_SIZE];
+                                if(rcvFull == 2) {
+                                        rcode = hrNAK; // no room, the SIE does not ask for data
+                                        break;
+                                }
+                                rcode = dev->In(ep, pkt, &len);
+                                if(rcode == hrSUCCESS) {
+                                        uint8_t b = (rcvHead + rcvFull) & 1;
+                                        memcpy(rcvBuf[b], pkt, len);
+                                        rcvCount[b] = len;
+                                        rcvFull++;
+                                        xferData = true;
+                                        rcvTog ^= 1;
+                                        wire += len + 3;
+                                        stats.bytesIn += len;
+                                }
+                                break;
+                        }
+                        case tokOUT:
+                        {
+                                uint8_t len = (sndQueued) ? sndCount[sndHead] : 0;
+                                rcode = dev->Out(ep, sndBuf[sndHead], len);
+                                wire += len + 3;
+                                if(rcode == hrSUCCESS) {
+                                        if(sndQueued) {
+                                                sndQueued--;
+                                                sndHead ^= 1;
+                                        }
+                                        sndTog ^= 1;
+                                        stats.bytesOut += len;
+                                }
+                                break;
+                        }
+                        case tokINHS:
+                                rcode = dev->StatusIn();
+                                wire += 3;
+                                break;
+                        case tokOUTHS:
+                                rcode = dev->StatusOut();
+                                wire += 3;
+                                break;
+                        case tokISOIN:
+                        {
+                                uint8_t len = 0, pkt[UHS_SIM_FIFO_SIZE];
+                                if(rcvFull == 2 || dev->IsoIn(ep, (uint16_t)frameCount, pkt, UHS_SIM_FIFO_SIZE, &len) != hrSUCCESS) {
+                                        rcode = hrTIMEOUT; // no data packet, there is no NAK
+                                        break;
+                                }
+                                uint8_t b = (rcvHead + rcvFull) & 1;
+                                memcpy(rcvBuf[b], pkt, len);
+                                rcvCount[b] = len;
+                                rcvFull++;
+                                xferData = true;
+                                rcode = hrSUCCESS;
+                                wire += len + 3;
+                                stats.bytesIn += len;
+                                break;
+                        }
+                        case tokISOOUT:
+                        {
+                                uint8_t len = (sndQueued) ? sndCount[sndHead] : 0;
+                                dev->IsoOut(ep, (uint16_t)frameCount, sndBuf[sndHead], len);
+                                if(sndQueued) {
+                                        sndQueued--;
+                                        sndHead ^= 1;
+                                }
+                                rcode = hrSUCCESS; // no handshake, the host can't tell if it arrived
+                                wire += len + 3;
+                                stats.bytesOut += len;
+                                break;
+                        }
+                        default:
+                                rcode = hrTIMEOUT;
+                                break;
+                }
+        }
+
+        if(rcode == hrNAK)
+                stats.xferNaks++;
+        else if(rcode != hrSUCCESS)
+                stats.xferErrors++;
+
+        // A missing device lets the host wait for the bus turnaround timeout
+        uint64_t ns = (rcode == hrTIMEOUT) ? 18 * 1000ULL : PacketNs(wire) + 1000;
+        stats.busNs += ns;
+        hrslResult = rcode;
+        regs[rHIRQ >> 3] &= ~bmHXFRDNIRQ;
+        if(rcode == hrSUCCESS && (token == tokOUT || token == tokISOOUT))
+                regs[rHIRQ >> 3] |= bmSNDBAVIRQ;
+        xferPending = true;
+        xferDoneAt = now + ns;
+}
+
+uint8_t UHSSim::ReadReg(uint8_t reg) {
+        switch(reg) {
+                case rRCVFIFO >> 3:
+                        if(!rcvFull || rcvPtr >= UHS_SIM_FIFO_SIZE)
+                                return 0;
+                        return rcvBuf[rcvHead][rcvPtr++];
+                case rRCVBC >> 3:
+                        return (rcvFull) ? rcvCount[rcvHead] : 0;
+                case rHRSL >> 3:
+                        return hrslResult | ((rcvTog) ? bmRCVTOGRD : 0) | ((sndTog) ? bmSNDTOGRD : 0) | BusState();
+                default:
+                        return regs[reg];
+        }
+}
+
+void UHSSim::WriteReg(uint8_t reg, uint8_t data) {
+        switch(reg) {
+                case rSNDFIFO >> 3:
+                {
+                        uint8_t b = (sndHead + sndQueued) & 1;
+                        if(sndQueued < 2 && sndPtr < UHS_SIM_FIFO_SIZE)
+                                sndBuf[b][sndPtr++] = data;
+                        break;
+                }
+                case rSUDFIFO >> 3:
+                        if(sudPtr < sizeof(sudBuf))
+                                sudBuf[sudPtr++] = data;
+                        break;
+                case rSNDBC >> 3:
+                        if(!data && sndQueued) {
+                                // AN4000: the last buffer handed to the SIE goes back to the CPU with its data,
+                                // the next SNDFIFO writes overwrite it from the start
+                                sndQueued--;
+                                sndPtr = 0;
+                                break;
+                        }
+                        if(sndQueued < 2) {
+                                sndCount[(sndHead + sndQueued) & 1] = data;
+                                sndQueued++;
+                                sndPtr = 0;
+                        }
+                        if(sndQueued == 2)
+                                regs[rHIRQ >> 3] &= ~bmSNDBAVIRQ;
+                        break;
+                case rUSBIRQ >> 3:
+                        regs[reg] &= ~data;
+                        break;
+                case rUSBCTL >> 3:
+                        if((data & bmPWRDOWN) && !(regs[reg] & bmPWRDOWN))
+                                pwrDownAt = now; // Sync() counts the time from here
+                        if(data & bmCHIPRES)
+                                ChipReset();
+                        else if((regs[reg] & (bmCHIPRES | bmPWRDOWN)) && !(data & bmPWRDOWN))
+                                regs[rUSBIRQ >> 3] |= bmOSCOKIRQ; // the oscillator is stable right away
+                        regs[reg] = data;
+                        break;
+                case rHIRQ >> 3:
+                        // SNDBAVIRQ can't be cleared here, RCVDAVIRQ frees the receive buffer
+                        if((data & bmRCVDAVIRQ) && rcvFull) {
+                                rcvFull--;
+                                rcvHead ^= 1;
+                                rcvPtr = 0;
+                                if(!rcvFull)
+                                        regs[reg] &= ~bmRCVDAVIRQ;
+                                data &= ~bmRCVDAVIRQ;
+                        }
+                        regs[reg] &= ~(data & ~bmSNDBAVIRQ);
+                        break;
+                case rHCTL >> 3:
+                        if(data & bmBUSRST) {
+                                resetPending = true;
+                                resetDoneAt = now + BUS_RESET_NS;
+                                rootEnabled = false;
+                        }
+                        if(data & bmSIGRSM) {
+                                resumePending = true;
+                                resumeDoneAt = now + RESUME_NS;
+                        }
+                        if(data & bmFRMRST) {
+                                frameStart = now;
+                                frameCount = 0;
+                        }
+                        if(data & bmRCVTOG0)
+                                rcvTog = 0;
+                        if(data & bmRCVTOG1)
+                                rcvTog = 1;
+                        if(data & bmSNDTOG0)
+                                sndTog = 0;
+                        if(data & bmSNDTOG1)
+                                sndTog = 1;
+                        // BUSRST and SIGRSM read back as set until they are over, SAMPLEBUS completes at once
+                        regs[reg] = (data & (bmBUSRST | bmSAMPLEBUS | bmSIGRSM)) | (regs[reg] & (bmBUSRST | bmSIGRSM));
+                        break;
+                case rHXFR >> 3:
+                        regs[reg] = data;
+                        Transfer(data);
+                        break;
+                case rRCVFIFO >> 3:
+                case rRCVBC >> 3:
+                case rREVISION >> 3:
+                case rHRSL >> 3:
+                        break; // read only
+                default:
+                        regs[reg] = data;
+                        break;
+        }
+}
+
+uint8_t UHSSim::SpiTransfer(uint8_t data) {
+        stats.spiBytes++;
+        now += spiByteNs;
+        Sync();
+
+        if(!selected)
+                return 0xff;
+
+        if(!cmdDone) {
+                cmdDone = true;
+                cmd = data;
+                if((cmd >> 3) == (rSUDFIFO >> 3) && (cmd & 0x02))
+                        sudPtr = 0; // a new setup packet
+                return regs[rHIRQ >> 3]; // full-duplex mode clocks out HIRQ with the command
+        }
+
+        uint8_t reg = cmd >> 3;
+        if(cmd & 0x02) {
+                WriteReg(reg, data);
+                return 0;
+        }
+        return ReadReg(reg);
+}
+
+void UHSSim::PinWrite(uint8_t pin, uint8_t val) {
+        if(pin != ssPin)
+                return;
+
+        if(!val && !selected) {
+                selected = true;
+                cmdDone = false;
+                stats.spiSelects++;
+                now += spiSelectNs;
+        } else if(val)
+                selected = false;
+}
+
+uint8_t UHSSim::PinRead(uint8_t pin) {
+        if(pin != intPin)
+                return HIGH;
+
+        now += 50; // a pin read costs a little, so loops that only watch the pin still see time pass
+        Sync();
+        bool pending = ((regs[rHIRQ >> 3] & regs[rHIEN >> 3]) || (regs[rUSBIRQ >> 3] & regs[rUSBIEN >> 3]));
+        if(!(regs[rCPUCTL >> 3] & bmIE) || !pending)
+                return HIGH;
+        return LOW; // INT is active low, see bmINTLEVEL
+}
@@ -0,0 +1,273 @@
+/* Copyright (C) 2011 Circuits At Home, LTD. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+Contact information
+-------------------
+
+Circuits At Home, LTD
+Web      :  http://www.circuitsathome.com
+e-mail   :  support@circuitsathome.com
+ */
+/* Register-level MAX3421E simulator for host builds, see README.md */
+
+#ifndef UHS_SIM_H
+#define UHS_SIM_H
+
+#include <Usb.h>
+
+#define UHS_SIM_SS_PIN          10      // MAX3421E SS, see UsbCore.h
+#define UHS_SIM_INT_PIN         9       // MAX3421E INT
+#define UHS_SIM_SS_PIN_2        8       // SS of the second MAX3421E, see USE_UHS_MULTI_HOST
+#define UHS_SIM_INT_PIN_2       7       // INT of the second MAX3421E
+#define UHS_SIM_CHIPS           2
+
+#define UHS_SIM_CTRL_BUF        1024    // largest control transfer data stage
+#define UHS_SIM_FIFO_SIZE       64
+#define UHS_SIM_MAX_FAULTS      4
+
+/* Virtual USB device behind the simulated MAX3421E. The base class runs the control pipe and */
+/* answers the standard requests, subclasses supply descriptors and class/endpoint behaviour.  */
+/* Data toggles are followed, not checked, use UHSSim::InjectFault() to get toggle errors.     */
+class UHSSimDevice {
+        friend class UHSSim;
+        friend class UHSSimHub;
+
+public:
+        UHSSimDevice(bool lowspeed_ = false);
+
+        virtual ~UHSSimDevice() {
+        };
+
+        uint8_t GetAddress() {
+                return address;
+        };
+
+        uint8_t GetConfiguration() {
+                return config;
+        };
+
+        bool IsLowSpeed() {
+                return lowspeed;
+        };
+
+protected:
+        // Returns the descriptor of 'type' and 'index', NULL if there is none
+        virtual const uint8_t* GetDescriptor(uint8_t type, uint8_t index, uint16_t *len) = 0;
+
+        // Class and vendor requests. IN requests put up to 'len' bytes into 'data' and update
+        // 'len'. OUT requests get the data stage in 'data'. Return hrSUCCESS or hrSTALL
+        virtual uint8_t ClassRequest(const SETUP_PKT *setup __attribute__((unused)), uint8_t *data __attribute__((unused)), uint16_t *len __attribute__((unused))) {
+                return hrSTALL;
+        };
+
+        // Bulk and interrupt endpoints, 'ep' is the endpoint number. Return hrSUCCESS, hrNAK or hrSTALL
+        virtual uint8_t EpIn(uint8_t ep __attribute__((unused)), uint8_t *buf __attribute__((unused)), uint8_t maxlen __attribute__((unused)), uint8_t *len __attribute__((unused))) {
+                return hrNAK;
+        };
+
+        virtual uint8_t EpOut(uint8_t ep __attribute__((unused)), const uint8_t *buf __attribute__((unused)), uint8_t len __attribute__((unused))) {
+                return hrSUCCESS;
+        };
+
+        // Isochronous endpoints, 'frame' is the number of the bus frame. IsoIn() returns hrSUCCESS with
+        // the packet, anything else means the device does not answer. OUT packets are not handshaked
+        virtual uint8_t IsoIn(uint8_t ep __attribute__((unused)), uint16_t frame __attribute__((unused)), uint8_t *buf __attribute__((unused)), uint8_t maxlen __attribute__((unused)), uint8_t *len __attribute__((unused))) {
+                return hrTIMEOUT;
+        };
+
+        virtual void IsoOut(uint8_t ep __attribute__((unused)), uint16_t frame __attribute__((unused)), const uint8_t *buf __attribute__((unused)), uint8_t len __attribute__((unused))) {
+        };
+
+        virtual void SetConfiguration(uint8_t conf __attribute__((unused))) {
+        };
+
+        // Bus or port reset
+        virtual void Reset() {
+        };
+
+        // Finds the device with address 'addr' at or below this one
+        virtual UHSSimDevice* Route(uint8_t addr);
+
+        bool lowspeed;
+
+private:
+        uint8_t Setup(const uint8_t *pkt);
+        uint8_t In(uint8_t ep, uint8_t *buf, uint8_t *len);
+        uint8_t Out(uint8_t ep, const uint8_t *buf, uint8_t len);
+        uint8_t StatusIn();
+        uint8_t StatusOut();
+        void BusReset();
+        uint8_t Request(uint8_t *data, uint16_t *len);
+        uint8_t MaxPacketSize0();
+
+        uint8_t address;
+        uint8_t pendingAddress;
+        uint8_t config;
+        uint8_t ctrlState;
+        SETUP_PKT setup;
+        uint16_t ctrlLen;
+        uint16_t ctrlPos;
+        uint8_t ctrlBuf[UHS_SIM_CTRL_BUF];
+};
+
+/* Bus and SPI activity, see UHSSim::GetStats() */
+struct UHSSimStats {
+        uint32_t spiSelects; // SS cycles
+        uint32_t spiBytes; // bytes clocked, command bytes included
+        uint32_t xfers; // HXFR launches
+        uint32_t xferNaks; // of which answered with NAK
+        uint32_t xferErrors; // of which failed otherwise
+        uint32_t bytesIn; // data bytes received from devices
+        uint32_t bytesOut; // data bytes sent to devices
+        uint64_t busNs; // time the USB was busy with transactions
+        uint64_t pwrDownNs; // time the oscillator was stopped
+};
+
+/* The MAX3421E, its SPI port, the INT pin and the clock of the host build. Instance(1) is a */
+/* second chip on UHS_SIM_SS_PIN_2 and UHS_SIM_INT_PIN_2, the clock is shared.             */
+class UHSSim {
+public:
+        static UHSSim& Instance(uint8_t chip = 0);
+
+        /* Clock, in nanoseconds since start */
+        uint64_t Now() {
+                return now;
+        };
+        void Advance(uint64_t ns);
+
+        /* Timing model. The defaults are a 26MHz SPI clock and a full-speed bus */
+        void SetSpiTiming(uint32_t byteNs, uint32_t selectNs) {
+                spiByteNs = byteNs;
+                spiSelectNs = selectNs;
+        };
+
+        /* SCK in Hz, what SPIClass::beginTransaction() was given */
+        void SetSpiClock(uint32_t hz) {
+                spiByteNs = (8000000000ULL + hz - 1) / hz;
+        };
+
+        /* Device on the root port. Attaching replaces the current one */
+        void Attach(UHSSimDevice *dev);
+        void Detach();
+
+        /* The device on the root port signals remote wakeup. Returns false if the bus is not suspended */
+        bool RemoteWakeup();
+
+        /* The next 'count' transactions to 'ep' of device 'addr' end with 'hrslt' instead */
+        /* of reaching the device, e.g. hrNAK, hrSTALL, hrTOGERR or hrTIMEOUT. A STALL is   */
+        /* a halt, CLEAR_FEATURE(ENDPOINT_HALT) to the endpoint ends it early.              */
+        bool InjectFault(uint8_t addr, uint8_t ep, uint8_t hrslt, uint16_t count);
+
+        const UHSSimStats& GetStats() {
+                return stats;
+        };
+
+        void ResetStats() {
+                memset(&stats, 0, sizeof(stats));
+        };
+
+        /* Run until the simulated clock reaches 'ms', main() checks this after every loop() */
+        void SetRunTime(uint32_t ms) {
+                runUntil = (uint64_t)ms * 1000000ULL;
+        };
+
+        bool Expired() {
+                return runUntil && now >= runUntil;
+        };
+
+        /* Arduino core glue, pins that belong to another chip are ignored */
+        void PinWrite(uint8_t pin, uint8_t val);
+        uint8_t PinRead(uint8_t pin);
+        uint8_t SpiTransfer(uint8_t data);
+
+        bool IsSelected() {
+                return selected;
+        };
+
+private:
+        UHSSim(uint8_t ss, uint8_t intr);
+
+        void Sync();
+        void ChipReset();
+        uint8_t ReadReg(uint8_t reg);
+        void WriteReg(uint8_t reg, uint8_t data);
+        void Transfer(uint8_t hxfr);
+        void ClearHalt(uint8_t addr, uint8_t ep);
+        uint8_t BusState();
+        bool SofRunning();
+        uint64_t PacketNs(uint16_t bytes);
+
+        static uint64_t now;
+        uint64_t runUntil;
+        uint8_t ssPin;
+        uint8_t intPin;
+        uint32_t spiByteNs;
+        uint32_t spiSelectNs;
+
+        // SPI framing
+        bool selected;
+        bool cmdDone;
+        uint8_t cmd;
+
+        // Register file, indexed by register number
+        uint8_t regs[32];
+        uint8_t hrslResult;
+        uint8_t rcvTog;
+        uint8_t sndTog;
+
+        // Receive FIFO, two buffers
+        uint8_t rcvBuf[2][UHS_SIM_FIFO_SIZE];
+        uint8_t rcvCount[2];
+        uint8_t rcvFull; // number of buffers holding data
+        uint8_t rcvHead; // buffer the CPU reads from
+        uint8_t rcvPtr;
+
+        // Send FIFO, two buffers
+        uint8_t sndBuf[2][UHS_SIM_FIFO_SIZE];
+        uint8_t sndCount[2];
+        uint8_t sndQueued; // buffers handed to the SIE
+        uint8_t sndHead; // buffer the SIE sends next
+        uint8_t sndPtr; // write pointer into the CPU buffer
+
+        uint8_t sudBuf[8];
+        uint8_t sudPtr;
+
+        // Pending events
+        bool xferPending;
+        uint64_t xferDoneAt;
+        bool xferData; // completed transfer delivered a packet into the receive FIFO
+        bool resetPending;
+        uint64_t resetDoneAt;
+        bool resumePending;
+        uint64_t resumeDoneAt;
+        uint64_t pwrDownAt;
+        uint64_t frameStart;
+        uint32_t frameCount;
+
+        UHSSimDevice *root;
+        bool rootEnabled;
+
+        struct {
+                uint8_t addr;
+                uint8_t ep;
+                uint8_t hrslt;
+                uint16_t count;
+        } faults[UHS_SIM_MAX_FAULTS];
+
+        UHSSimStats stats;
+};
+
+#endif /* UHS_SIM_H */
@@ -0,0 +1,283 @@
+/* Copyright (C) 2011 Circuits At Home, LTD. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+Contact information
+-------------------
+
+Circuits At Home, LTD
+Web      :  http://www.circuitsathome.com
+e-mail   :  support@circuitsathome.com
+ */
+/* Arduino core for host builds: clock, pins, SPI and Serial on top of the simulator */
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "UHS_sim.h"
+
+#define SIM_CALL_NS     100     // cost of a millis() or micros() call, so polling loops see time pass
+
+SPIClass SPI;
+HardwareSerial Serial;
+
+unsigned long millis(void) {
+        UHSSim::Instance().Advance(SIM_CALL_NS);
+        return (unsigned long)(UHSSim::Instance().Now() / 1000000ULL);
+}
+
+unsigned long micros(void) {
+        UHSSim::Instance().Advance(SIM_CALL_NS);
+        return (unsigned long)(UHSSim::Instance().Now() / 1000ULL);
+}
+
+void delay(unsigned long ms) {
+        UHSSim::Instance().Advance((uint64_t)ms * 1000000ULL);
+}
+
+void delayMicroseconds(unsigned int us) {
+        UHSSim::Instance().Advance((uint64_t)us * 1000ULL);
+}
+
+void yield(void) {
+}
+
+void pinMode(uint8_t pin __attribute__((unused)), uint8_t mode __attribute__((unused))) {
+}
+
+void digitalWrite(uint8_t pin, uint8_t val) {
+        for(uint8_t i = 0; i < UHS_SIM_CHIPS; i++)
+                UHSSim::Instance(i).PinWrite(pin, val);
+}
+
+int digitalRead(uint8_t pin) {
+        for(uint8_t i = 0; i < UHS_SIM_CHIPS; i++)
+                if(UHSSim::Instance(i).PinRead(pin) == LOW)
+                        return LOW;
+        return HIGH;
+}
+
+long random(long howbig) {
+        return (howbig) ? rand() % howbig : 0;
+}
+
+long random(long howsmall, long howbig) {
+        return (howsmall >= howbig) ? howsmall : random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed) {
+        srand(seed);
+}
+
+void interrupts(void) {
+}
+
+void noInterrupts(void) {
+}
+
+/* SPI, the bytes go to the chip that is selected */
+static UHSSim& SpiChip() {
+        for(uint8_t i = 1; i < UHS_SIM_CHIPS; i++)
+                if(UHSSim::Instance(i).IsSelected())
+                        return UHSSim::Instance(i);
+        return UHSSim::Instance();
+}
+
+/* The clock of the transaction sets the byte time of both chips, they share the bus */
+void SPIClass::beginTransaction(SPISettings settings) {
+        for(uint8_t i = 0; i < UHS_SIM_CHIPS; i++)
+                UHSSim::Instance(i).SetSpiClock(settings.clock);
+}
+
+void SPIClass::endTransaction() {
+}
+
+uint8_t SPIClass::transfer(uint8_t data) {
+        return SpiChip().SpiTransfer(data);
+}
+
+void SPIClass::transfer(void *buf, size_t count) {
+        uint8_t *p = (uint8_t *)buf;
+        while(count--) {
+                *p = SpiChip().SpiTransfer(*p);
+                p++;
+        }
+}
+
+/* Print */
+size_t Print::write(const uint8_t *buffer, size_t size) {
+        size_t n = 0;
+        while(size--)
+                n += write(*buffer++);
+        return n;
+}
+
+size_t Print::printNumber(unsigned long n, uint8_t base) {
+        char buf[8 * sizeof(long) + 1];
+        char *str = &buf[sizeof(buf) - 1];
+
+        if(base < 2)
+                base = 10;
+        *str = '\0';
+        do {
+                char c = n % base;
+                n /= base;
+                *--str = c < 10 ? c + '0' : c + 'A' - 10;
+        } while(n);
+        return write(str);
+}
+
+size_t Print::print(const __FlashStringHelper *str) {
+        return write((const char *)str);
+}
+
+size_t Print::print(const char str[]) {
+        return write(str);
+}
+
+size_t Print::print(char c) {
+        return write((uint8_t)c);
+}
+
+size_t Print::print(unsigned char n, int base) {
+        return print((unsigned long)n, base);
+}
+
+size_t Print::print(int n, int base) {
+        return print((long)n, base);
+}
+
+size_t Print::print(unsigned int n, int base) {
+        return print((unsigned long)n, base);
+}
+
+size_t Print::print(long n, int base) {
+        if(base == 10 && n < 0)
+                return write('-') + printNumber(-n, 10);
+        if(base == 0)
+                return write((uint8_t)n);
+        return printNumber(n, base);
+}
+
+size_t Print::print(unsigned long n, int base) {
+        if(base == 0)
+                return write((uint8_t)n);
+        return printNumber(n, base);
+}
+
+size_t Print::print(double n, int digits) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.*f", digits, n);
+        return write(buf);
+}
+
+size_t Print::println(void) {
+        return write("\r\n");
+}
+
+size_t Print::println(const __FlashStringHelper *str) {
+        return print(str) + println();
+}
+
+size_t Print::println(const char str[]) {
+        return print(str) + println();
+}
+
+size_t Print::println(char c) {
+        return print(c) + println();
+}
+
+size_t Print::println(unsigned char n, int base) {
+        return print(n, base) + println();
+}
+
+size_t Print::println(int n, int base) {
+        return print(n, base) + println();
+}
+
+size_t Print::println(unsigned int n, int base) {
+        return print(n, base) + println();
+}
+
+size_t Print::println(long n, int base) {
+        return print(n, base) + println();
+}
+
+size_t Print::println(unsigned long n, int base) {
+        return print(n, base) + println();
+}
+
+size_t Print::println(double n, int digits) {
+        return print(n, digits) + println();
+}
+
+/* Serial */
+static int serialPeek = -1;
+
+void HardwareSerial::begin(unsigned long baud __attribute__((unused))) {
+        fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_NONBLOCK);
+}
+
+int HardwareSerial::available() {
+        return (peek() < 0) ? 0 : 1;
+}
+
+int HardwareSerial::peek() {
+        if(serialPeek < 0) {
+                uint8_t c;
+                if(::read(STDIN_FILENO, &c, 1) == 1)
+                        serialPeek = c;
+        }
+        return serialPeek;
+}
+
+int HardwareSerial::read() {
+        int c = peek();
+        serialPeek = -1;
+        return c;
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+        if(c == '\r')
+                return 1; // the terminal wants plain newlines
+        putchar(c);
+        return 1;
+}
+
+void HardwareSerial::flush() {
+        fflush(stdout);
+}
+
+/* Runs the sketch until the simulated time set with -t or UHS_SIM_TIME (in ms) is reached */
+int main(int argc, char **argv) {
+        uint32_t ms = 10000;
+        const char *env = getenv("UHS_SIM_TIME");
+
+        if(env)
+                ms = strtoul(env, NULL, 0);
+        for(int i = 1; i < argc - 1; i++) {
+                if(!strcmp(argv[i], "-t"))
+                        ms = strtoul(argv[i + 1], NULL, 0);
+        }
+        UHSSim::Instance().SetRunTime(ms);
+
+        setup();
+        while(!UHSSim::Instance().Expired())
+                loop();
+        fflush(stdout);
+        return 0;
+}
@@ -0,0 +1,580 @@
+/* Copyright (C) 2011 Circuits At Home, LTD. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+Contact information
+-------------------
+
+Circuits At Home, LTD
+Web      :  http://www.circuitsathome.com
+e-mail   :  support@circuitsathome.com
+ */
+/* Virtual devices for the MAX3421E simulator */
+
+#include "UHS_simdev.h"
+#include <usbhub.h>
+#include <usbhid.h>
+#include <cdcacm.h>
+
+/* Queue */
+bool UHSSimQueue::Put(const uint8_t *data, uint16_t len) {
+        if(count + len > UHS_SIM_QUEUE_SIZE)
+                return false;
+        for(uint16_t i = 0; i < len; i++)
+                buf[(head + count + i) % UHS_SIM_QUEUE_SIZE] = data[i];
+        count += len;
+        return true;
+}
+
+uint16_t UHSSimQueue::Get(uint8_t *data, uint16_t len) {
+        if(len > count)
+                len = count;
+        for(uint16_t i = 0; i < len; i++)
+                data[i] = buf[(head + i) % UHS_SIM_QUEUE_SIZE];
+        head = (head + len) % UHS_SIM_QUEUE_SIZE;
+        count -= len;
+        return len;
+}
+
+static const uint8_t* StringDescriptor(uint8_t index, uint16_t *len, const char *product) {
+        static uint8_t desc[2 + 2 * 32];
+        uint8_t n = 0;
+
+        if(index == 0) {
+                // Supported languages, US English
+                desc[0] = 4;
+                desc[1] = USB_DESCRIPTOR_STRING;
+                desc[2] = 0x09;
+                desc[3] = 0x04;
+                *len = 4;
+                return desc;
+        }
+        const char *str = (index == 1) ? "Circuits At Home" : product;
+        for(; str[n] && n < 32; n++) {
+                desc[2 + 2 * n] = str[n];
+                desc[3 + 2 * n] = 0;
+        }
+        desc[0] = 2 + 2 * n;
+        desc[1] = USB_DESCRIPTOR_STRING;
+        *len = desc[0];
+        return desc;
+}
+
+/* Hub */
+static const uint8_t hubDevDesc[] = {
+        18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, 0x09, 0x00, 0x00, 64,
+        0x51, 0x04, 0x46, 0x20, 0x00, 0x01, 1, 2, 0, 1
+};
+
+static const uint8_t hubConfDesc[] = {
+        9, USB_DESCRIPTOR_CONFIGURATION, 25, 0, 1, 1, 0, 0xe0, 50,
+        9, USB_DESCRIPTOR_INTERFACE, 0, 0, 1, 0x09, 0x00, 0x00, 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x81, USB_TRANSFER_TYPE_INTERRUPT, 1, 0, 12
+};
+
+static const uint8_t hubClassDesc[] = {
+        9, 0x29, UHS_SIM_HUB_PORTS, 0x09, 0x00, 50, 100, 0x00, 0xff
+};
+
+UHSSimHub::UHSSimHub() : UHSSimDevice(false) {
+        memset(ports, 0, sizeof(ports));
+        Reset();
+}
+
+void UHSSimHub::Reset() {
+        // Ports lose power with the hub
+        for(uint8_t i = 0; i < UHS_SIM_HUB_PORTS; i++) {
+                portStatus[i] = 0;
+                portChange[i] = 0;
+        }
+}
+
+void UHSSimHub::Attach(uint8_t port, UHSSimDevice *dev) {
+        if(port < 1 || port > UHS_SIM_HUB_PORTS)
+                return;
+
+        uint8_t i = port - 1;
+        ports[i] = dev;
+        if(!(portStatus[i] & bmHUB_PORT_STATUS_PORT_POWER))
+                return;
+        if(!dev && !(portStatus[i] & bmHUB_PORT_STATUS_PORT_CONNECTION))
+                return;
+        if(dev) {
+                dev->BusReset();
+                portStatus[i] |= bmHUB_PORT_STATUS_PORT_CONNECTION;
+        } else
+                portStatus[i] &= ~(bmHUB_PORT_STATUS_PORT_CONNECTION | bmHUB_PORT_STATUS_PORT_ENABLE | bmHUB_PORT_STATUS_PORT_LOW_SPEED);
+        portChange[i] |= bmHUB_PORT_STATUS_C_PORT_CONNECTION;
+}
+
+UHSSimDevice* UHSSimHub::Route(uint8_t addr) {
+        if(GetAddress() == addr)
+                return this;
+        for(uint8_t i = 0; i < UHS_SIM_HUB_PORTS; i++) {
+                if(!ports[i] || !(portStatus[i] & bmHUB_PORT_STATUS_PORT_ENABLE))
+                        continue;
+                UHSSimDevice *dev = ports[i]->Route(addr);
+                if(dev)
+                        return dev;
+        }
+        return NULL;
+}
+
+const uint8_t* UHSSimHub::GetDescriptor(uint8_t type, uint8_t index, uint16_t *len) {
+        switch(type) {
+                case USB_DESCRIPTOR_DEVICE:
+                        *len = sizeof(hubDevDesc);
+                        return hubDevDesc;
+                case USB_DESCRIPTOR_CONFIGURATION:
+                        *len = sizeof(hubConfDesc);
+                        return hubConfDesc;
+                case USB_DESCRIPTOR_STRING:
+                        return StringDescriptor(index, len, "Simulated hub");
+                default:
+                        return NULL;
+        }
+}
+
+uint8_t UHSSimHub::ClassRequest(const SETUP_PKT *setup, uint8_t *data, uint16_t *len) {
+        uint8_t recipient = setup->ReqType_u.bmRequestType & 0x1f;
+        uint8_t port = setup->wIndex;
+        uint8_t feature = setup->wVal_u.wValueLo;
+
+        if(recipient == USB_SETUP_RECIPIENT_DEVICE) {
+                switch(setup->bRequest) {
+                        case USB_REQUEST_GET_DESCRIPTOR:
+                                if(*len > sizeof(hubClassDesc))
+                                        *len = sizeof(hubClassDesc);
+                                memcpy(data, hubClassDesc, *len);
+                                return hrSUCCESS;
+                        case USB_REQUEST_GET_STATUS:
+                                if(*len > 4)
+                                        *len = 4;
+                                memset(data, 0, *len);
+                                return hrSUCCESS;
+                        case USB_REQUEST_CLEAR_FEATURE:
+                        case USB_REQUEST_SET_FEATURE:
+                                return hrSUCCESS;
+                        default:
+                                return hrSTALL;
+                }
+        }
+
+        if(recipient != USB_SETUP_RECIPIENT_OTHER || port < 1 || port > UHS_SIM_HUB_PORTS)
+                return hrSTALL;
+
+        uint8_t i = port - 1;
+        switch(setup->bRequest) {
+                case USB_REQUEST_GET_STATUS:
+                        if(*len > 4)
+                                *len = 4;
+                        data[0] = portStatus[i] & 0xff;
+                        data[1] = portStatus[i] >> 8;
+                        data[2] = portChange[i] & 0xff;
+                        data[3] = portChange[i] >> 8;
+                        return hrSUCCESS;
+                case USB_REQUEST_SET_FEATURE:
+                        if(feature == HUB_FEATURE_PORT_POWER && !(portStatus[i] & bmHUB_PORT_STATUS_PORT_POWER)) {
+                                portStatus[i] |= bmHUB_PORT_STATUS_PORT_POWER;
+                                Attach(port, ports[i]);
+                        } else if(feature == HUB_FEATURE_PORT_RESET && (portStatus[i] & bmHUB_PORT_STATUS_PORT_CONNECTION)) {
+                                // The reset completes at once, the driver polls for it anyway
+                                ports[i]->BusReset();
+                                portStatus[i] |= bmHUB_PORT_STATUS_PORT_ENABLE;
+                                if(ports[i]->IsLowSpeed())
+                                        portStatus[i] |= bmHUB_PORT_STATUS_PORT_LOW_SPEED;
+                                portChange[i] |= bmHUB_PORT_STATUS_C_PORT_RESET;
+                        } else if(feature == HUB_FEATURE_PORT_SUSPEND)
+                                portStatus[i] |= bmHUB_PORT_STATUS_PORT_SUSPEND;
+                        return hrSUCCESS;
+                case USB_REQUEST_CLEAR_FEATURE:
+                        if(feature >= HUB_FEATURE_C_PORT_CONNECTION && feature <= HUB_FEATURE_C_PORT_RESET)
+                                portChange[i] &= ~(1 << (feature - HUB_FEATURE_C_PORT_CONNECTION));
+                        else if(feature == HUB_FEATURE_PORT_ENABLE)
+                                portStatus[i] &= ~(bmHUB_PORT_STATUS_PORT_ENABLE | bmHUB_PORT_STATUS_PORT_LOW_SPEED);
+                        else if(feature == HUB_FEATURE_PORT_SUSPEND)
+                                portStatus[i] &= ~bmHUB_PORT_STATUS_PORT_SUSPEND;
+                        else if(feature == HUB_FEATURE_PORT_POWER)
+                                portStatus[i] = 0;
+                        return hrSUCCESS;
+                default:
+                        return hrSTALL;
+        }
+}
+
+uint8_t UHSSimHub::EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen __attribute__((unused)), uint8_t *len) {
+        if(ep != 1)
+                return hrSTALL;
+
+        // Status change bitmap, bit 0 is the hub itself
+        uint8_t bitmap = 0;
+        for(uint8_t i = 0; i < UHS_SIM_HUB_PORTS; i++) {
+                if(portChange[i])
+                        bitmap |= 1 << (i + 1);
+        }
+        if(!bitmap)
+                return hrNAK;
+        buf[0] = bitmap;
+        *len = 1;
+        return hrSUCCESS;
+}
+
+/* Keyboard */
+static const uint8_t kbdDevDesc[] = {
+        18, USB_DESCRIPTOR_DEVICE, 0x10, 0x01, 0x00, 0x00, 0x00, 8,
+        0x6d, 0x04, 0x1c, 0xc3, 0x00, 0x01, 1, 2, 0, 1
+};
+
+static const uint8_t kbdReportDesc[] = {
+        0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01,
+        0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01,
+        0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+        0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xc0
+};
+
+static const uint8_t kbdConfDesc[] = {
+        9, USB_DESCRIPTOR_CONFIGURATION, 34, 0, 1, 1, 0, 0xa0, 50,
+        9, USB_DESCRIPTOR_INTERFACE, 0, 0, 1, 0x03, 0x01, 0x01, 0,
+        9, HID_DESCRIPTOR_HID, 0x11, 0x01, 0, 1, HID_DESCRIPTOR_REPORT, sizeof(kbdReportDesc), 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x81, USB_TRANSFER_TYPE_INTERRUPT, 8, 0, 10
+};
+
+UHSSimKeyboard::UHSSimKeyboard() : UHSSimDevice(true) {
+        Reset();
+}
+
+void UHSSimKeyboard::Reset() {
+        reports.Clear();
+        protocol = HID_RPT_PROTOCOL;
+        leds = 0;
+}
+
+void UHSSimKeyboard::Type(const char *str) {
+        for(; *str; str++) {
+                uint8_t report[8] = {0};
+                char c = *str;
+
+                if(c >= 'a' && c <= 'z')
+                        report[2] = 0x04 + c - 'a';
+                else if(c >= 'A' && c <= 'Z') {
+                        report[0] = 0x02; // left shift
+                        report[2] = 0x04 + c - 'A';
+                } else if(c >= '1' && c <= '9')
+                        report[2] = 0x1e + c - '1';
+                else if(c == '0')
+                        report[2] = 0x27;
+                else if(c == '\n')
+                        report[2] = 0x28;
+                else if(c == ' ')
+                        report[2] = 0x2c;
+                else
+                        continue;
+                reports.Put(report, sizeof(report));
+                memset(report, 0, sizeof(report));
+                reports.Put(report, sizeof(report));
+        }
+}
+
+const uint8_t* UHSSimKeyboard::GetDescriptor(uint8_t type, uint8_t index, uint16_t *len) {
+        switch(type) {
+                case USB_DESCRIPTOR_DEVICE:
+                        *len = sizeof(kbdDevDesc);
+                        return kbdDevDesc;
+                case USB_DESCRIPTOR_CONFIGURATION:
+                        *len = sizeof(kbdConfDesc);
+                        return kbdConfDesc;
+                case USB_DESCRIPTOR_STRING:
+                        return StringDescriptor(index, len, "Simulated keyboard");
+                case HID_DESCRIPTOR_REPORT:
+                        *len = sizeof(kbdReportDesc);
+                        return kbdReportDesc;
+                default:
+                        return NULL;
+        }
+}
+
+uint8_t UHSSimKeyboard::ClassRequest(const SETUP_PKT *setup, uint8_t *data, uint16_t *len) {
+        switch(setup->bRequest) {
+                case HID_REQUEST_SET_IDLE:
+                        return hrSUCCESS;
+                case HID_REQUEST_SET_PROTOCOL:
+                        protocol = setup->wVal_u.wValueLo;
+                        return hrSUCCESS;
+                case HID_REQUEST_GET_PROTOCOL:
+                        *len = 1;
+                        data[0] = protocol;
+                        return hrSUCCESS;
+                case HID_REQUEST_SET_REPORT:
+                        if(*len)
+                                leds = data[0];
+                        return hrSUCCESS;
+                default:
+                        return hrSTALL;
+        }
+}
+
+uint8_t UHSSimKeyboard::EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen __attribute__((unused)), uint8_t *len) {
+        if(ep != 1)
+                return hrSTALL;
+        if(reports.Count() < 8)
+                return hrNAK;
+        *len = reports.Get(buf, 8);
+        return hrSUCCESS;
+}
+
+/* CDC ACM */
+static const uint8_t acmDevDesc[] = {
+        18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, 0x02, 0x00, 0x00, 64,
+        0x41, 0x23, 0x43, 0x00, 0x00, 0x01, 1, 2, 0, 1
+};
+
+static const uint8_t acmConfDesc[] = {
+        9, USB_DESCRIPTOR_CONFIGURATION, 67, 0, 2, 1, 0, 0xc0, 50,
+        9, USB_DESCRIPTOR_INTERFACE, 0, 0, 1, 0x02, 0x02, 0x01, 0,
+        5, 0x24, 0x00, 0x10, 0x01, // header
+        5, 0x24, 0x01, 0x00, 0x01, // call management
+        4, 0x24, 0x02, 0x02, // ACM, line coding and state
+        5, 0x24, 0x06, 0x00, 0x01, // union
+        7, USB_DESCRIPTOR_ENDPOINT, 0x83, USB_TRANSFER_TYPE_INTERRUPT, 8, 0, 255,
+        9, USB_DESCRIPTOR_INTERFACE, 1, 0, 2, 0x0a, 0x00, 0x00, 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x02, USB_TRANSFER_TYPE_BULK, 64, 0, 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x81, USB_TRANSFER_TYPE_BULK, 64, 0, 0
+};
+
+UHSSimCdcAcm::UHSSimCdcAcm() : UHSSimDevice(false) {
+        Reset();
+}
+
+void UHSSimCdcAcm::Reset() {
+        static const uint8_t defaults[7] = {0x80, 0x25, 0x00, 0x00, 0, 0, 8}; // 9600 8N1
+
+        loop.Clear();
+        memcpy(lineCoding, defaults, sizeof(lineCoding));
+        lineState = 0;
+}
+
+const uint8_t* UHSSimCdcAcm::GetDescriptor(uint8_t type, uint8_t index, uint16_t *len) {
+        switch(type) {
+                case USB_DESCRIPTOR_DEVICE:
+                        *len = sizeof(acmDevDesc);
+                        return acmDevDesc;
+                case USB_DESCRIPTOR_CONFIGURATION:
+                        *len = sizeof(acmConfDesc);
+                        return acmConfDesc;
+                case USB_DESCRIPTOR_STRING:
+                        return StringDescriptor(index, len, "Simulated modem");
+                default:
+                        return NULL;
+        }
+}
+
+uint8_t UHSSimCdcAcm::ClassRequest(const SETUP_PKT *setup, uint8_t *data, uint16_t *len) {
+        switch(setup->bRequest) {
+                case CDC_SET_LINE_CODING:
+                        if(*len < sizeof(lineCoding))
+                                return hrSTALL;
+                        memcpy(lineCoding, data, sizeof(lineCoding));
+                        return hrSUCCESS;
+                case CDC_GET_LINE_CODING:
+                        if(*len > sizeof(lineCoding))
+                                *len = sizeof(lineCoding);
+                        memcpy(data, lineCoding, *len);
+                        return hrSUCCESS;
+                case CDC_SET_CONTROL_LINE_STATE:
+                        lineState = setup->wVal_u.wValueLo;
+                        return hrSUCCESS;
+                default:
+                        return hrSTALL;
+        }
+}
+
+uint8_t UHSSimCdcAcm::EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen, uint8_t *len) {
+        if(ep == 3)
+                return hrNAK; // no serial state notifications
+        if(ep != 1)
+                return hrSTALL;
+        if(!loop.Count())
+                return hrNAK;
+        *len = loop.Get(buf, maxlen);
+        return hrSUCCESS;
+}
+
+uint8_t UHSSimCdcAcm::EpOut(uint8_t ep, const uint8_t *buf, uint8_t len) {
+        if(ep != 2)
+                return hrSTALL;
+        // Flow control: the data is not taken until the host has read the earlier data back
+        return (loop.Put(buf, len)) ? hrSUCCESS : hrNAK;
+}
+
+/* Bluetooth dongle */
+static const uint8_t btDevDesc[] = {
+        18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, 0xe0, 0x01, 0x01, 64,
+        0x12, 0x0a, 0x01, 0x00, 0x00, 0x01, 1, 2, 0, 1
+};
+
+static const uint8_t btConfDesc[] = {
+        9, USB_DESCRIPTOR_CONFIGURATION, 39, 0, 1, 1, 0, 0xe0, 50,
+        9, USB_DESCRIPTOR_INTERFACE, 0, 0, 3, 0xe0, 0x01, 0x01, 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x81, USB_TRANSFER_TYPE_INTERRUPT, 16, 0, 1,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x82, USB_TRANSFER_TYPE_BULK, 64, 0, 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x02, USB_TRANSFER_TYPE_BULK, 64, 0, 0
+};
+
+UHSSimBtDongle::UHSSimBtDongle() : UHSSimDevice(false), eventLeft(0) {
+}
+
+void UHSSimBtDongle::Reset() {
+        events.Clear();
+        eventLeft = 0;
+}
+
+void UHSSimBtDongle::Event(uint8_t code, const uint8_t *params, uint8_t len) {
+        uint8_t hdr[2] = {code, len};
+
+        if(events.Count() + 2 + len > UHS_SIM_QUEUE_SIZE)
+                return; // the host is not reading events, drop it like a real controller would
+        events.Put(hdr, 2);
+        events.Put(params, len);
+}
+
+const uint8_t* UHSSimBtDongle::GetDescriptor(uint8_t type, uint8_t index, uint16_t *len) {
+        switch(type) {
+                case USB_DESCRIPTOR_DEVICE:
+                        *len = sizeof(btDevDesc);
+                        return btDevDesc;
+                case USB_DESCRIPTOR_CONFIGURATION:
+                        *len = sizeof(btConfDesc);
+                        return btConfDesc;
+                case USB_DESCRIPTOR_STRING:
+                        return StringDescriptor(index, len, "Simulated Bluetooth dongle");
+                default:
+                        return NULL;
+        }
+}
+
+uint8_t UHSSimBtDongle::ClassRequest(const SETUP_PKT *setup, uint8_t *data, uint16_t *len) {
+        // HCI commands come in over the control pipe: opcode, parameter length, parameters
+        if((setup->ReqType_u.bmRequestType & 0x80) || *len < 3)
+                return hrSTALL;
+
+        uint8_t opLo = data[0], opHi = data[1];
+        uint8_t ogf = opHi >> 2;
+        uint8_t params[12] = {1, opLo, opHi, 0}; // one command allowed, opcode, status
+
+        if(ogf == 0x01) {
+                // Link control commands only get Command Status, their results would need a radio
+                uint8_t status[4] = {0, 1, opLo, opHi};
+                Event(0x0f, status, sizeof(status));
+                return hrSUCCESS;
+        }
+
+        uint8_t n = 4;
+        if(opHi == 0x10 && opLo == 0x09) {
+                // Read BD_ADDR
+                static const uint8_t bdaddr[6] = {0x56, 0x34, 0x12, 0xef, 0xcd, 0xab};
+                memcpy(params + n, bdaddr, sizeof(bdaddr));
+                n += sizeof(bdaddr);
+        } else if(opHi == 0x10 && opLo == 0x01) {
+                // Read Local Version Information, Bluetooth 2.1
+                static const uint8_t version[8] = {0x04, 0x00, 0x00, 0x04, 0x0a, 0x00, 0x00, 0x00};
+                memcpy(params + n, version, sizeof(version));
+                n += sizeof(version);
+        }
+        Event(0x0e, params, n);
+        return hrSUCCESS;
+}
+
+uint8_t UHSSimBtDongle::EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen, uint8_t *len) {
+        if(ep == 2)
+                return hrNAK; // no ACL data without a radio
+        if(ep != 1)
+                return hrSTALL;
+        if(!events.Count())
+                return hrNAK;
+        // An event may take several packets, but a packet never holds parts of two events
+        if(!eventLeft)
+                eventLeft = 2 + events.Peek(1);
+        if(maxlen > 16)
+                maxlen = 16; // wMaxPacketSize of the event endpoint
+        if(maxlen > eventLeft)
+                maxlen = eventLeft;
+        *len = events.Get(buf, maxlen);
+        eventLeft -= *len;
+        return hrSUCCESS;
+}
+
+/* Streaming sensor */
+static const uint8_t isoDevDesc[] = {
+        18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, 0xff, 0x00, 0x00, 64,
+        0x09, 0x12, 0x02, 0x00, 0x00, 0x01, 1, 2, 0, 1
+};
+
+static const uint8_t isoConfDesc[] = {
+        9, USB_DESCRIPTOR_CONFIGURATION, 32, 0, 1, 1, 0, 0x80, 50,
+        9, USB_DESCRIPTOR_INTERFACE, 0, 0, 2, 0xff, 0x00, 0x00, 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x81, USB_TRANSFER_TYPE_ISOCHRONOUS, UHS_SIM_ISO_PACKET, 0, 1,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x02, USB_TRANSFER_TYPE_ISOCHRONOUS, UHS_SIM_ISO_PACKET, 0, 1
+};
+
+UHSSimIsoSensor::UHSSimIsoSensor() : UHSSimDevice(false) {
+        Reset();
+}
+
+void UHSSimIsoSensor::Reset() {
+        lastFrame = 0;
+        sent = false;
+        outPackets = 0;
+        outBytes = 0;
+}
+
+const uint8_t* UHSSimIsoSensor::GetDescriptor(uint8_t type, uint8_t index, uint16_t *len) {
+        switch(type) {
+                case USB_DESCRIPTOR_DEVICE:
+                        *len = sizeof(isoDevDesc);
+                        return isoDevDesc;
+                case USB_DESCRIPTOR_CONFIGURATION:
+                        *len = sizeof(isoConfDesc);
+                        return isoConfDesc;
+                case USB_DESCRIPTOR_STRING:
+                        return StringDescriptor(index, len, "Simulated sensor");
+                default:
+                        return NULL;
+        }
+}
+
+uint8_t UHSSimIsoSensor::IsoIn(uint8_t ep, uint16_t frame, uint8_t *buf, uint8_t maxlen, uint8_t *len) {
+        if(ep != 1 || !GetConfiguration())
+                return hrTIMEOUT;
+
+        *len = 0;
+        if(sent && frame == lastFrame)
+                return hrSUCCESS; // this frame's samples are gone already
+
+        // Frame number, then a sawtooth that carries on from frame to frame
+        uint8_t n = (maxlen < UHS_SIM_ISO_PACKET) ? maxlen : UHS_SIM_ISO_PACKET;
+        for(uint8_t i = 0; i < n; i++)
+                buf[i] = (i < 2) ? (uint8_t)(frame >> (8 * i)) : (uint8_t)(frame * (UHS_SIM_ISO_PACKET - 2) + i - 2);
+        *len = n;
+        lastFrame = frame;
+        sent = true;
+        return hrSUCCESS;
+}
+
+void UHSSimIsoSensor::IsoOut(uint8_t ep, uint16_t frame __attribute__((unused)), const uint8_t *buf __attribute__((unused)), uint8_t len) {
+        if(ep != 2 || !GetConfiguration())
+                return;
+        outPackets++;
+        outBytes += len;
+}
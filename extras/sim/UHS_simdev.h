@@ -0,0 +1,175 @@
+/* Copyright (C) 2011 Circuits At Home, LTD. All rights reserved.
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation; either version 2 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+Contact information
+-------------------
+
+Circuits At Home, LTD
+Web      :  http://www.circuitsathome.com
+e-mail   :  support@circuitsathome.com
+ */
+/* Virtual devices for the MAX3421E simulator */
+
+#ifndef UHS_SIMDEV_H
+#define UHS_SIMDEV_H
+
+#include "UHS_sim.h"
+
+#define UHS_SIM_HUB_PORTS       4
+#define UHS_SIM_QUEUE_SIZE      256
+#define UHS_SIM_ISO_PACKET      32      // wMaxPacketSize of the streaming sensor endpoints
+
+/* Byte queue used by the devices to hold data for IN endpoints */
+class UHSSimQueue {
+        uint8_t buf[UHS_SIM_QUEUE_SIZE];
+        uint16_t head;
+        uint16_t count;
+
+public:
+        UHSSimQueue() : head(0), count(0) {
+        };
+
+        void Clear() {
+                head = 0;
+                count = 0;
+        };
+
+        uint16_t Count() {
+                return count;
+        };
+
+        uint8_t Peek(uint16_t offset) {
+                return buf[(head + offset) % UHS_SIM_QUEUE_SIZE];
+        };
+
+        bool Put(const uint8_t *data, uint16_t len);
+        uint16_t Get(uint8_t *data, uint16_t len);
+};
+
+/* Full-speed hub, the downstream ports report their devices once powered */
+class UHSSimHub : public UHSSimDevice {
+        UHSSimDevice *ports[UHS_SIM_HUB_PORTS];
+        uint16_t portStatus[UHS_SIM_HUB_PORTS];
+        uint16_t portChange[UHS_SIM_HUB_PORTS];
+
+protected:
+        const uint8_t* GetDescriptor(uint8_t type, uint8_t index, uint16_t *len);
+        uint8_t ClassRequest(const SETUP_PKT *setup, uint8_t *data, uint16_t *len);
+        uint8_t EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen, uint8_t *len);
+        void Reset();
+        UHSSimDevice* Route(uint8_t addr);
+
+public:
+        UHSSimHub();
+
+        /* 'port' is 1 based, a NULL 'dev' disconnects the port */
+        void Attach(uint8_t port, UHSSimDevice *dev);
+};
+
+/* Low-speed boot protocol keyboard */
+class UHSSimKeyboard : public UHSSimDevice {
+        UHSSimQueue reports;
+        uint8_t protocol;
+        uint8_t leds;
+
+protected:
+        const uint8_t* GetDescriptor(uint8_t type, uint8_t index, uint16_t *len);
+        uint8_t ClassRequest(const SETUP_PKT *setup, uint8_t *data, uint16_t *len);
+        uint8_t EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen, uint8_t *len);
+        void Reset();
+
+public:
+        UHSSimKeyboard();
+
+        /* Queues the key press and release reports for 'str', letters, digits and spaces */
+        void Type(const char *str);
+
+        uint8_t GetLeds() {
+                return leds;
+        };
+};
+
+/* CDC ACM modem, whatever is written to the bulk OUT endpoint comes back on bulk IN */
+class UHSSimCdcAcm : public UHSSimDevice {
+        UHSSimQueue loop;
+        uint8_t lineCoding[7];
+        uint8_t lineState;
+
+protected:
+        const uint8_t* GetDescriptor(uint8_t type, uint8_t index, uint16_t *len);
+        uint8_t ClassRequest(const SETUP_PKT *setup, uint8_t *data, uint16_t *len);
+        uint8_t EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen, uint8_t *len);
+        uint8_t EpOut(uint8_t ep, const uint8_t *buf, uint8_t len);
+        void Reset();
+
+public:
+        UHSSimCdcAcm();
+
+        uint32_t GetBaudRate() {
+                return (uint32_t)lineCoding[0] | ((uint32_t)lineCoding[1] << 8) | ((uint32_t)lineCoding[2] << 16) | ((uint32_t)lineCoding[3] << 24);
+        };
+
+        uint8_t GetLineState() {
+                return lineState;
+        };
+};
+
+/* Bluetooth HCI dongle. Commands are answered with Command Complete, or with Command */
+/* Status for link control commands, no radio is simulated                          */
+class UHSSimBtDongle : public UHSSimDevice {
+        UHSSimQueue events;
+        uint8_t eventLeft; // bytes of the event being sent
+
+        void Event(uint8_t code, const uint8_t *params, uint8_t len);
+
+protected:
+        const uint8_t* GetDescriptor(uint8_t type, uint8_t index, uint16_t *len);
+        uint8_t ClassRequest(const SETUP_PKT *setup, uint8_t *data, uint16_t *len);
+        uint8_t EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen, uint8_t *len);
+        void Reset();
+
+public:
+        UHSSimBtDongle();
+};
+
+/* Full-speed streaming sensor. The isochronous IN endpoint 1 sends a block of samples each frame,  */
+/* stamped with the frame number, a second IN in the same frame gets a zero-length packet. Packets  */
+/* to the isochronous OUT endpoint 2 are only counted.                                              */
+class UHSSimIsoSensor : public UHSSimDevice {
+        uint16_t lastFrame; // frame the last sample block was sent in
+        bool sent; // lastFrame is valid
+        uint32_t outPackets;
+        uint32_t outBytes;
+
+protected:
+        const uint8_t* GetDescriptor(uint8_t type, uint8_t index, uint16_t *len);
+        uint8_t IsoIn(uint8_t ep, uint16_t frame, uint8_t *buf, uint8_t maxlen, uint8_t *len);
+        void IsoOut(uint8_t ep, uint16_t frame, const uint8_t *buf, uint8_t len);
+        void Reset();
+
+public:
+        UHSSimIsoSensor();
+
+        uint32_t GetOutPackets() {
+                return outPackets;
+        };
+
+        uint32_t GetOutBytes() {
+                return outBytes;
+        };
+};
+
+#endif /* UHS_SIMDEV_H */
@@ -0,0 +1,130 @@
+/* Host build demo: asynchronous transfers to a CDC ACM modem, submitted, completed and aborted, see README.md */
+
+#include <cdcacm.h>
+
+#include "UHS_simdev.h"
+
+USB Usb;
+
+class ACMAsyncOper : public CDCAsyncOper {
+public:
+        uint8_t OnInit(ACM *pacm);
+        void OnDataRcvd(ACM *pacm, uint8_t rcode, uint16_t nbytes, uint8_t *dataptr);
+};
+
+ACMAsyncOper AsyncOper;
+ACM Acm(&Usb, &AsyncOper);
+
+/* Completion of the OUT transfers the sketch submits on its own */
+class OutHandler : public USBXferHandler {
+public:
+        void XferDone(USBXferReq *req);
+};
+
+OutHandler OutDone;
+
+UHSSimCdcAcm SimModem;
+
+static USBXferReq outReq;
+static uint8_t outBuf[] = "ping over an asynchronous bulk OUT";
+static uint8_t rcvBuf[64];
+static uint32_t submitted; // millis() of the last submit
+static uint8_t callbacks; // OnDataRcvd() calls so far
+static uint32_t next;
+static uint8_t step;
+
+uint8_t ACMAsyncOper::OnInit(ACM *pacm) {
+        return pacm->SetControlLineState(3);
+}
+
+void ACMAsyncOper::OnDataRcvd(ACM *pacm __attribute__((unused)), uint8_t rcode, uint16_t nbytes, uint8_t *dataptr) {
+        callbacks++;
+        Serial.print(F("IN done after "));
+        Serial.print(millis() - submitted);
+        Serial.print(F("ms, rcode 0x"));
+        Serial.print(rcode, HEX);
+        Serial.print(F(", "));
+        Serial.print(nbytes);
+        Serial.print(F(" bytes"));
+        if(!rcode) {
+                Serial.print(F(": "));
+                Serial.write(dataptr, nbytes);
+        }
+        Serial.println();
+}
+
+void OutHandler::XferDone(USBXferReq *req) {
+        Serial.print(F("OUT done, rcode 0x"));
+        Serial.print(req->rcode, HEX);
+        Serial.print(F(", "));
+        Serial.print(req->count);
+        Serial.println(F(" bytes"));
+}
+
+static void Receive() {
+        uint8_t rcode = Acm.RcvDataAsync(sizeof(rcvBuf), rcvBuf);
+
+        submitted = millis();
+        Serial.print(F("\r\nIN submitted, rcode 0x"));
+        Serial.println(rcode, HEX);
+}
+
+void setup() {
+        Serial.begin(115200);
+        Serial.println(F("Start"));
+
+        UHSSim::Instance().Attach(&SimModem);
+
+        if(Usb.Init() == -1)
+                Serial.println(F("OSC did not start."));
+}
+
+void loop() {
+        Usb.Task();
+
+        if(!Acm.isReady() && step == 0)
+                return;
+        if((int32_t)(millis() - next) < 0)
+                return;
+        next = millis() + 100;
+
+        switch(step++) {
+                case 0: // nothing to receive yet, the request stays queued
+                        Receive();
+                        break;
+                case 1:
+                        Serial.print(F("Pending, "));
+                        Serial.print(callbacks);
+                        Serial.println(F(" callbacks"));
+                        // The modem sends it back, that completes the IN request
+                        Serial.print(F("OUT submitted, rcode 0x"));
+                        Serial.println(Usb.submitOutTransfer(&outReq, Acm.GetAddress(), Acm.epInfo[ACM::epDataOutIndex].epAddr,
+                                strlen((char *)outBuf), outBuf, &OutDone), HEX);
+                        break;
+                case 2: // cancelled by the sketch
+                {
+                        Receive();
+                        bool cancelled = Acm.CancelRcv();
+
+                        Serial.print(F("Cancelled: "));
+                        Serial.println(cancelled ? F("yes") : F("no"));
+                        break;
+                }
+                case 3: // fails once the modem goes away, the driver is released
+                        Receive();
+                        break;
+                case 4:
+                        Serial.println(F("Modem unplugged"));
+                        UHSSim::Instance().Detach();
+                        break;
+                case 5:
+                        Serial.print(F("\r\nCallbacks: "));
+                        Serial.print(callbacks);
+                        Serial.print(F(", modem "));
+                        Serial.println(Acm.isReady() ? F("ready") : F("gone"));
+                        UHSSim::Instance().SetRunTime(millis());
+                        break;
+                default:
+                        break;
+        }
+}
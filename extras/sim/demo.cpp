@@ -0,0 +1,164 @@
+/* Host build demo: a hub with a keyboard, a CDC ACM modem and a Bluetooth dongle, see README.md */
+
+#include <usbhub.h>
+#include <hidboot.h>
+#include <cdcacm.h>
+#include <BTDSSP.h>
+
+#include "UHS_simdev.h"
+
+USB Usb;
+USBHub Hub(&Usb);
+HIDBoot<USB_HID_PROTOCOL_KEYBOARD> HidKeyboard(&Usb);
+BTDSSP Btd(&Usb);
+
+class ACMAsyncOper : public CDCAsyncOper {
+public:
+        uint8_t OnInit(ACM *pacm);
+};
+
+uint8_t ACMAsyncOper::OnInit(ACM *pacm) {
+        uint8_t rcode;
+        LINE_CODING lc;
+
+        rcode = pacm->SetControlLineState(3);
+        if(rcode)
+                return rcode;
+
+        lc.dwDTERate = 115200;
+        lc.bCharFormat = 0;
+        lc.bParityType = 0;
+        lc.bDataBits = 8;
+        return pacm->SetLineCoding(&lc);
+}
+
+ACMAsyncOper AsyncOper;
+ACM Acm(&Usb, &AsyncOper);
+
+class KbdRptParser : public KeyboardReportParser {
+protected:
+        void OnKeyDown(uint8_t mod, uint8_t key);
+};
+
+void KbdRptParser::OnKeyDown(uint8_t mod, uint8_t key) {
+        uint8_t c = OemToAscii(mod, key);
+
+        if(c)
+                Serial.print((char)c);
+}
+
+KbdRptParser Prs;
+
+UHSSimHub SimHub;
+UHSSimKeyboard SimKeyboard;
+UHSSimCdcAcm SimModem;
+UHSSimBtDongle SimDongle;
+
+static uint32_t next;
+static uint8_t step;
+
+void setup() {
+        Serial.begin(115200);
+        Serial.println(F("Start"));
+
+        SimHub.Attach(1, &SimKeyboard);
+        SimHub.Attach(2, &SimModem);
+        SimHub.Attach(3, &SimDongle);
+        UHSSim::Instance().Attach(&SimHub);
+
+        if(Usb.Init() == -1)
+                Serial.println(F("OSC did not start."));
+
+        HidKeyboard.SetReportParser(0, &Prs);
+        next = millis() + 5000;
+}
+
+void loop() {
+        Usb.Task();
+
+        if((int32_t)(millis() - next) < 0)
+                return;
+        next = millis() + 1000;
+
+        switch(step++) {
+                case 0:
+                        Serial.print(F("\r\nUSB state: "));
+                        Serial.println(Usb.getUsbTaskState(), HEX);
+                        Serial.print(F("Modem: "));
+                        Serial.print(Acm.isReady() ? F("ready at ") : F("not ready at "));
+                        Serial.println(SimModem.GetBaudRate());
+                        SimKeyboard.Type("hello world\n");
+                        break;
+                case 1:
+                        if(Acm.isReady()) {
+                                uint8_t buf[64] = "ping over the simulated bulk pipes";
+                                uint16_t len = sizeof(buf);
+
+                                Acm.SndData(strlen((char *)buf), buf);
+                                memset(buf, 0, sizeof(buf));
+                                if(!Acm.RcvData(&len, buf) && len) {
+                                        Serial.print(F("\r\nModem echo: "));
+                                        Serial.println((char *)buf);
+                                }
+                        }
+                        break;
+                case 2:
+                        // OUT packets the modem NAKs are sent again from the SNDFIFO, the echo has to match
+                        if(Acm.isReady()) {
+                                static const uint16_t naks[] = { 0, 1, 3 };
+
+                                Serial.print(F("\r\nModem OUT NAK loopback:"));
+                                for(uint8_t n = 0; n < sizeof(naks) / sizeof(naks[0]); n++) {
+                                        uint8_t out[150], in[150];
+                                        uint16_t got = 0;
+
+                                        for(uint16_t i = 0; i < sizeof(out); i++)
+                                                out[i] = (uint8_t)(i * 7 + n);
+                                        UHSSim::Instance().InjectFault(Acm.GetAddress(), Acm.epInfo[ACM::epDataOutIndex].epAddr, hrNAK, naks[n]);
+                                        uint8_t rcode = Acm.SndData(sizeof(out), out);
+
+                                        while(!rcode && got < sizeof(in)) {
+                                                uint16_t len = sizeof(in) - got;
+
+                                                rcode = Acm.RcvData(&len, in + got);
+                                                got += len;
+                                                if(rcode == hrNAK)
+                                                        rcode = (len) ? 0 : hrNAK;
+                                        }
+                                        Serial.print(F(" "));
+                                        Serial.print(naks[n]);
+                                        Serial.print((!rcode && !memcmp(out, in, sizeof(out))) ? F(" ok") : F(" FAILED"));
+                                }
+                                Serial.println();
+                        }
+                        break;
+                case 3:
+                {
+                        const UHSSimStats &s = UHSSim::Instance().GetStats();
+
+                        // The dongle is the last one on the hub, the local address is read by the HCI init commands
+                        Serial.print(F("\r\nBluetooth: "));
+                        Serial.print(Btd.isReady() ? F("ready, ") : F("not ready, "));
+                        for(int8_t i = 5; i >= 0; i--) {
+                                Serial.print(Btd.my_bdaddr[i], HEX);
+                                Serial.print((i) ? F(":") : F("\r\n"));
+                        }
+                        Serial.print(F("SPI selects: "));
+                        Serial.println(s.spiSelects);
+                        Serial.print(F("SPI bytes: "));
+                        Serial.println(s.spiBytes);
+                        Serial.print(F("Transactions: "));
+                        Serial.print(s.xfers);
+                        Serial.print(F(", NAKed: "));
+                        Serial.print(s.xferNaks);
+                        Serial.print(F(", failed: "));
+                        Serial.println(s.xferErrors);
+                        Serial.print(F("Bus busy: "));
+                        Serial.print((unsigned long)(s.busNs / 1000000ULL));
+                        Serial.println(F("ms"));
+                        break;
+                }
+                default:
+                        break;
+        }
+}
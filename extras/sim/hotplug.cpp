@@ -0,0 +1,119 @@
+/* Host build benchmark: Task() time and key latency while devices are plugged into a running hub, see README.md */
+
+#include <usbhub.h>
+#include <hidboot.h>
+#include <cdcacm.h>
+#include <BTDSSP.h>
+
+#include "UHS_simdev.h"
+
+#if !ENABLE_UHS_TELEMETRY
+#error "Build the benchmark with -DENABLE_UHS_TELEMETRY=1"
+#endif
+
+#define PLUG_PAUSE              1000    // milliseconds between a device being ready and the next one plugged in
+#define PLUG_KEY_PERIOD         37      // milliseconds between the keys typed while a device enumerates
+
+USB Usb;
+USBHub Hub(&Usb);
+HIDBoot<USB_HID_PROTOCOL_KEYBOARD> HidKeyboard(&Usb);
+CDCAsyncOper AsyncOper;
+ACM Acm(&Usb, &AsyncOper);
+BTDSSP Btd(&Usb);
+
+class KbdRptParser : public KeyboardReportParser {
+protected:
+        void OnKeyDown(uint8_t mod, uint8_t key);
+};
+
+KbdRptParser Prs;
+
+UHSSimHub SimHub;
+UHSSimKeyboard SimKeyboard;
+UHSSimCdcAcm SimModem;
+UHSSimBtDongle SimDongle;
+
+static uint8_t step; // device being plugged in: 0 the keyboard with the hub, 1 the modem, 2 the dongle, 3 done
+static bool waiting; // between a device being ready and the next one plugged in
+static uint32_t plugTime, next;
+static uint32_t keyTime; // micros() of the last key typed, 0 once it has arrived
+static uint32_t keys, latMax;
+
+void KbdRptParser::OnKeyDown(uint8_t mod __attribute__((unused)), uint8_t key __attribute__((unused))) {
+        if(!keyTime)
+                return;
+
+        uint32_t lat = (uint32_t)micros() - keyTime;
+
+        keyTime = 0;
+        keys++;
+        if(lat > latMax)
+                latMax = lat;
+}
+
+static bool Ready(uint8_t dev) {
+        switch(dev) {
+                case 0:
+                        return HidKeyboard.isReady();
+                case 1:
+                        return Acm.isReady();
+                default:
+                        return Btd.isReady();
+        }
+}
+
+static void Plug() {
+        if(step == 1)
+                SimHub.Attach(2, &SimModem);
+        else
+                SimHub.Attach(3, &SimDongle);
+        plugTime = millis();
+        keys = latMax = 0;
+        keyTime = 0;
+        next = millis();
+        Usb.getTaskMaxTime(true);
+        waiting = false;
+}
+
+void setup() {
+        SimHub.Attach(1, &SimKeyboard);
+        UHSSim::Instance().Attach(&SimHub);
+
+        if(Usb.Init() == -1)
+                printf("OSC did not start.\n");
+
+        HidKeyboard.SetReportParser(0, &Prs);
+        printf("device,readyMs,taskMaxUs,keys,keyMaxUs\n");
+        Usb.getTaskMaxTime(true);
+}
+
+void loop() {
+        static const char *names[] = { "keyboard", "modem", "dongle" };
+
+        Usb.Task();
+
+        if(waiting) {
+                if((int32_t)(millis() - next) >= 0)
+                        Plug();
+                return;
+        }
+
+        // The keyboard is typed on while the other devices enumerate
+        if(step && (int32_t)(millis() - next) >= 0) {
+                next += PLUG_KEY_PERIOD;
+                SimKeyboard.Type("a");
+                keyTime = micros();
+        }
+
+        if(!Ready(step))
+                return;
+
+        printf("%s,%lu,%lu,%lu,%lu\n", names[step], (unsigned long)(millis() - plugTime),
+                (unsigned long)Usb.getTaskMaxTime(true), (unsigned long)keys, (unsigned long)latMax);
+        if(++step > 2) {
+                UHSSim::Instance().SetRunTime(millis());
+                return;
+        }
+        waiting = true;
+        next = millis() + PLUG_PAUSE;
+}
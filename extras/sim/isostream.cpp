@@ -0,0 +1,108 @@
+/* Host build demo: isochronous streaming from a simulated sensor, see README.md */
+
+#include <Usb.h>
+
+#include "UHS_simdev.h"
+
+#if !USE_UHS_ISO
+#error "Build the demo with -DUSE_UHS_ISO=1"
+#endif
+
+#define ISO_SLOTS               8       // packet buffers of each stream
+#define ISO_RUN_MS              5000    // streaming time
+#define ISO_STALL_AT            2000    // time into the run at which the sketch is busy for ISO_STALL_MS
+#define ISO_STALL_MS            5
+
+USB Usb;
+UHSSimIsoSensor SimSensor;
+
+static EpInfo epInfo[3];
+static uint8_t inRing[ISO_SLOTS * UHS_SIM_ISO_PACKET], inLens[ISO_SLOTS];
+static uint8_t outRing[ISO_SLOTS * UHS_SIM_ISO_PACKET], outLens[ISO_SLOTS];
+static USBIsoStream inStream, outStream;
+static uint32_t startTime;
+static bool started, stalled;
+
+// What the sketch saw in the frame stamps of the sensor
+static uint32_t samplePackets, emptyPackets, gapFrames;
+static uint16_t lastStamp;
+
+static void PrintStats(const char *name, const USBIsoStats *s) {
+        printf("%s,%lu,%lu,%u,%u,%u,%u\n", name, (unsigned long)s->packets, (unsigned long)s->bytes,
+                s->missed, s->overruns, s->underruns, s->errors);
+}
+
+static void Report() {
+        printf("stream,packets,bytes,missed,overruns,underruns,errors\n");
+        PrintStats("iso_in", &inStream.stats);
+        PrintStats("iso_out", &outStream.stats);
+        printf("sensor: %lu sample packets, %lu empty, %lu frames lost between them, %lu OUT packets arrived\n",
+                (unsigned long)samplePackets, (unsigned long)emptyPackets, (unsigned long)gapFrames,
+                (unsigned long)SimSensor.GetOutPackets());
+}
+
+void setup() {
+        UHSSim::Instance().Attach(&SimSensor);
+
+        if(Usb.Init() == -1)
+                printf("OSC did not start.\n");
+}
+
+void loop() {
+        uint8_t *pkt, len;
+
+        Usb.Task();
+        if(Usb.getUsbTaskState() != USB_STATE_RUNNING)
+                return;
+
+        if(!started) {
+                uint8_t addr = SimSensor.GetAddress();
+
+                // No driver takes the device, it is only addressed. Set up the endpoints and the configuration here
+                epInfo[0].maxPktSize = 64;
+                epInfo[0].bmNakPower = USB_NAK_MAX_POWER;
+                for(uint8_t i = 1; i < 3; i++) {
+                        epInfo[i].epAddr = i;
+                        epInfo[i].maxPktSize = UHS_SIM_ISO_PACKET;
+                }
+                if(Usb.setEpInfoEntry(addr, 3, epInfo) || Usb.setConf(addr, 0, 1) ||
+                        Usb.isoStartIn(&inStream, addr, 1, 1, inRing, inLens, ISO_SLOTS) ||
+                        Usb.isoStartOut(&outStream, addr, 2, 1, outRing, outLens, ISO_SLOTS)) {
+                        printf("Can't start the streams\n");
+                        UHSSim::Instance().SetRunTime(millis());
+                }
+                startTime = millis();
+                started = true;
+                return;
+        }
+
+        while((pkt = inStream.Front(&len)) != NULL) {
+                if(len >= 2) {
+                        uint16_t stamp = pkt[0] | (pkt[1] << 8);
+
+                        if(samplePackets)
+                                gapFrames += (uint16_t)(stamp - lastStamp - 1);
+                        lastStamp = stamp;
+                        samplePackets++;
+                } else
+                        emptyPackets++;
+                inStream.Pop();
+        }
+
+        while((pkt = outStream.Back()) != NULL) {
+                memset(pkt, 0x55, UHS_SIM_ISO_PACKET);
+                outStream.Push(UHS_SIM_ISO_PACKET);
+        }
+
+        if(!stalled && millis() - startTime >= ISO_STALL_AT) {
+                stalled = true;
+                delay(ISO_STALL_MS); // the sketch is busy, the streams miss these frames
+        }
+
+        if(millis() - startTime >= ISO_RUN_MS) {
+                Usb.isoStop(&inStream);
+                Usb.isoStop(&outStream);
+                Report();
+                UHSSim::Instance().SetRunTime(millis());
+        }
+}
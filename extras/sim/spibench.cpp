@@ -0,0 +1,188 @@
+/* Host build benchmark: the SPI cost of each transfer type, see README.md */
+
+#include <Usb.h>
+
+#include "UHS_simdev.h"
+
+#if !ENABLE_UHS_SPI_STATS
+#error "Build the benchmark with -DENABLE_UHS_SPI_STATS=1"
+#endif
+
+#define BENCH_BULK_SIZE         512     // multiple-packet bulk transfers
+#define BENCH_RUNS              8       // runs of each operation, the first one is not counted
+#define BENCH_STREAM_SIZE       4096    // bulk IN transfers of the sustained rate
+#define BENCH_STREAM_RUNS       64      // 256KB at 4096 bytes per transfer
+
+/* Vendor specific full-speed device that always has data on its IN endpoints and always takes OUT data */
+class BenchDevice : public UHSSimDevice {
+protected:
+        const uint8_t* GetDescriptor(uint8_t type, uint8_t index, uint16_t *len);
+        uint8_t EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen, uint8_t *len);
+};
+
+static const uint8_t benchDevDesc[] = {
+        18, USB_DESCRIPTOR_DEVICE, 0x00, 0x02, 0xff, 0x00, 0x00, 64,
+        0x09, 0x12, 0x01, 0x00, 0x00, 0x01, 0, 0, 0, 1
+};
+
+static const uint8_t benchConfDesc[] = {
+        9, USB_DESCRIPTOR_CONFIGURATION, 46, 0, 1, 1, 0, 0x80, 50,
+        9, USB_DESCRIPTOR_INTERFACE, 0, 0, 4, 0xff, 0x00, 0x00, 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x81, USB_TRANSFER_TYPE_INTERRUPT, 64, 0, 1,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x82, USB_TRANSFER_TYPE_BULK, 64, 0, 0,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x83, USB_TRANSFER_TYPE_INTERRUPT, 8, 0, 1,
+        7, USB_DESCRIPTOR_ENDPOINT, 0x04, USB_TRANSFER_TYPE_BULK, 64, 0, 0
+};
+
+const uint8_t* BenchDevice::GetDescriptor(uint8_t type, uint8_t index __attribute__((unused)), uint16_t *len) {
+        switch(type) {
+                case USB_DESCRIPTOR_DEVICE:
+                        *len = sizeof(benchDevDesc);
+                        return benchDevDesc;
+                case USB_DESCRIPTOR_CONFIGURATION:
+                        *len = sizeof(benchConfDesc);
+                        return benchConfDesc;
+                default:
+                        return NULL;
+        }
+}
+
+uint8_t BenchDevice::EpIn(uint8_t ep, uint8_t *buf, uint8_t maxlen, uint8_t *len) {
+        if(ep == 3)
+                return hrNAK; // nothing to report, ever
+        if(ep != 1 && ep != 2)
+                return hrSTALL;
+        *len = (maxlen < 64) ? maxlen : 64;
+        memset(buf, ep, *len);
+        return hrSUCCESS;
+}
+
+USB Usb;
+BenchDevice SimDev;
+
+static EpInfo epInfo[5];
+static uint8_t buf[BENCH_STREAM_SIZE];
+
+enum {
+        BENCH_CTRL_IN,
+        BENCH_INTR_IN,
+        BENCH_INTR_NAK,
+        BENCH_BULK_IN,
+        BENCH_BULK_OUT,
+        BENCH_NUM_OPS
+};
+
+static const char * const benchNames[BENCH_NUM_OPS] = {
+        "ctrl_in_18", "intr_in_64", "intr_in_nak", "bulk_in_512", "bulk_out_512"
+};
+
+static uint8_t Run(uint8_t op, uint8_t addr, uint16_t *len) {
+        switch(op) {
+                case BENCH_CTRL_IN:
+                        *len = sizeof(USB_DEVICE_DESCRIPTOR);
+                        return Usb.getDevDescr(addr, 0, *len, buf);
+                case BENCH_INTR_IN:
+                        *len = 64;
+                        return Usb.inTransfer(addr, 1, len, buf);
+                case BENCH_INTR_NAK:
+                        *len = 8;
+                        return Usb.inTransfer(addr, 3, len, buf);
+                case BENCH_BULK_IN:
+                        *len = BENCH_BULK_SIZE;
+                        return Usb.inTransfer(addr, 2, len, buf);
+                default:
+                        *len = BENCH_BULK_SIZE;
+                        return Usb.outTransfer(addr, 4, *len, buf);
+        }
+}
+
+/* One CSV line per operation, the counts are per run so they can be compared between versions and settings */
+static void Bench(uint8_t addr) {
+        printf("op,rcode,bytes,regRd,regWr,bytesRd,bytesWr,regBatch,spiSelects,spiBytes,xfers,xferNaks,us\n");
+        for(uint8_t op = 0; op < BENCH_NUM_OPS; op++) {
+                UHSSimStats before, after;
+                uint32_t start;
+                uint16_t len = 0;
+                uint8_t rcode = 0;
+
+                Run(op, addr, &len); // the toggles and the peripheral address settle
+                Usb.resetSpiStats();
+                before = UHSSim::Instance().GetStats();
+                start = micros();
+                for(uint8_t i = 0; i < BENCH_RUNS; i++)
+                        rcode = Run(op, addr, &len);
+                start = micros() - start;
+                after = UHSSim::Instance().GetStats();
+
+                const MAX3421eSpiStats &s = Usb.getSpiStats();
+
+                printf("%s,0x%02x,%u,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n", benchNames[op], rcode, len,
+                        (unsigned long)(s.regRd / BENCH_RUNS), (unsigned long)(s.regWr / BENCH_RUNS),
+                        (unsigned long)(s.bytesRd / BENCH_RUNS), (unsigned long)(s.bytesWr / BENCH_RUNS),
+                        (unsigned long)(s.regBatch / BENCH_RUNS),
+                        (unsigned long)((after.spiSelects - before.spiSelects) / BENCH_RUNS),
+                        (unsigned long)((after.spiBytes - before.spiBytes) / BENCH_RUNS),
+                        (unsigned long)((after.xfers - before.xfers) / BENCH_RUNS),
+                        (unsigned long)((after.xferNaks - before.xferNaks) / BENCH_RUNS),
+                        (unsigned long)(start / BENCH_RUNS));
+        }
+}
+
+/* Sustained bulk IN: back to back transfers from an endpoint that always has data */
+static void Stream(uint8_t addr) {
+        uint32_t start, bytes = 0;
+        uint8_t rcode = 0;
+
+        start = micros();
+        for(uint8_t i = 0; i < BENCH_STREAM_RUNS && !rcode; i++) {
+                uint16_t len = BENCH_STREAM_SIZE;
+
+                rcode = Usb.inTransfer(addr, 2, &len, buf);
+                bytes += len;
+        }
+        start = micros() - start;
+
+        printf("stream,rcode,bytes,us,bytesPerSec\n");
+        printf("bulk_in_%u,0x%02x,%lu,%lu,%lu\n", BENCH_STREAM_SIZE, rcode, (unsigned long)bytes, (unsigned long)start,
+                (unsigned long)((uint64_t)bytes * 1000000 / start));
+}
+
+#if USE_UHS_SPI_DMA
+static MAX3421eSpiSoftDma SoftDma;
+#endif
+
+void setup() {
+        UHSSim::Instance().Attach(&SimDev);
+
+        if(Usb.Init() == -1)
+                printf("OSC did not start.\n");
+#if USE_UHS_SPI_DMA
+        Usb.setSpiDma(&SoftDma); // FIFO transfers of UHS_SPI_DMA_MIN bytes or more go through the reference engine
+#endif
+}
+
+void loop() {
+        uint8_t addr;
+
+        Usb.Task();
+        if(Usb.getUsbTaskState() != USB_STATE_RUNNING)
+                return;
+
+        // No driver takes the device, it is only addressed. Set up the endpoints and the configuration here
+        addr = SimDev.GetAddress();
+        epInfo[0].maxPktSize = 64;
+        epInfo[0].bmNakPower = USB_NAK_MAX_POWER;
+        for(uint8_t i = 1; i < 5; i++) {
+                epInfo[i].epAddr = i;
+                epInfo[i].maxPktSize = (i == 3) ? 8 : 64;
+                epInfo[i].bmNakPower = (i == 2 || i == 4) ? USB_NAK_MAX_POWER : USB_NAK_NOWAIT;
+        }
+        if(Usb.setEpInfoEntry(addr, 5, epInfo) || Usb.setConf(addr, 0, 1)) {
+                printf("Can't configure the device\n");
+        } else {
+                Bench(addr);
+                Stream(addr);
+        }
+
+        UHSSim::Instance().SetRunTime(millis());
+}
@@ -0,0 +1,146 @@
+/* Host build benchmark: keyboard latency and Task() time under a bulk flood, see README.md */
+
+#include <usbhub.h>
+#include <hidboot.h>
+#include <cdcacm.h>
+
+#include "UHS_simdev.h"
+
+#if !ENABLE_UHS_TELEMETRY
+#error "Build the benchmark with -DENABLE_UHS_TELEMETRY=1"
+#endif
+
+#define FLOOD_MAX_REQS          12      // bulk OUT and bulk IN requests in flight, each
+#define FLOOD_PKT_SIZE          64      // bytes of each request
+#define FLOOD_PHASE_TIME        2000    // milliseconds of each run
+#define FLOOD_KEY_PERIOD        37      // milliseconds between the keys typed
+
+/* Runs: requests in flight in each direction and the Task() budget in microseconds */
+static const uint16_t floodRuns[][2] = {
+        { 0, 0 }, { 3, 0 }, { 12, 0 }, { 12, 1000 }, { 12, 500 }
+};
+
+#define FLOOD_NUM_RUNS          (sizeof(floodRuns) / sizeof(floodRuns[0]))
+
+USB Usb;
+USBHub Hub(&Usb);
+HIDBoot<USB_HID_PROTOCOL_KEYBOARD> HidKeyboard(&Usb);
+CDCAsyncOper AsyncOper;
+ACM Acm(&Usb, &AsyncOper);
+
+class KbdRptParser : public KeyboardReportParser {
+protected:
+        void OnKeyDown(uint8_t mod, uint8_t key);
+};
+
+/* Completion of the flood requests, each one is submitted again while its run lasts */
+class FloodHandler : public USBXferHandler {
+public:
+        void XferDone(USBXferReq *req);
+};
+
+KbdRptParser Prs;
+FloodHandler Flood;
+
+UHSSimHub SimHub;
+UHSSimKeyboard SimKeyboard;
+UHSSimCdcAcm SimModem;
+
+static USBXferReq outReq[FLOOD_MAX_REQS], inReq[FLOOD_MAX_REQS];
+static uint8_t outBuf[FLOOD_PKT_SIZE], inBuf[FLOOD_MAX_REQS][FLOOD_PKT_SIZE];
+
+static uint8_t run; // index into floodRuns, FLOOD_NUM_RUNS when done
+static bool running;
+static uint32_t runEnd, nextKey;
+static uint32_t keyTime; // micros() of the last key typed, 0 once it has arrived
+static uint32_t keys, latSum, latMax, bytesIn;
+
+void KbdRptParser::OnKeyDown(uint8_t mod __attribute__((unused)), uint8_t key __attribute__((unused))) {
+        if(!keyTime)
+                return;
+
+        uint32_t lat = (uint32_t)micros() - keyTime;
+
+        keyTime = 0;
+        keys++;
+        latSum += lat;
+        if(lat > latMax)
+                latMax = lat;
+}
+
+static uint8_t Submit(USBXferReq *req) {
+        uint8_t addr = Acm.GetAddress();
+
+        if(req >= outReq && req < outReq + FLOOD_MAX_REQS)
+                return Usb.submitOutTransfer(req, addr, Acm.epInfo[ACM::epDataOutIndex].epAddr, FLOOD_PKT_SIZE, outBuf, &Flood);
+        return Usb.submitInTransfer(req, addr, Acm.epInfo[ACM::epDataInIndex].epAddr, FLOOD_PKT_SIZE, inBuf[req - inReq], &Flood);
+}
+
+void FloodHandler::XferDone(USBXferReq *req) {
+        if(req >= inReq && req < inReq + FLOOD_MAX_REQS && !req->rcode)
+                bytesIn += req->count;
+        if(running)
+                Submit(req);
+}
+
+static void StartRun() {
+        keys = latSum = latMax = bytesIn = 0;
+        keyTime = 0;
+        for(uint8_t i = 0; i < floodRuns[run][0]; i++) {
+                Submit(&outReq[i]);
+                Submit(&inReq[i]);
+        }
+        Usb.getTaskMaxTime(true);
+        running = true;
+        runEnd = millis() + FLOOD_PHASE_TIME;
+        nextKey = millis();
+}
+
+static void EndRun() {
+        running = false;
+        for(uint8_t i = 0; i < FLOOD_MAX_REQS; i++) {
+                Usb.cancelTransfer(&outReq[i]);
+                Usb.cancelTransfer(&inReq[i]);
+        }
+        printf("%u,%u,%lu,%lu,%lu,%lu,%lu\n", floodRuns[run][0], floodRuns[run][1], (unsigned long)keys,
+                (unsigned long)((keys) ? latSum / keys : 0), (unsigned long)latMax,
+                (unsigned long)((uint64_t)bytesIn * 1000 / FLOOD_PHASE_TIME), (unsigned long)Usb.getTaskMaxTime(true));
+}
+
+void setup() {
+        SimHub.Attach(1, &SimKeyboard);
+        SimHub.Attach(2, &SimModem);
+        UHSSim::Instance().Attach(&SimHub);
+
+        if(Usb.Init() == -1)
+                printf("OSC did not start.\n");
+
+        HidKeyboard.SetReportParser(0, &Prs);
+        memset(outBuf, 'x', sizeof(outBuf));
+}
+
+void loop() {
+        Usb.Task((running) ? floodRuns[run][1] : 0);
+
+        if(!running) {
+                if(!Acm.isReady() || !HidKeyboard.isReady())
+                        return;
+                printf("reqs,budget,keys,latAvgUs,latMaxUs,bytesPerSec,taskMaxUs\n");
+                StartRun();
+                return;
+        }
+
+        if((int32_t)(millis() - nextKey) >= 0) {
+                nextKey += FLOOD_KEY_PERIOD;
+                SimKeyboard.Type("a");
+                keyTime = micros();
+        }
+
+        if((int32_t)(millis() - runEnd) < 0)
+                return;
+        EndRun();
+        if(++run < FLOOD_NUM_RUNS)
+                StartRun();
+        else
+                UHSSim::Instance().SetRunTime(millis());
+}
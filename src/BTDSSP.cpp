@@ -38,7 +38,8 @@ bAddress(0), // Device address - mandatory
 bNumEP(1), // If config descriptor needs to be parsed
 qNextPollTime(0), // Reset NextPollTime
 pollInterval(0),
-bPollEnable(false) // Don't start polling before dongle is connected
+bPollEnable(false), // Don't start polling before dongle is connected
+bPollScheduled(false)
 {
         for(uint8_t i = 0; i < BTDSSP_NUM_SERVICES; i++)
                 btService[i] = NULL;
@@ -137,49 +138,64 @@ FailGetDevDescr:
 
 uint8_t BTDSSP::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed) {
         uint8_t rcode;
-        uint8_t num_of_conf = epInfo[1].epAddr; // Number of configurations
-        epInfo[1].epAddr = 0;
+        uint8_t num_of_conf;
+
+        if(!bInitAddressed) {
+                // Give the dongle 300ms after the reset before it gets its address, USB::Task() calls again until then
+                if(!bInitWait) {
+                        bInitWait = true;
+                        qInitTime = (uint32_t)millis() + 300;
+                }
+                if((int32_t)((uint32_t)millis() - qInitTime) < 0L)
+                        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+                bInitWait = false;
 
-        AddressPool &addrPool = pUsb->GetAddressPool();
+                AddressPool &addrPool = pUsb->GetAddressPool();
 #ifdef EXTRADEBUG
-        Notify(PSTR("\r\nBTDSSP Init"), 0x80);
+                Notify(PSTR("\r\nBTDSSP Init"), 0x80);
 #endif
-        UsbDevice *p = addrPool.GetUsbDevicePtr(bAddress); // Get pointer to assigned address record
+                UsbDevice *p = addrPool.GetUsbDevicePtr(bAddress); // Get pointer to assigned address record
 
-        if(!p) {
+                if(!p) {
 #ifdef DEBUG_USB_HOST
-                Notify(PSTR("\r\nAddress not found"), 0x80);
+                        Notify(PSTR("\r\nAddress not found"), 0x80);
 #endif
-                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
-        }
-
-        delay(300); // Assign new address to the device
+                        return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+                }
 
-        rcode = pUsb->setAddr(0, 0, bAddress); // Assign new address to the device
-        if(rcode) {
+                rcode = pUsb->setAddr(0, 0, bAddress, false); // Assign new address to the device
+                if(rcode) {
 #ifdef DEBUG_USB_HOST
-                Notify(PSTR("\r\nsetAddr: "), 0x80);
-                D_PrintHex<uint8_t > (rcode, 0x80);
+                        Notify(PSTR("\r\nsetAddr: "), 0x80);
+                        D_PrintHex<uint8_t > (rcode, 0x80);
 #endif
-                p->lowspeed = false;
-                goto Fail;
-        }
+                        p->lowspeed = false;
+                        goto Fail;
+                }
 #ifdef EXTRADEBUG
-        Notify(PSTR("\r\nAddr: "), 0x80);
-        D_PrintHex<uint8_t > (bAddress, 0x80);
+                Notify(PSTR("\r\nAddr: "), 0x80);
+                D_PrintHex<uint8_t > (bAddress, 0x80);
 #endif
 
-        p->lowspeed = false;
+                p->lowspeed = false;
 
-        p = addrPool.GetUsbDevicePtr(bAddress); // Get pointer to assigned address record
-        if(!p) {
+                p = addrPool.GetUsbDevicePtr(bAddress); // Get pointer to assigned address record
+                if(!p) {
 #ifdef DEBUG_USB_HOST
-                Notify(PSTR("\r\nAddress not found"), 0x80);
+                        Notify(PSTR("\r\nAddress not found"), 0x80);
 #endif
-                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+                        return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+                }
+
+                p->lowspeed = lowspeed;
+
+                // The rest once the dongle has recovered from SET_ADDRESS, USB::Task() holds the next call until then
+                bInitAddressed = true;
+                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
         }
 
-        p->lowspeed = lowspeed;
+        num_of_conf = epInfo[1].epAddr; // Number of configurations
+        epInfo[1].epAddr = 0;
 
         rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo); // Assign epInfo to epinfo pointer - only EP0 is known
         if(rcode)
@@ -215,6 +231,7 @@ uint8_t BTDSSP::Init(uint8_t parent __attribute__((unused)), uint8_t port __attr
 
         waitingForConnection = false;
         bPollEnable = true;
+        bPollScheduled = !pUsb->RegisterPeriodic(this, pollInterval); // Let the USB class poll at the endpoint interval
 
 #ifdef DEBUG_USB_HOST
         Notify(PSTR("\r\nBluetooth Dongle Initialized"), 0x80);
@@ -276,6 +293,9 @@ void BTDSSP::Initialize() {
         qNextPollTime = 0; // Reset next poll time
         pollInterval = 0;
         bPollEnable = false; // Don't start polling before dongle is connected
+        bPollScheduled = false;
+        bInitWait = false;
+        bInitAddressed = false;
 
 }
 
@@ -332,6 +352,8 @@ void BTDSSP::PrintEndpointDescriptor(const USB_ENDPOINT_DESCRIPTOR* ep_ptr __att
 
 /* Performs a cleanup after failed Init() attempt */
 uint8_t BTDSSP::Release() {
+        pUsb->UnregisterPeriodic(this);
+        pUsb->cancelTransfer(&hciEventReq);
         Initialize(); // Set all variables, endpoint structs etc. to default values
         pUsb->GetAddressPool().FreeAddress(bAddress);
         return 0;
@@ -340,16 +362,24 @@ uint8_t BTDSSP::Release() {
 uint8_t BTDSSP::Poll() {
         if(!bPollEnable)
                 return 0;
-        if((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L) { // Don't poll if shorter than polling interval
+        if(bPollScheduled || (int32_t)((uint32_t)millis() - qNextPollTime) >= 0L) { // Don't poll if shorter than polling interval, the frame scheduler keeps it for us
                 qNextPollTime = (uint32_t)millis() + pollInterval; // Set new poll time
                 HCI_task(); // HCI state machine
-                HCI_event_task(); // Poll the HCI event pipe
+                // Read the HCI event pipe ahead of the other transfers, the event is handled in XferDone()
+                pUsb->submitInTransfer(&hciEventReq, bAddress, epInfo[ BTDSSP_EVENT_PIPE ].epAddr, BULK_MAXPKTSIZE, hcibuf, this, USB_XFER_CLASS_INTR);
                 ACL_event_task(); // Poll the ACL input pipe too
-                memset(hcibuf, 0, BULK_MAXPKTSIZE); // Clear hcibuf
         }
         return 0;
 }
 
+void BTDSSP::XferDone(USBXferReq *req) {
+        if(req->rcode == USB_ERROR_TRANSFER_ABORTED) // Released
+                return;
+        if(req->count || (req->rcode && req->rcode != hrNAK)) // A NAK without data means no event
+                HCI_event_task(req->rcode, req->count);
+        memset(hcibuf, 0, BULK_MAXPKTSIZE); // Clear hcibuf
+}
+
 void BTDSSP::disconnect() {
         for(uint8_t i = 0; i < BTDSSP_NUM_SERVICES; i++)
                 if(btService[i])
@@ -492,7 +522,7 @@ void BTDSSP::HCI_task(){
 #ifdef EXTRADEBUG
                         Notify(PSTR("\r\nnext init command"), 0x80);
 #endif
-                        hci_init_config(btInitConfigState);
+                        hci_init_config((BT_HCI_INIT_STATES)btInitConfigState);
                         flagHciInitCommandComplete = false;
                 }
         } else {
@@ -512,7 +542,7 @@ void BTDSSP::HCI_task(){
 
                 flagHciInitError = false;
                 btInitConfigState = BT_HCI_INIT_RESET;
-                hci_init_config(btInitConfigState);
+                hci_init_config((BT_HCI_INIT_STATES)btInitConfigState);
 #ifdef DEBUG_USB_HOST
                 Notify(PSTR("\r\nrestart hci init"), 0x80);
 #endif
@@ -570,10 +600,7 @@ void BTDSSP::HCI_task(){
 //--------------------------------------------------------------
 
 
-void BTDSSP::HCI_event_task() {
-        uint16_t length = BULK_MAXPKTSIZE; // Request more than 16 bytes anyway, the inTransfer routine will take care of this
-        uint8_t rcode = pUsb->inTransfer(bAddress, epInfo[ BTDSSP_EVENT_PIPE ].epAddr, &length, hcibuf, pollInterval); // Input on endpoint 1
-
+void BTDSSP::HCI_event_task(uint8_t rcode, uint16_t length) {
         if(!rcode || rcode == hrNAK) { // Check for errors
 #ifdef EXTRADEBUG
                 if( (length > 0 ) && (hcibuf[0] != 0 ) ){
@@ -1127,97 +1154,99 @@ void BTDSSP::HCI_event_task() {
 
 
                         case EV_COMMAND_COMPLETE:
-/*
-                                uint8_t ocf = hcibuf[3];
-                                uint8_t ogf = hcibuf[4];
-                                uint16_t opcode = ((uint16_t)ocf | (((uint16_t)ogf) << 10))
+                                {
+        /*
+                                        uint8_t ocf = hcibuf[3];
+                                        uint8_t ogf = hcibuf[4];
+                                        uint16_t opcode = ((uint16_t)ocf | (((uint16_t)ogf) << 10))
 
-                                compCMD = opcode;
+                                        compCMD = opcode;
 
-*/
-                                uint16_t compCMD = hci_opcode(hcibuf[4], hcibuf[3]);
+        */
+                                        uint16_t compCMD = hci_opcode(hcibuf[4], hcibuf[3]);
 
-                                uint8_t status = hcibuf[5];
+                                        uint8_t status = hcibuf[5];
 
-                                if (flagHciInitProcessComplete == false) { // Hci init
+                                        if (flagHciInitProcessComplete == false) { // Hci init
 #ifdef DEBUG_USB_HOST
-                                        Notify(PSTR("\r\ncommand complete event in init config Process"), 0x80);
+                                                Notify(PSTR("\r\ncommand complete event in init config Process"), 0x80);
 #endif
-                                        if (compCMD == preCMD){
-                                                if (status != 0x00){//command failed.
+                                                if (compCMD == preCMD){
+                                                        if (status != 0x00){//command failed.
 #ifdef DEBUG_USB_HOST
-                                                        Notify(PSTR("\r\nHci init command failed"), 0x80);
-                                                        Notify(PSTR("\r\nError Code :"), 0x80);
-                                                        D_PrintHex<uint8_t > (status, 0x80);
+                                                                Notify(PSTR("\r\nHci init command failed"), 0x80);
+                                                                Notify(PSTR("\r\nError Code :"), 0x80);
+                                                                D_PrintHex<uint8_t > (status, 0x80);
 #endif
-                                                        commandRetryCount++;//error count++
-                                                        if (commandRetryCount > commandRetryMax){
+                                                                commandRetryCount++;//error count++
+                                                                if (commandRetryCount > commandRetryMax){
 #ifdef DEBUG_USB_HOST
-                                                                Notify(PSTR("\r\nHci init command retry count Max"), 0x80);
+                                                                        Notify(PSTR("\r\nHci init command retry count Max"), 0x80);
 #endif
-                                                                btInitConfigState = BT_HCI_INIT_ERROR;
-                                                                break;
-                                                        }
-                                                } else { //succeeded
+                                                                        btInitConfigState = BT_HCI_INIT_ERROR;
+                                                                        break;
+                                                                }
+                                                        } else { //succeeded
 #ifdef DEBUG_USB_HOST
-                                                        Notify(PSTR("\r\ncommand succeeded"), 0x80);
+                                                                Notify(PSTR("\r\ncommand succeeded"), 0x80);
 #endif
-                                                        //-----------------------------
-                                                        //if (compCMD == BT_HCI_OP_READ_BD_ADDR) { // Parameters from read local bluetooth address
-                                                        //if (opcode == "hci_read_bdaddr") { // Parameters from read local bluetooth address
-                                                        //if((hcibuf[3] == 0x09) && (hcibuf[4] == 0x10)) { // Parameters from read local bluetooth address
-                                                        if (compCMD ==  hci_opcode(0x10, 0x09)) { // Parameters from read local bluetooth address
-                                                                for(uint8_t i = 0; i < 6; i++) {
-                                                                        my_bdaddr[i] = hcibuf[6 + i];
-                                                                }
+                                                                //-----------------------------
+                                                                //if (compCMD == BT_HCI_OP_READ_BD_ADDR) { // Parameters from read local bluetooth address
+                                                                //if (opcode == "hci_read_bdaddr") { // Parameters from read local bluetooth address
+                                                                //if((hcibuf[3] == 0x09) && (hcibuf[4] == 0x10)) { // Parameters from read local bluetooth address
+                                                                if (compCMD ==  hci_opcode(0x10, 0x09)) { // Parameters from read local bluetooth address
+                                                                        for(uint8_t i = 0; i < 6; i++) {
+                                                                                my_bdaddr[i] = hcibuf[6 + i];
+                                                                        }
 
-                                                                hci_set_flag(HCI_FLAG_READ_BDADDR);
+                                                                        hci_set_flag(HCI_FLAG_READ_BDADDR);
 
 #ifdef DEBUG_USB_HOST
-                                                                Notify(PSTR("\r\nLocal_bdaddr: "), 0x80);
-                                                                for(int8_t i = 5; i > 0; i--) {
-                                                                        D_PrintHex<uint8_t > (my_bdaddr[i], 0x80);
-                                                                        Notify(PSTR(":"), 0x80);
-                                                                }
-                                                                D_PrintHex<uint8_t > (my_bdaddr[0], 0x80);
+                                                                        Notify(PSTR("\r\nLocal_bdaddr: "), 0x80);
+                                                                        for(int8_t i = 5; i > 0; i--) {
+                                                                                D_PrintHex<uint8_t > (my_bdaddr[i], 0x80);
+                                                                                Notify(PSTR(":"), 0x80);
+                                                                        }
+                                                                        D_PrintHex<uint8_t > (my_bdaddr[0], 0x80);
 #endif
-                                                        }
-                                                        //-----------------------------
+                                                                }
+                                                                //-----------------------------
 
-                                                        flagHciInitCommandComplete = true;
-                                                        commandRetryCount = 0;
-                                                        flagHciInitCommand = 0;
-                                                        btInitConfigState++;
+                                                                flagHciInitCommandComplete = true;
+                                                                commandRetryCount = 0;
+                                                                flagHciInitCommand = 0;
+                                                                btInitConfigState++;
 #ifdef EXTRADEBUG
-                                                        Notify(PSTR("\r\nbtInitConfigState "), 0x80);
-                                                        D_PrintHex<uint8_t > (btInitConfigState, 0x80);
-                                                        Notify(PSTR("\r\nset next command in init config"), 0x80);
+                                                                Notify(PSTR("\r\nbtInitConfigState "), 0x80);
+                                                                D_PrintHex<uint8_t > (btInitConfigState, 0x80);
+                                                                Notify(PSTR("\r\nset next command in init config"), 0x80);
 #endif
+                                                        }
+                                                } else {
+                                                        //ignore EV_COMMAND_COMPLETE from commands not used in init
+                                                        break;
                                                 }
-                                        } else {
-                                                //ignore EV_COMMAND_COMPLETE from commands not used in init
-                                                break;
-                                        }
 
-                                } else { // not init (init is already over)
+                                        } else { // not init (init is already over)
 #ifdef EXTRADEBUG
-                                        Notify(PSTR("\r\ncommand complete event"), 0x80);
+                                                Notify(PSTR("\r\ncommand complete event"), 0x80);
 #endif
-                                        if(status == 0x00) { // Check if command succeeded
-                                                hci_set_flag(HCI_FLAG_CMD_COMPLETE); // Set command complete flag
+                                                if(status == 0x00) { // Check if command succeeded
+                                                        hci_set_flag(HCI_FLAG_CMD_COMPLETE); // Set command complete flag
 #ifdef EXTRADEBUG
-                                                Notify(PSTR("\r\ncommand succeeded"), 0x80);
+                                                        Notify(PSTR("\r\ncommand succeeded"), 0x80);
 #endif
-                                        } else {
+                                                } else {
 #ifdef DEBUG_USB_HOST
-                                                Notify(PSTR("\r\ncommand failed"), 0x80);
-                                                Notify(PSTR("\r\nError Code :"), 0x80);
-                                                D_PrintHex<uint8_t > (status, 0x80);
+                                                        Notify(PSTR("\r\ncommand failed"), 0x80);
+                                                        Notify(PSTR("\r\nError Code :"), 0x80);
+                                                        D_PrintHex<uint8_t > (status, 0x80);
 #endif
-                                                // flag_hci_error
+                                                        // flag_hci_error
+                                                }
                                         }
+                                        break;
                                 }
-                                break;
 
 
                         case EV_COMMAND_STATUS:
@@ -1313,7 +1342,7 @@ void BTDSSP::HCI_event_task() {
 
 void BTDSSP::ACL_event_task() {
         uint16_t length = BULK_MAXPKTSIZE;
-        uint8_t rcode = pUsb->inTransfer(bAddress, epInfo[ BTDSSP_DATAIN_PIPE ].epAddr, &length, l2capinbuf, pollInterval); // Input on endpoint 2
+        uint8_t rcode = pUsb->inTransfer(bAddress, epInfo[ BTDSSP_DATAIN_PIPE ].epAddr, &length, l2capinbuf); // Input on endpoint 2 - a bulk pipe, so no delay between packets
 
         if(!rcode) { // Check for errors
                 if(length > 0) { // Check if any data was read
@@ -1403,11 +1432,11 @@ void BTDSSP::hci_read_bdaddr() {
 #ifdef EXTRADEBUG
         Notify(PSTR("\r\nhci_read_bdaddr();"), 0x80);
 #endif
-        hcibuf[0] = 0x09; // HCI OCF = 9
-        hcibuf[1] = 0x04 << 2; // HCI OGF = 4
-        hcibuf[2] = 0x00;
+        hcioutbuf[0] = 0x09; // HCI OCF = 9
+        hcioutbuf[1] = 0x04 << 2; // HCI OGF = 4
+        hcioutbuf[2] = 0x00;
 
-        HCI_Command(hcibuf, 3);
+        HCI_Command(hcioutbuf, 3);
 }
 
 
@@ -208,7 +208,7 @@ class BluetoothService;
  * The Bluetooth Dongle class will take care of all the USB communication
  * and then pass the data to the BluetoothService classes.
  */
-class BTDSSP : public USBDeviceConfig, public UsbConfigXtracter {
+class BTDSSP : public USBDeviceConfig, public UsbConfigXtracter, public USBXferHandler {
 public:
         /**
          * Constructor for the BTDSSP class.
@@ -281,6 +281,14 @@ public:
         void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep);
         /**@}*/
 
+        /** @name USBXferHandler implementation */
+        /**
+         * Called from USB::Task() when the read of the HCI event pipe has finished.
+         * @param req The request of the HCI event pipe.
+         */
+        void XferDone(USBXferReq *req);
+        /**@}*/
+
         /** Disconnects both the L2CAP Channel and the HCI Connection for all Bluetooth services. */
         void disconnect();
 
@@ -541,6 +549,8 @@ protected:
         uint8_t bNumEP;
         /** Next poll time based on poll interval taken from the USB descriptor. */
         uint32_t qNextPollTime;
+        /** End of the wait before the dongle gets its address, see Init(). */
+        uint32_t qInitTime;
 
         /** Bluetooth dongle control endpoint. */
         static const uint8_t BTDSSP_CONTROL_PIPE;
@@ -565,6 +575,9 @@ private:
 
         uint8_t pollInterval;
         bool bPollEnable;
+        bool bPollScheduled; // Polled by the frame scheduler of the USB class
+        bool bInitWait; // Init() is waiting for qInitTime
+        bool bInitAddressed; // Init() has given the dongle its address
 
 //      bool checkRemoteName; // Used to check remote device's name before connecting.
         uint8_t classOfDevice[3]; // Class of device of last device
@@ -597,13 +610,14 @@ private:
        /* ----------------------------- */
 
         uint8_t hcibuf[BULK_MAXPKTSIZE]; // General purpose buffer for HCI data
+        USBXferReq hciEventReq; // Read of the HCI event pipe into hcibuf
         uint8_t hcioutbuf[BULK_MAXPKTSIZE]; // General purpose buffer for HCI out data
         uint8_t l2capinbuf[BULK_MAXPKTSIZE]; // General purpose buffer for L2CAP in data
         uint8_t l2capoutbuf[14]; // General purpose buffer for L2CAP out data
 
         /* State machines */
         void HCI_task(); // HCI state machine
-        void HCI_event_task(); // Poll the HCI event pipe
+        void HCI_event_task(uint8_t rcode, uint16_t length); // Handle an event from the HCI event pipe
         void ACL_event_task(); // ACL input pipe
 
 };
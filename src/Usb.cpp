@@ -18,12 +18,72 @@ e-mail   :  support@circuitsathome.com
 
 #include "Usb.h"
 
-static uint8_t usb_error = 0;
-static uint8_t usb_task_state;
+/* nak_limit = ( 2^power - 1), see address.h */
+static uint16_t NakLimit(uint8_t power) {
+        return (0x0001UL << ((power > USB_NAK_MAX_POWER) ? USB_NAK_MAX_POWER : power)) - 1;
+}
+
+#if ENABLE_UHS_TELEMETRY
+#define USB_TELEMETRY_INC(x) do { if(xferTelemetry) xferTelemetry->x++; } while(0)
+#else
+#define USB_TELEMETRY_INC(x) ((void)0)
+#endif
 
 /* constructor */
-USB::USB() : bmHubPre(0) {
+USB::USB() : bmHubPre(0), xferRun(NULL), xferKeep(NULL), xferKeepTail(&xferKeep), xferFrame(0), frameBase(0), taskBudget(false), taskPollNext(0), usb_error(0), taskDelay(0), addrRecovery(USB_SET_ADDRESS_DELAY) {
         usb_task_state = USB_DETACHED_SUBSTATE_INITIALIZE; //set up state machine
+        enumState.state = USB_ENUM_STATE_IDLE;
+        for(uint8_t i = 0; i < USB_XFER_CLASSES; i++) {
+                xferQueue[i] = NULL;
+                xferUsed[i] = 0;
+        }
+        xferShare[USB_XFER_CLASS_INTR] = USB_XFER_SHARE_INTR;
+        xferShare[USB_XFER_CLASS_CTRL] = USB_XFER_SHARE_CTRL;
+        xferShare[USB_XFER_CLASS_BULK] = USB_XFER_SHARE_BULK;
+        for(uint8_t i = 0; i < USB_NUMPERIODIC; i++)
+                periodic[i].pdev = NULL;
+#if USE_UHS_ADAPTIVE_NAK
+        for(uint8_t i = 0; i < USB_NUMNAKSTATS; i++)
+                nakStats[i].addr = 0;
+        nakStatsNext = 0;
+        xferNaks = 0;
+        nakAdapted = false;
+        xferCut = false;
+#endif
+#if USE_UHS_STALL_RECOVERY
+        memset(&recoveryStats, 0, sizeof (recoveryStats));
+#endif
+#if ENABLE_UHS_TELEMETRY
+        xferTelemetry = NULL;
+        xferStart = 0;
+        taskMaxTime = 0;
+#endif
+#if USE_UHS_ISO
+        isoList = NULL;
+#endif
+#if USE_UHS_ACTIVE_POLL
+        activeCount = 0;
+#endif
+#if USE_UHS_EVENTS
+        eventHead = 0;
+        eventCount = 0;
+        for(uint8_t i = 0; i < USB_NUMDEVICES; i++)
+                eventAddr[i] = 0;
+        for(uint8_t i = 0; i < USB_NUMEVENTHANDLERS; i++)
+                eventHandlers[i] = NULL;
+#endif
+#if USE_UHS_BIND_CACHE
+        for(uint8_t i = 0; i < USB_NUMBINDCACHE; i++)
+                bindCache[i].driver = USB_NUMDEVICES;
+        bindCacheNext = 0;
+#endif
+#if ENABLE_UHS_CAPTURE
+        captureHead = 0;
+        captureCount = 0;
+        captureAddr = 0;
+        captureOn = false;
+        captureSeq = 0;
+#endif
         init();
 }
 
@@ -41,7 +101,45 @@ void USB::setUsbTaskState(uint8_t state) {
         usb_task_state = state;
 }
 
+uint8_t USB::suspend() {
+        if(usb_task_state == USB_DETACHED_SUBSTATE_WAIT_FOR_DEVICE)
+                usb_task_state = USB_DETACHED_SUBSTATE_SUSPENDED;
+        else if(usb_task_state == USB_STATE_RUNNING && !isEnumerating()) {
+                for(uint8_t i = 0; i < USB_NUMDEVICES; i++)
+                        if(devConfig[i])
+                                devConfig[i]->Suspend();
+
+                regWr(rMODE, regRd(rMODE) & ~bmSOFKAENAB); // the devices suspend after 3ms without SOFs
+                usb_task_state = USB_STATE_SUSPENDED;
+        } else
+                return USB_ERROR_INVALID_BUS_STATE;
+
+        powerDown();
+        return 0;
+}
+
+uint8_t USB::resume() {
+        if(usb_task_state != USB_STATE_SUSPENDED && usb_task_state != USB_DETACHED_SUBSTATE_SUSPENDED)
+                return USB_ERROR_INVALID_BUS_STATE;
+
+        if(isPoweredDown())
+                powerUp();
+        if(usb_task_state == USB_STATE_SUSPENDED) {
+                regWr(rHCTL, bmSIGRSM); // 20ms of resume signaling, Task() starts the SOFs when it is over
+                usb_task_state = USB_SUSPENDED_SUBSTATE_RESUME;
+        } else
+                usb_task_state = USB_DETACHED_SUBSTATE_WAIT_FOR_DEVICE;
+        return 0;
+}
+
+bool USB::isSuspended() {
+        return (usb_task_state & USB_STATE_MASK) == USB_STATE_SUSPENDED || usb_task_state == USB_DETACHED_SUBSTATE_SUSPENDED;
+}
+
 EpInfo* USB::getEpInfoEntry(uint8_t addr, uint8_t ep) {
+#if USE_UHS_ADDRESS_MAP
+        return addrPool.GetEpInfo(addr, ep);
+#else
         UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
 
         if(!p || !p->epinfo)
@@ -56,6 +154,7 @@ EpInfo* USB::getEpInfoEntry(uint8_t addr, uint8_t ep) {
                 pep++;
         }
         return NULL;
+#endif
 }
 
 /* set device table entry */
@@ -73,6 +172,9 @@ uint8_t USB::setEpInfoEntry(uint8_t addr, uint8_t epcount, EpInfo* eprecord_ptr)
         p->address.devAddress = addr;
         p->epinfo = eprecord_ptr;
         p->epcount = epcount;
+#if USE_UHS_ADAPTIVE_NAK
+        NakStatsClear(addr); // history of an earlier device at this address
+#endif
 
         return 0;
 }
@@ -91,8 +193,14 @@ uint8_t USB::SetAddress(uint8_t addr, uint8_t ep, EpInfo **ppep, uint16_t *nak_l
         if(!*ppep)
                 return USB_ERROR_EP_NOT_FOUND_IN_TBL;
 
-        *nak_limit = (0x0001UL << (((*ppep)->bmNakPower > USB_NAK_MAX_POWER) ? USB_NAK_MAX_POWER : (*ppep)->bmNakPower));
-        (*nak_limit)--;
+        *nak_limit = NakLimit((*ppep)->bmNakPower);
+#if ENABLE_UHS_TELEMETRY
+        xferTelemetry = addrPool.GetEpTelemetry(addr, ep, true);
+        xferStart = millis();
+#endif
+#if ENABLE_UHS_CAPTURE
+        captureAddr = addr;
+#endif
         /*
           USBTRACE2("\r\nAddress: ", addr);
           USBTRACE2(" EP: ", ep);
@@ -127,6 +235,7 @@ uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bReque
         uint16_t wInd, uint16_t total, uint16_t nbytes, uint8_t* dataptr, USBReadParser *p) {
         bool direction = false; //request direction, IN or OUT
         uint8_t rcode;
+        uint16_t count = 0; // data stage bytes moved
         SETUP_PKT setup_pkt;
 
         EpInfo *pep = NULL;
@@ -150,11 +259,15 @@ uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bReque
         bytesWr(rSUDFIFO, 8, (uint8_t*) & setup_pkt); //transfer to setup packet FIFO
 
         rcode = dispatchPkt(tokSETUP, ep, nak_limit); //dispatch packet
+        CaptureData((uint8_t*) & setup_pkt, 8);
 
         if(rcode) //return HRSLT if not zero
-                return ( rcode);
+                return XferResult(rcode, 0);
+
+        // A streaming parser takes the IN data stage straight from the FIFO, see USBReadParser
+        bool stream = (direction && p && p->Streams());
 
-        if(dataptr != NULL) //data stage, if present
+        if(dataptr != NULL || stream) //data stage, if present
         {
                 if(direction) //IN transfer
                 {
@@ -167,38 +280,40 @@ uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bReque
 #if defined(ESP8266) || defined(ESP32)
                         yield(); // needed in order to reset the watchdog timer on the ESP8266
 #endif
-                                uint16_t read = nbytes;
+                                uint16_t read = (stream) ? left : nbytes;
                                 //uint16_t read = (left<nbytes) ? left : nbytes;
 
-                                rcode = InTransfer(pep, nak_limit, &read, dataptr);
+                                rcode = InTransfer(pep, nak_limit, &read, dataptr, 0, (stream) ? p : NULL);
                                 if(rcode == hrTOGERR) {
-                                        // yes, we flip it wrong here so that next time it is actually correct!
-                                        pep->bmRcvToggle = (regRd(rHRSL) & bmSNDTOGRD) ? 0 : 1;
+                                        ToggleResync(pep, true);
                                         continue;
                                 }
 
                                 if(rcode)
-                                        return rcode;
+                                        return XferResult(rcode, count);
 
                                 // Invoke callback function if inTransfer completed successfully and callback function pointer is specified
-                                if(!rcode && p)
+                                if(!rcode && p && !stream)
                                         ((USBReadParser*)p)->Parse(read, dataptr, total - left);
 
                                 left -= read;
+                                count += read;
 
-                                if(read < nbytes)
+                                if(stream || read < nbytes)
                                         break;
                         }
                 } else //OUT transfer
                 {
                         pep->bmSndToggle = 1; //bmSNDTOG1;
                         rcode = OutTransfer(pep, nak_limit, nbytes, dataptr);
+                        count = nbytes;
                 }
                 if(rcode) //return error
-                        return ( rcode);
+                        return XferResult(rcode, (direction) ? count : 0);
         }
         // Status stage
-        return dispatchPkt((direction) ? tokOUTHS : tokINHS, ep, nak_limit); //GET if direction
+        rcode = dispatchPkt((direction) ? tokOUTHS : tokINHS, ep, nak_limit); //GET if direction
+        return XferResult(rcode, count);
 }
 
 /* IN transfer to arbitrary endpoint. Assumes PERADDR is set. Handles multiple packets if necessary. Transfers 'nbytes' bytes. */
@@ -209,6 +324,8 @@ uint8_t USB::ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bReque
 uint8_t USB::inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t* data, uint8_t bInterval /*= 0*/) {
         EpInfo *pep = NULL;
         uint16_t nak_limit = 0;
+        uint16_t nbytes = *nbytesptr;
+        uint8_t stalls = 0;
 
         uint8_t rcode = SetAddress(addr, ep, &pep, &nak_limit);
 
@@ -218,10 +335,21 @@ uint8_t USB::inTransfer(uint8_t addr, uint8_t ep, uint16_t *nbytesptr, uint8_t*
                 USBTRACE3("(USB::InTransfer) ep requested ", ep, 0x81);
                 return rcode;
         }
-        return InTransfer(pep, nak_limit, nbytesptr, data, bInterval);
+        do {
+                *nbytesptr = nbytes;
+#if USE_UHS_ADAPTIVE_NAK
+                uint32_t start = millis();
+                rcode = InTransfer(pep, NakAdapt(addr, pep, nak_limit), nbytesptr, data, bInterval);
+                NakLearn(addr, pep, rcode, start);
+#else
+                rcode = InTransfer(pep, nak_limit, nbytesptr, data, bInterval);
+#endif
+                // A halted endpoint is cleared, the transfer is only tried again if no data was lost
+        } while(rcode == hrSTALL && StallRecover(addr, ep, true, !*nbytesptr && stalls++ < USB_STALL_RETRY_LIMIT, &pep, &nak_limit));
+        return XferResult(rcode, *nbytesptr);
 }
 
-uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, uint8_t* data, uint8_t bInterval /*= 0*/) {
+uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, uint8_t* data, uint8_t bInterval /*= 0*/, USBReadParser *stream /*= NULL*/) {
         uint8_t rcode = 0;
         uint8_t pktsize;
 
@@ -232,16 +360,30 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
         *nbytesptr = 0;
         regWr(rHCTL, (pep->bmRcvToggle) ? bmRCVTOG1 : bmRCVTOG0); //set toggle value
 
+#if USE_UHS_PIPELINED_IN
+        bool launched = false; // the next IN token was sent while the previous packet was read out
+#endif
+
         // use a 'break' to exit this loop
         while(1) {
 #if defined(ESP8266) || defined(ESP32)
                         yield(); // needed in order to reset the watchdog timer on the ESP8266
+#endif
+#if USE_UHS_PIPELINED_IN
+                if(launched) {
+                        launched = false;
+                        uint8_t hrsl;
+                        rcode = USB_ERROR_TRANSFER_TIMEOUT;
+                        if(waitXfrDone((uint32_t)millis() + USB_XFER_TIMEOUT, &hrsl))
+                                rcode = (hrsl & 0x0f);
+                        Capture(tokIN, pep->epAddr, rcode, NULL, 0);
+                        if(rcode == hrNAK || rcode == hrTIMEOUT) // let dispatchPkt() take care of the retries
+                                rcode = dispatchPkt(tokIN, pep->epAddr, nak_limit);
+                } else
 #endif
                 rcode = dispatchPkt(tokIN, pep->epAddr, nak_limit); //IN packet to EP-'endpoint'. Function takes care of NAKS.
                 if(rcode == hrTOGERR) {
-                        // yes, we flip it wrong here so that next time it is actually correct!
-                        pep->bmRcvToggle = (regRd(rHRSL) & bmRCVTOGRD) ? 0 : 1;
-                        regWr(rHCTL, (pep->bmRcvToggle) ? bmRCVTOG1 : bmRCVTOG0); //set toggle value
+                        ToggleResync(pep, true);
                         continue;
                 }
                 if(rcode) {
@@ -254,13 +396,26 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
                  *
                  * NOTE: I've seen this happen with SPI corruption -- xxxajk
                  */
-                if((regRd(rHIRQ) & bmRCVDAVIRQ) == 0) {
+                MAX3421eRegOp rcv[2] = {
+                        { MAX3421E_RD(rHIRQ), 0 },
+                        { MAX3421E_RD(rRCVBC), 0 } //number of received bytes
+                };
+                regBatch(rcv, 2);
+                if((rcv[0].data & bmRCVDAVIRQ) == 0) {
                         //printf(">>>>>>>> Problem! NO RCVDAVIRQ!\r\n");
                         rcode = 0xf0; //receive error
                         break;
                 }
-                pktsize = regRd(rRCVBC); //number of received bytes
+                pktsize = rcv[1].data;
                 //printf("Got %i bytes \r\n", pktsize);
+#if USE_UHS_PIPELINED_IN
+                // A full packet and more to come: the other receive FIFO is free, so the next IN
+                // goes on the wire while this packet is read out over SPI
+                if(pktsize == maxpktsize && *nbytesptr + pktsize < nbytes && !bInterval) {
+                        regWr(rHXFR, (tokIN | pep->epAddr));
+                        launched = true;
+                }
+#endif
                 // This would be OK, but...
                 //assert(pktsize <= nbytes);
                 if(pktsize > nbytes) {
@@ -275,10 +430,21 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
                 if(mem_left < 0)
                         mem_left = 0;
 
-                data = bytesRd(rRCVFIFO, ((pktsize > mem_left) ? mem_left : pktsize), data);
+                uint8_t nread = (pktsize > mem_left) ? mem_left : pktsize;
+
+                if(stream)
+                        StreamRd(stream, nread);
+                else {
+                        data = bytesRd(rRCVFIFO, nread, data);
+                        CaptureData(data - nread, nread);
+                }
 
                 regWr(rHIRQ, bmRCVDAVIRQ); // Clear the IRQ & free the buffer
                 *nbytesptr += pktsize; // add this packet's byte count to total transfer length
+#if USE_UHS_ADAPTIVE_NAK
+                if(nakAdapted)
+                        nak_limit = NakLimit(pep->bmNakPower); // the device is sending, the rest may wait the full limit
+#endif
 
                 /* The transfer is complete under two conditions:           */
                 /* 1. The device sent a short packet (L.T. maxPacketSize)   */
@@ -296,20 +462,61 @@ uint8_t USB::InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, ui
         return ( rcode);
 }
 
+/* Hands 'nbytes' of the receive FIFO to a streaming parser, straight into the buffers it asks for,  */
+/* in one FIFO read. Bytes it skips at the end of the packet are not clocked out at all, freeing the */
+/* buffer drops them. The capture does not see streamed data.                                        */
+void USB::StreamRd(USBReadParser *p, uint8_t nbytes) {
+        bool reading = false;
+
+        while(nbytes) {
+                uint16_t n = nbytes;
+                uint8_t *dst = p->StreamBuffer(&n);
+
+                if(!n || n > nbytes)
+                        break; // the parser is done, drop the rest
+
+                if(dst || n < nbytes) {
+                        if(!reading) {
+                                fifoRdBegin(rRCVFIFO);
+                                reading = true;
+                        }
+                        fifoRd(n, dst);
+                }
+                p->StreamDone(n);
+                nbytes -= n;
+        }
+        if(reading)
+                fifoRdEnd();
+}
+
 /* OUT transfer to arbitrary endpoint. Handles multiple packets if necessary. Transfers 'nbytes' bytes. */
 /* Handles NAK bug per Maxim Application Note 4000 for single buffer transfer   */
+/* With USE_UHS_PIPELINED_OUT the next packet is loaded into the second SNDFIFO */
+/* buffer while the current one is on the wire. Every wait ends at the timeout. */
 
 /* rcode 0 if no errors. rcode 01-0f is relayed from HRSL                       */
 uint8_t USB::outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data) {
         EpInfo *pep = NULL;
         uint16_t nak_limit = 0;
+        uint8_t stalls = 0;
 
         uint8_t rcode = SetAddress(addr, ep, &pep, &nak_limit);
 
         if(rcode)
                 return rcode;
 
-        return OutTransfer(pep, nak_limit, nbytes, data);
+        do {
+#if USE_UHS_ADAPTIVE_NAK
+                uint32_t start = millis();
+                rcode = OutTransfer(pep, NakAdapt(addr, pep, nak_limit), nbytes, data);
+                NakLearn(addr, pep, rcode, start);
+#else
+                rcode = OutTransfer(pep, nak_limit, nbytes, data);
+#endif
+                // A STALL after the first packet may come after the device took some of the data,
+                // only a single packet transfer is sure to be sent once when it is tried again
+        } while(rcode == hrSTALL && StallRecover(addr, ep, false, nbytes <= pep->maxPktSize && stalls++ < USB_STALL_RETRY_LIMIT, &pep, &nak_limit));
+        return XferResult(rcode, (rcode) ? 0 : nbytes);
 }
 
 uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8_t *data) {
@@ -317,6 +524,8 @@ uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8
         uint8_t *data_p = data; //local copy of the data pointer
         uint16_t bytes_tosend, nak_count;
         uint16_t bytes_left = nbytes;
+        uint8_t hrsl;
+        bool staged = false; // the packet is already in the SNDFIFO
 
         uint8_t maxpktsize = pep->maxPktSize;
 
@@ -334,16 +543,28 @@ uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8
                 retry_count = 0;
                 nak_count = 0;
                 bytes_tosend = (bytes_left >= maxpktsize) ? maxpktsize : bytes_left;
-                bytesWr(rSNDFIFO, bytes_tosend, data_p); //filling output FIFO
-                regWr(rSNDBC, bytes_tosend); //set number of bytes
-                regWr(rHXFR, (tokOUT | pep->epAddr)); //dispatch packet
-                while(!(regRd(rHIRQ) & bmHXFRDNIRQ)){
-#if defined(ESP8266) || defined(ESP32)
-                        yield(); // needed in order to reset the watchdog timer on the ESP8266
+                if(!staged)
+                        bytesWr(rSNDFIFO, bytes_tosend, data_p); //filling output FIFO
+                staged = false;
+                MAX3421eRegOp launch[2] = {
+                        { MAX3421E_WR(rSNDBC), (uint8_t)bytes_tosend }, //set number of bytes
+                        { MAX3421E_WR(rHXFR), (uint8_t)(tokOUT | pep->epAddr) } //dispatch packet
+                };
+                regBatch(launch, 2);
+#if USE_UHS_PIPELINED_OUT
+                if(bytes_left > bytes_tosend) {
+                        // The other buffer is free once SNDBC is written, fill it while this packet is on the wire
+                        uint16_t next_left = bytes_left - bytes_tosend;
+                        bytesWr(rSNDFIFO, (next_left >= maxpktsize) ? maxpktsize : next_left, data_p + bytes_tosend);
+                        staged = true;
+                }
 #endif
-                } //wait for the completion IRQ
-                regWr(rHIRQ, bmHXFRDNIRQ); //clear IRQ
-                rcode = (regRd(rHRSL) & 0x0f);
+                if(!waitXfrDone(timeout, &hrsl)) { //wait for the completion IRQ
+                        rcode = USB_ERROR_TRANSFER_TIMEOUT;
+                        goto breakout;
+                }
+                rcode = (hrsl & 0x0f);
+                Capture(tokOUT, pep->epAddr, rcode, data_p, bytes_tosend);
 
                 while(rcode && ((int32_t)((uint32_t)millis() - timeout) < 0L)) {
 #if defined(ESP8266) || defined(ESP32)
@@ -352,40 +573,51 @@ uint8_t USB::OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8
                         switch(rcode) {
                                 case hrNAK:
                                         nak_count++;
+                                        USB_TELEMETRY_INC(naks);
+#if USE_UHS_ADAPTIVE_NAK
+                                        xferNaks++;
+#endif
                                         if(nak_limit && (nak_count == nak_limit))
                                                 goto breakout;
                                         //return ( rcode);
                                         break;
                                 case hrTIMEOUT:
                                         retry_count++;
+                                        USB_TELEMETRY_INC(retries);
                                         if(retry_count == USB_RETRY_LIMIT)
                                                 goto breakout;
                                         //return ( rcode);
                                         break;
                                 case hrTOGERR:
-                                        // yes, we flip it wrong here so that next time it is actually correct!
-                                        pep->bmSndToggle = (regRd(rHRSL) & bmSNDTOGRD) ? 0 : 1;
-                                        regWr(rHCTL, (pep->bmSndToggle) ? bmSNDTOG1 : bmSNDTOG0); //set toggle value
+                                        ToggleResync(pep, false);
                                         break;
                                 default:
                                         goto breakout;
                         }//switch( rcode
 
                         /* process NAK according to Host out NAK bug */
-                        regWr(rSNDBC, 0);
-                        regWr(rSNDFIFO, *data_p);
-                        regWr(rSNDBC, bytes_tosend);
-                        regWr(rHXFR, (tokOUT | pep->epAddr)); //dispatch packet
-                        while(!(regRd(rHIRQ) & bmHXFRDNIRQ)){
-#if defined(ESP8266) || defined(ESP32)
-                        yield(); // needed in order to reset the watchdog timer on the ESP8266
-#endif
-                        } //wait for the completion IRQ
-                        regWr(rHIRQ, bmHXFRDNIRQ); //clear IRQ
-                        rcode = (regRd(rHRSL) & 0x0f);
+                        MAX3421eRegOp resend[4] = {
+                                { MAX3421E_WR(rSNDBC), 0 },
+                                { MAX3421E_WR(rSNDFIFO), *data_p },
+                                { MAX3421E_WR(rSNDBC), (uint8_t)bytes_tosend },
+                                { MAX3421E_WR(rHXFR), (uint8_t)(tokOUT | pep->epAddr) } //dispatch packet
+                        };
+                        regBatch(resend, 4);
+                        // The CPU has the NAKed packet's buffer now, the staged packet is loaded again later
+                        staged = false;
+                        if(!waitXfrDone(timeout, &hrsl)) { //wait for the completion IRQ
+                                rcode = USB_ERROR_TRANSFER_TIMEOUT;
+                                goto breakout;
+                        }
+                        rcode = (hrsl & 0x0f);
+                        Capture(tokOUT, pep->epAddr, rcode, data_p, bytes_tosend);
                 }//while( rcode && ....
                 bytes_left -= bytes_tosend;
                 data_p += bytes_tosend;
+#if USE_UHS_ADAPTIVE_NAK
+                if(nakAdapted)
+                        nak_limit = NakLimit(pep->bmNakPower); // the device is accepting, the rest may wait the full limit
+#endif
         }//while( bytes_left...
 breakout:
         /* If rcode(=rHRSL) is non-zero, untransmitted data remains in the SNDFIFO. */
@@ -397,6 +629,63 @@ breakout:
         pep->bmSndToggle = (regRd(rHRSL) & bmSNDTOGRD) ? 1 : 0; //bmSNDTOG1 : bmSNDTOG0;  //update toggle
         return ( rcode); //should be 0 in all cases
 }
+/* Data toggle resync after hrTOGERR. Yes, the toggle is flipped wrong here, so that after the packet */
+/* that is sent or taken again it is actually correct.                                               */
+void USB::ToggleResync(EpInfo *pep, bool in) {
+        uint8_t hrsl = regRd(rHRSL);
+
+        USB_TELEMETRY_INC(togErrors);
+#if USE_UHS_STALL_RECOVERY
+        recoveryStats.togResyncs++;
+#endif
+        if(in) {
+                pep->bmRcvToggle = (hrsl & bmRCVTOGRD) ? 0 : 1;
+                regWr(rHCTL, (pep->bmRcvToggle) ? bmRCVTOG1 : bmRCVTOG0); //set toggle value
+        } else {
+                pep->bmSndToggle = (hrsl & bmSNDTOGRD) ? 0 : 1;
+                regWr(rHCTL, (pep->bmSndToggle) ? bmSNDTOG1 : bmSNDTOG0); //set toggle value
+        }
+}
+
+uint8_t USB::clearEpHalt(uint8_t addr, uint8_t ep) {
+        uint8_t rcode = ctrlReq(addr, 0, bmREQ_SET_EP, USB_REQUEST_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, 0x00, ep, 0x0000, 0x0000, NULL, NULL);
+
+        if(rcode)
+                return rcode;
+
+        // The device starts the endpoint over with DATA0
+        EpInfo *pep = getEpInfoEntry(addr, ep & 0x7f);
+
+        if(pep) {
+                if(ep & 0x80)
+                        pep->bmRcvToggle = 0;
+                else
+                        pep->bmSndToggle = 0;
+        }
+#if USE_UHS_STALL_RECOVERY
+        recoveryStats.cleared++;
+#endif
+        return 0;
+}
+
+#if USE_UHS_STALL_RECOVERY
+/* A bulk or interrupt endpoint answered with a STALL. Its halt is cleared, which costs a control transfer */
+/* instead of the re-enumeration a driver does when an error reaches it. Returns true if the transfer is   */
+/* to be tried again, 'retry' says if it may, the endpoint is set up for it then.                          */
+bool USB::StallRecover(uint8_t addr, uint8_t ep, bool in, bool retry, EpInfo **ppep, uint16_t *nak_limit) {
+        if(!ep)
+                return false; // a control pipe STALL ends with the next SETUP
+
+        recoveryStats.stalls++;
+        if(clearEpHalt(addr, (in) ? ep | 0x80 : ep))
+                return false;
+        if(!retry || SetAddress(addr, ep, ppep, nak_limit))
+                return false;
+        recoveryStats.retried++;
+        return true;
+}
+#endif
+
 /* dispatch USB packet. Assumes peripheral address is set and relevant buffer is loaded/empty       */
 /* If NAK, tries to re-send up to nak_limit times                                                   */
 /* If nak_limit == 0, do not count NAKs, exit after timeout                                         */
@@ -405,46 +694,43 @@ breakout:
 /* return codes 0x00-0x0f are HRSLT( 0x00 being success ), 0xff means timeout                       */
 uint8_t USB::dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit) {
         uint32_t timeout = (uint32_t)millis() + USB_XFER_TIMEOUT;
-        uint8_t tmpdata;
         uint8_t rcode = hrSUCCESS;
         uint8_t retry_count = 0;
         uint16_t nak_count = 0;
+        uint8_t hrsl;
 
         while((int32_t)((uint32_t)millis() - timeout) < 0L) {
 #if defined(ESP8266) || defined(ESP32)
                         yield(); // needed in order to reset the watchdog timer on the ESP8266
 #endif
                 regWr(rHXFR, (token | ep)); //launch the transfer
-                rcode = USB_ERROR_TRANSFER_TIMEOUT;
 
-                while((int32_t)((uint32_t)millis() - timeout) < 0L) //wait for transfer completion
-                {
-#if defined(ESP8266) || defined(ESP32)
-                        yield(); // needed in order to reset the watchdog timer on the ESP8266
-#endif
-                        tmpdata = regRd(rHIRQ);
-
-                        if(tmpdata & bmHXFRDNIRQ) {
-                                regWr(rHIRQ, bmHXFRDNIRQ); //clear the interrupt
-                                rcode = 0x00;
-                                break;
-                        }//if( tmpdata & bmHXFRDNIRQ
-
-                }//while ( millis() < timeout
-
-                //if (rcode != 0x00) //exit if timeout
-                //        return ( rcode);
+                //wait for transfer completion, the result is read along with clearing the IRQ
+                if(!waitXfrDone(timeout, &hrsl))
+                        hrsl = regRd(rHRSL);
 
-                rcode = (regRd(rHRSL) & 0x0f); //analyze transfer result
+                rcode = (hrsl & 0x0f); //analyze transfer result
+                Capture(token, ep, rcode, NULL, 0);
 
                 switch(rcode) {
                         case hrNAK:
                                 nak_count++;
+                                USB_TELEMETRY_INC(naks);
+#if USE_UHS_ADAPTIVE_NAK
+                                xferNaks++;
+#endif
                                 if(nak_limit && (nak_count == nak_limit))
                                         return (rcode);
+                                if(ep && TaskTimeUp()) { // the budget of Task() is used up, don't wait for this pipe
+#if USE_UHS_ADAPTIVE_NAK
+                                        xferCut = true;
+#endif
+                                        return (rcode);
+                                }
                                 break;
                         case hrTIMEOUT:
                                 retry_count++;
+                                USB_TELEMETRY_INC(retries);
                                 if(retry_count == USB_RETRY_LIMIT)
                                         return (rcode);
                                 break;
@@ -456,16 +742,859 @@ uint8_t USB::dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit) {
         return ( rcode);
 }
 
+/* Asynchronous transfers. A request is queued by one of the submit functions and advanced from Task().  */
+/* Every queued request gets one turn per Task() call; a NAK ends the turn instead of being retried in a  */
+/* loop, so NAKing endpoints no longer stall the sketch. The NAK limit of the endpoint and               */
+/* USB_XFER_TIMEOUT apply to the whole request just like for the blocking transfers.                     */
+/* Requests are queued by priority class: interrupt, then control, then bulk. In every frame a class     */
+/* may start requests until its share, plus what the classes above it left over, is used up; the rest    */
+/* wait for the next frame.                                                                              */
+uint8_t USB::submitInTransfer(USBXferReq *req, uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data, USBXferHandler *handler, uint8_t xclass) {
+        if(!nbytes)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        return SubmitXfer(req, USB_XFER_TYPE_IN, xclass, addr, ep, nbytes, data, handler);
+}
+
+uint8_t USB::submitOutTransfer(USBXferReq *req, uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data, USBXferHandler *handler, uint8_t xclass) {
+        if(!nbytes)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        return SubmitXfer(req, USB_XFER_TYPE_OUT, xclass, addr, ep, nbytes, data, handler);
+}
+
+uint8_t USB::submitCtrlReq(USBXferReq *req, uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
+        uint16_t wInd, uint16_t nbytes, uint8_t* dataptr, USBXferHandler *handler) {
+        if(!req)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        /* fill in setup packet */
+        SETUP_PKT setup_pkt;
+        setup_pkt.ReqType_u.bmRequestType = bmReqType;
+        setup_pkt.bRequest = bRequest;
+        setup_pkt.wVal_u.wValueLo = wValLo;
+        setup_pkt.wVal_u.wValueHi = wValHi;
+        setup_pkt.wIndex = wInd;
+        setup_pkt.wLength = nbytes;
+
+        uint8_t rcode = SubmitXfer(req, USB_XFER_TYPE_CTRL, USB_XFER_CLASS_CTRL, addr, ep, nbytes, dataptr, handler);
+        if(!rcode)
+                req->setup = setup_pkt;
+        return rcode;
+}
+
+/* Returns the link that points to a queued request, NULL if it is not queued. A handler may cancel or   */
+/* submit requests while XferTask() or AbortXfers() runs, so the lists these work on are searched too.   */
+USBXferReq **USB::FindXfer(USBXferReq *req) {
+        for(uint8_t c = 0; c <= USB_XFER_CLASSES + 1; c++) {
+                USBXferReq **pp = (c < USB_XFER_CLASSES) ? &xferQueue[c] : (c == USB_XFER_CLASSES) ? &xferRun : &xferKeep;
+
+                for(; *pp; pp = &(*pp)->next)
+                        if(*pp == req)
+                                return pp;
+        }
+        return NULL;
+}
+
+bool USB::cancelTransfer(USBXferReq *req) {
+        USBXferReq **pp = FindXfer(req);
+
+        if(!pp)
+                return false;
+
+        *pp = req->next;
+        if(xferKeepTail == &req->next)
+                xferKeepTail = pp;
+        req->next = NULL;
+        req->state = USB_XFER_STATE_IDLE;
+        req->rcode = USB_ERROR_TRANSFER_ABORTED;
+        return true;
+}
+
+/* Sets the microseconds of each 1ms frame the requests of a class may use. A request that is started   */
+/* runs its turn to the end, so a class can overrun its share by one turn.                             */
+uint8_t USB::setXferShare(uint8_t xclass, uint16_t us) {
+        if(xclass >= USB_XFER_CLASSES)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        xferShare[xclass] = us;
+        return 0;
+}
+
+uint8_t USB::SubmitXfer(USBXferReq *req, uint8_t type, uint8_t xclass, uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data, USBXferHandler *handler) {
+        if(!req || !handler || (nbytes && !data) || xclass >= USB_XFER_CLASSES)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        if(FindXfer(req))
+                return USB_ERROR_TRANSFER_IN_PROGRESS;
+
+        USBXferReq **pp = &xferQueue[xclass];
+        for(; *pp; pp = &(*pp)->next);
+
+        if(!getEpInfoEntry(addr, ep))
+                return USB_ERROR_EP_NOT_FOUND_IN_TBL;
+
+        req->next = NULL;
+        req->handler = handler;
+        req->data = data;
+        req->nbytes = nbytes;
+        req->count = 0;
+        req->nakCount = 0;
+        req->timeout = (uint32_t)millis() + USB_XFER_TIMEOUT;
+        req->addr = addr;
+        req->ep = ep;
+        req->type = type;
+        req->state = (type == USB_XFER_TYPE_CTRL) ? USB_XFER_STATE_SETUP : USB_XFER_STATE_DATA;
+        req->xclass = xclass;
+        req->rcode = 0;
+
+        *pp = req; // append to the end of the queue
+        return 0;
+}
+
+/* Advances a request until it is finished or NAKed. Returns true if it has to stay queued */
+bool USB::XferStep(USBXferReq *req) {
+        EpInfo *pep = NULL;
+        uint16_t nak_limit = 0;
+        bool direction = (req->type == USB_XFER_TYPE_IN) || (req->type == USB_XFER_TYPE_CTRL && req->setup.ReqType_u.direction);
+
+        // The blocking transfers may have used the chip since the last turn, so the address is set up every time
+        uint8_t rcode = SetAddress(req->addr, req->ep, &pep, &nak_limit);
+
+        while(!rcode && req->state != USB_XFER_STATE_IDLE) {
+                if((int32_t)((uint32_t)millis() - req->timeout) >= 0L) {
+                        rcode = USB_ERROR_TRANSFER_TIMEOUT;
+                        break;
+                }
+
+                switch(req->state) {
+                        case USB_XFER_STATE_SETUP:
+                                bytesWr(rSUDFIFO, 8, (uint8_t*) & req->setup); //transfer to setup packet FIFO
+                                rcode = dispatchPkt(tokSETUP, req->ep, 1);
+                                if(rcode)
+                                        break;
+
+                                if(direction)
+                                        pep->bmRcvToggle = 1;
+                                else
+                                        pep->bmSndToggle = 1;
+                                req->state = (req->nbytes) ? USB_XFER_STATE_DATA : USB_XFER_STATE_STATUS;
+                                break;
+
+                        case USB_XFER_STATE_DATA:
+                                if(direction) {
+                                        uint16_t read = req->nbytes - req->count;
+
+                                        rcode = InTransfer(pep, 1, &read, req->data + req->count);
+                                        req->count += read;
+                                        if(rcode == hrNAK) // keep the toggle of the packets received before the NAK
+                                                pep->bmRcvToggle = (regRd(rHRSL) & bmRCVTOGRD) ? 1 : 0;
+                                        if(rcode)
+                                                break;
+                                } else {
+                                        uint16_t left = req->nbytes - req->count;
+                                        uint16_t nbytes = (left > pep->maxPktSize) ? pep->maxPktSize : left;
+
+                                        // One packet at a time, so a NAK never loses track of what has been sent
+                                        rcode = OutTransfer(pep, 1, nbytes, req->data + req->count);
+                                        if(rcode)
+                                                break;
+
+                                        req->count += nbytes;
+                                        if(req->count < req->nbytes)
+                                                break;
+                                }
+                                req->state = (req->type == USB_XFER_TYPE_CTRL) ? USB_XFER_STATE_STATUS : USB_XFER_STATE_IDLE;
+                                break;
+
+                        case USB_XFER_STATE_STATUS:
+                                rcode = dispatchPkt((direction) ? tokOUTHS : tokINHS, req->ep, 1);
+                                if(!rcode)
+                                        req->state = USB_XFER_STATE_IDLE;
+                                break;
+                }
+        }
+
+        if(rcode == hrNAK) {
+                req->nakCount++;
+                if(!nak_limit || req->nakCount < nak_limit)
+                        return true; // try again on the next Task()
+        }
+        req->state = USB_XFER_STATE_IDLE;
+        req->rcode = rcode;
+        return false;
+}
+
+void USB::XferTask() {
+        uint16_t frame = getFrameNumber();
+
+        if(frame != xferFrame) { // every class gets its share again
+                xferFrame = frame;
+                for(uint8_t c = 0; c < USB_XFER_CLASSES; c++)
+                        xferUsed[c] = 0;
+        }
+
+        // A class may also use what the classes above it left of their shares
+        int32_t budget = 0;
+
+        for(uint8_t c = 0; c < USB_XFER_CLASSES; c++) {
+                budget += xferShare[c];
+                // Handlers may submit new requests, these are queued behind the ones still pending
+                xferRun = xferQueue[c];
+                xferQueue[c] = NULL;
+                while(xferRun && (int32_t)xferUsed[c] < budget && !TaskTimeUp()) {
+                        USBXferReq *req = xferRun;
+                        uint32_t start = (uint32_t)micros();
+
+                        xferRun = req->next;
+                        req->next = NULL;
+                        bool more = XferStep(req);
+                        xferUsed[c] += (uint32_t)micros() - start;
+                        if(more) {
+                                *xferKeepTail = req;
+                                xferKeepTail = &req->next;
+                        } else
+                                req->handler->XferDone(req);
+                }
+
+                // Requests that did not get a turn go first in the next frame
+                USBXferReq **end = &xferRun;
+                while(*end)
+                        end = &(*end)->next;
+                *xferKeepTail = xferQueue[c];
+                *end = xferKeep;
+                xferQueue[c] = xferRun;
+                xferRun = xferKeep = NULL;
+                xferKeepTail = &xferKeep;
+                budget = (budget > (int32_t)xferUsed[c]) ? budget - (int32_t)xferUsed[c] : 0;
+        }
+}
+
+/* Finishes all queued requests with USB_ERROR_TRANSFER_ABORTED */
+void USB::AbortXfers() {
+        for(uint8_t c = 0; c < USB_XFER_CLASSES; c++) {
+                xferRun = xferQueue[c];
+                xferQueue[c] = NULL;
+                while(xferRun) {
+                        USBXferReq *req = xferRun;
+                        xferRun = req->next;
+                        req->next = NULL;
+                        req->state = USB_XFER_STATE_IDLE;
+                        req->rcode = USB_ERROR_TRANSFER_ABORTED;
+                        req->handler->XferDone(req);
+                }
+        }
+}
+
+/* Frame scheduler. The MAX3421E has no readable frame counter, so frames are counted in milliseconds from */
+/* the first SOF after the bus reset. Intervals are rounded down to a power of two and each driver is      */
+/* given the phase with the lowest load, so polls are spread over the frames instead of bunching up.       */
+uint16_t USB::getFrameNumber(void) {
+        return (uint16_t)((uint32_t)millis() - frameBase);
+}
+
+uint8_t USB::RegisterPeriodic(USBDeviceConfig *pdev, uint8_t bInterval) {
+        if(!pdev)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        UnregisterPeriodic(pdev);
+
+        USBPeriodicEntry *pe = NULL;
+        for(uint8_t i = 0; i < USB_NUMPERIODIC; i++) {
+                if(!periodic[i].pdev) {
+                        pe = periodic + i;
+                        break;
+                }
+        }
+        if(!pe)
+                return USB_ERROR_PERIODIC_TABLE_FULL;
+
+        uint8_t interval = 1;
+        while(interval < USB_PERIODIC_FRAMES && (uint16_t)(interval << 1) <= bInterval)
+                interval <<= 1;
+
+        // Find the phase where the busiest frame has the fewest polls
+        uint8_t phase = 0, bestLoad = 0xff;
+        for(uint8_t p = 0; p < interval; p++) {
+                uint8_t peak = 0;
+                for(uint16_t frame = p; frame < USB_PERIODIC_FRAMES; frame += interval) {
+                        uint8_t load = 0;
+                        for(uint8_t i = 0; i < USB_NUMPERIODIC; i++)
+                                if(periodic[i].pdev && (frame & (periodic[i].interval - 1)) == periodic[i].phase)
+                                        load++;
+                        if(load > peak)
+                                peak = load;
+                }
+                if(peak < bestLoad) {
+                        bestLoad = peak;
+                        phase = p;
+                }
+        }
+
+        uint16_t frame = getFrameNumber();
+        pe->interval = interval;
+        pe->phase = phase;
+        pe->nextFrame = frame + ((uint16_t)(phase - frame) & (interval - 1));
+        pe->pdev = pdev;
+        return 0;
+}
+
+void USB::UnregisterPeriodic(USBDeviceConfig *pdev) {
+        for(uint8_t i = 0; i < USB_NUMPERIODIC; i++)
+                if(periodic[i].pdev == pdev)
+                        periodic[i].pdev = NULL;
+}
+
+bool USB::IsPeriodic(USBDeviceConfig *pdev) {
+        for(uint8_t i = 0; i < USB_NUMPERIODIC; i++)
+                if(periodic[i].pdev == pdev)
+                        return true;
+        return false;
+}
+
+#if USE_UHS_ACTIVE_POLL
+/* Active driver heap. Only the drivers that hold a device are polled, earliest NextPollTime() first,  */
+/* so a Task() call where nothing is due costs a single comparison. A driver that let go of its device */
+/* or moved to the frame scheduler leaves the heap when it comes up. Drivers are polled at most once   */
+/* per frame.                                                                                         */
+void USB::ActiveAdd(uint8_t driver) {
+        USBDeviceConfig *pdev = devConfig[driver];
+        uint8_t k;
+
+        if(IsPeriodic(pdev))
+                return;
+
+        for(k = 0; k < activeCount && active[k].driver != driver; k++);
+        if(k == activeCount) {
+                if(activeCount == USB_NUMDEVICES)
+                        return;
+                activeCount++;
+        }
+        active[k].driver = driver;
+        active[k].due = pdev->NextPollTime();
+        ActiveSiftDown(ActiveSiftUp(k));
+}
+
+void USB::ActiveTask() {
+        uint32_t now = (uint32_t)millis();
+        bool polled = false;
+
+        // A budgeted call polls at least the driver due first, so a busy transfer queue cannot starve them
+        for(uint8_t n = activeCount; n && activeCount && !(polled && TaskTimeUp()); n--) {
+                if((int32_t)(now - active[0].due) < 0L)
+                        break;
+
+                USBDeviceConfig *pdev = devConfig[active[0].driver];
+
+                if(!pdev || !pdev->GetAddress() || IsPeriodic(pdev)) {
+                        active[0] = active[--activeCount];
+                        ActiveSiftDown(0);
+                        continue;
+                }
+                pdev->Poll();
+                polled = true;
+
+                uint32_t due = pdev->NextPollTime();
+
+                if((int32_t)(due - now) <= 0L)
+                        due = now + 1;
+                active[0].due = due;
+                ActiveSiftDown(0);
+        }
+}
+
+uint8_t USB::ActiveSiftUp(uint8_t k) {
+        while(k) {
+                uint8_t parent = (k - 1) / 2;
+
+                if((int32_t)(active[k].due - active[parent].due) >= 0L)
+                        break;
+
+                USBActiveEntry tmp = active[k];
+
+                active[k] = active[parent];
+                active[parent] = tmp;
+                k = parent;
+        }
+        return k;
+}
+
+void USB::ActiveSiftDown(uint8_t k) {
+        for(;;) {
+                uint8_t first = k;
+                uint8_t child = 2 * k + 1;
+
+                if(child < activeCount && (int32_t)(active[child].due - active[first].due) < 0L)
+                        first = child;
+                child++;
+                if(child < activeCount && (int32_t)(active[child].due - active[first].due) < 0L)
+                        first = child;
+                if(first == k)
+                        return;
+
+                USBActiveEntry tmp = active[k];
+
+                active[k] = active[first];
+                active[first] = tmp;
+                k = first;
+        }
+}
+#endif
+
+void USB::PeriodicTask() {
+        uint16_t frame = getFrameNumber();
+
+        for(uint8_t i = 0; i < USB_NUMPERIODIC; i++) {
+                USBPeriodicEntry *pe = periodic + i;
+
+                if(!pe->pdev || (int16_t)(frame - pe->nextFrame) < 0)
+                        continue;
+                if(TaskTimeUp())
+                        return; // still due, polled by the next Task() call
+
+                // Polls missed while the sketch was busy are not made up, the next one stays on this entry's phase
+                pe->nextFrame = frame + pe->interval - ((uint16_t)(frame - pe->phase) & (pe->interval - 1));
+                pe->pdev->Poll();
+        }
+}
+
+#if USE_UHS_ISO
+/* Isochronous streams. Every stream moves one packet per interval, on the frame it is due, before any */
+/* other work of Task() and regardless of its budget. Nothing is ever sent again: a packet that fails  */
+/* is counted and dropped, and so are intervals the sketch did not call Task() in.                     */
+uint8_t USB::isoStartIn(USBIsoStream *s, uint8_t addr, uint8_t ep, uint8_t bInterval, uint8_t *ring, uint8_t *lens, uint8_t slots) {
+        return IsoStart(s, true, addr, ep, bInterval, ring, lens, slots);
+}
+
+uint8_t USB::isoStartOut(USBIsoStream *s, uint8_t addr, uint8_t ep, uint8_t bInterval, uint8_t *ring, uint8_t *lens, uint8_t slots) {
+        return IsoStart(s, false, addr, ep, bInterval, ring, lens, slots);
+}
+
+bool USB::isoStop(USBIsoStream *s) {
+        for(USBIsoStream **pp = &isoList; *pp; pp = &(*pp)->next) {
+                if(*pp == s) {
+                        *pp = s->next;
+                        s->next = NULL;
+                        return true;
+                }
+        }
+        return false;
+}
+
+uint8_t USB::IsoStart(USBIsoStream *s, bool in, uint8_t addr, uint8_t ep, uint8_t bInterval, uint8_t *ring, uint8_t *lens, uint8_t slots) {
+        if(!s || !ring || !lens || !slots)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        USBIsoStream **pp = &isoList;
+        for(; *pp; pp = &(*pp)->next)
+                if(*pp == s)
+                        return USB_ERROR_TRANSFER_IN_PROGRESS;
+
+        UsbDevice *p = addrPool.GetUsbDevicePtr(addr);
+
+        if(!p)
+                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
+
+        if(p->lowspeed)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        EpInfo *pep = getEpInfoEntry(addr, ep);
+
+        if(!pep)
+                return USB_ERROR_EP_NOT_FOUND_IN_TBL;
+
+        if(pep->maxPktSize > 64)
+                return USB_ERROR_INVALID_MAX_PKT_SIZE;
+
+        // The interval of a full-speed isochronous endpoint is 2^(bInterval - 1) frames
+        uint8_t interval = 1;
+        while(bInterval > 1 && interval < USB_PERIODIC_FRAMES) {
+                interval <<= 1;
+                bInterval--;
+        }
+
+        s->next = NULL;
+        s->ring = ring;
+        s->lens = lens;
+        s->slots = slots;
+        s->pktSize = pep->maxPktSize;
+        s->head = 0;
+        s->count = 0;
+        s->addr = addr;
+        s->ep = ep;
+        s->in = in;
+        s->interval = interval;
+        s->nextFrame = getFrameNumber();
+        memset(&s->stats, 0, sizeof (s->stats));
+
+        *pp = s; // append to the end of the list
+        return 0;
+}
+
+void USB::IsoTask() {
+        if(!isoList)
+                return;
+
+        uint16_t frame = getFrameNumber();
+
+        for(USBIsoStream *s = isoList; s; s = s->next) {
+                uint16_t late = frame - s->nextFrame;
+
+                if((int16_t)late < 0)
+                        continue;
+
+                // The intervals that went by are lost, the stream stays on its phase
+                s->stats.missed += late / s->interval;
+                s->nextFrame = frame + s->interval - (late & (s->interval - 1));
+                IsoStep(s);
+        }
+}
+
+/* One transaction of a stream, the outcome only goes into its counters */
+void USB::IsoStep(USBIsoStream *s) {
+        EpInfo *pep = NULL;
+        uint16_t nak_limit = 0;
+        uint8_t *buf;
+        uint8_t len = 0;
+        uint8_t hrsl;
+
+        buf = (s->in) ? s->Back() : s->Front(&len);
+        if(!buf) {
+                if(s->in)
+                        s->stats.overruns++;
+                else
+                        s->stats.underruns++;
+                return;
+        }
+
+        // The blocking transfers may have used the chip in between, so the address is set up every time
+        uint8_t rcode = SetAddress(s->addr, s->ep, &pep, &nak_limit);
+
+        if(!rcode) {
+                if(s->in)
+                        regWr(rHXFR, (tokISOIN | s->ep));
+                else {
+                        bytesWr(rSNDFIFO, len, buf);
+                        MAX3421eRegOp launch[2] = {
+                                { MAX3421E_WR(rSNDBC), len },
+                                { MAX3421E_WR(rHXFR), (uint8_t)(tokISOOUT | s->ep) }
+                        };
+                        regBatch(launch, 2);
+                }
+                rcode = USB_ERROR_TRANSFER_TIMEOUT;
+                if(waitXfrDone((uint32_t)millis() + USB_XFER_TIMEOUT, &hrsl))
+                        rcode = (hrsl & 0x0f);
+        }
+
+        if(s->in && !rcode) {
+                MAX3421eRegOp rcv[2] = {
+                        { MAX3421E_RD(rHIRQ), 0 },
+                        { MAX3421E_RD(rRCVBC), 0 }
+                };
+                regBatch(rcv, 2);
+                if(rcv[0].data & bmRCVDAVIRQ) {
+                        len = (rcv[1].data > s->pktSize) ? s->pktSize : rcv[1].data;
+                        bytesRd(rRCVFIFO, len, buf);
+                        regWr(rHIRQ, bmRCVDAVIRQ); // free the buffer, anything above pktSize is dropped
+                        s->Push(len);
+                } else
+                        rcode = 0xf0; // receive error, as in InTransfer()
+        } else if(!s->in) {
+                if(rcode)
+                        regWr(rSNDBC, 0); // hand the FIFO back
+                s->Pop(); // sent or lost, it is not sent again
+        }
+
+        if(rcode)
+                s->stats.errors++;
+        else {
+                s->stats.packets++;
+                s->stats.bytes += len;
+        }
+}
+#endif
+
+#if USE_UHS_ADAPTIVE_NAK
+/* Adaptive NAK limit for inTransfer()/outTransfer(). An endpoint that mostly gives up on its NAK limit   */
+/* (e.g. an idle interrupt pipe) gets a limit just above the NAKs it needed when it did move data. One    */
+/* that mostly moves data keeps the full limit of its EpInfo, and so does the rest of a transfer once the */
+/* first packet went through. Control transfers are never adapted.                                        */
+USBNakStats* USB::NakStatsEntry(uint8_t addr, uint8_t ep, bool alloc) {
+        for(uint8_t i = 0; i < USB_NUMNAKSTATS; i++)
+                if(nakStats[i].addr == addr && nakStats[i].ep == ep)
+                        return nakStats + i;
+
+        if(!alloc)
+                return NULL;
+
+        USBNakStats *s = NULL;
+        for(uint8_t i = 0; i < USB_NUMNAKSTATS; i++) {
+                if(!nakStats[i].addr) {
+                        s = nakStats + i;
+                        break;
+                }
+        }
+        if(!s) { // table full, recycle the entries in turn
+                s = nakStats + nakStatsNext;
+                nakStatsNext = (nakStatsNext + 1) % USB_NUMNAKSTATS;
+        }
+        s->addr = addr;
+        s->ep = ep;
+        s->nakPower = USB_NAK_MAX_POWER;
+        s->dataRatio = 0xff; // assume a busy endpoint until it shows otherwise
+        s->avgNaks = 0;
+        s->avgLatency = 0;
+        return s;
+}
+
+void USB::NakStatsClear(uint8_t addr) {
+        for(uint8_t i = 0; i < USB_NUMNAKSTATS; i++)
+                if(nakStats[i].addr == addr)
+                        nakStats[i].addr = 0;
+}
+
+const USBNakStats* USB::getNakStats(uint8_t addr, uint8_t ep) {
+        return addr ? NakStatsEntry(addr, ep, false) : NULL;
+}
+
+uint16_t USB::NakAdapt(uint8_t addr, EpInfo *pep, uint16_t nak_limit) {
+        xferNaks = 0;
+        xferCut = false;
+        if(!addr || !pep->epAddr || pep->bmNakPower <= USB_NAK_ADAPT_MIN_POWER)
+                return nak_limit; // control endpoint, or NAKs are not counted or already give up quickly
+
+        USBNakStats *s = NakStatsEntry(addr, pep->epAddr, true);
+        if(s->nakPower > pep->bmNakPower)
+                s->nakPower = pep->bmNakPower;
+        nakAdapted = true;
+        return NakLimit(s->nakPower);
+}
+
+void USB::NakLearn(uint8_t addr, EpInfo *pep, uint8_t rcode, uint32_t start) {
+        nakAdapted = false;
+        if(rcode != hrSUCCESS && rcode != hrNAK)
+                return; // errors say nothing about the traffic on the endpoint
+        if(xferCut)
+                return; // cut short by the Task() budget, the NAK limit was not reached
+
+        USBNakStats *s = NakStatsEntry(addr, pep->epAddr, false);
+        if(!s)
+                return;
+
+        // Running averages over about the last 8 transfers
+        if(rcode == hrSUCCESS) {
+                s->dataRatio += (0xff - s->dataRatio) >> 3;
+                s->avgNaks = (uint16_t)((int32_t)s->avgNaks + (((int32_t)xferNaks - s->avgNaks) >> 3));
+                uint16_t latency = (uint16_t)((uint32_t)millis() - start);
+                s->avgLatency = (uint16_t)((int32_t)s->avgLatency + (((int32_t)latency - s->avgLatency) >> 3));
+        } else
+                s->dataRatio -= (s->dataRatio + 7) >> 3;
+
+        uint8_t power = pep->bmNakPower;
+        if(s->dataRatio < USB_NAK_ADAPT_BUSY) {
+                // Twice the NAKs it took to move data is enough to catch the data when there is any
+                power = USB_NAK_ADAPT_MIN_POWER;
+                while(power < pep->bmNakPower && NakLimit(power) < 2 * (uint32_t)s->avgNaks)
+                        power++;
+        }
+        s->nakPower = power;
+}
+#endif
+
+#if ENABLE_UHS_TELEMETRY
+/* Telemetry. SetAddress() picks the counters of the endpoint, the transfer code counts NAKs, toggle resyncs */
+/* and retries into them, and XferResult() books the outcome of ctrlReq(), inTransfer() and outTransfer().   */
+/* Asynchronous transfers only add to the NAK, toggle and retry counters.                                   */
+uint8_t USB::XferResult(uint8_t rcode, uint16_t nbytes) {
+        UsbEpTelemetry *t = xferTelemetry;
+
+        if(!t)
+                return rcode;
+
+        t->transfers++;
+        t->bytes += nbytes;
+        if(rcode == hrNAK)
+                t->nakLimits++;
+        else if(rcode)
+                t->errors++;
+
+        uint16_t ms = (uint16_t)((uint32_t)millis() - xferStart);
+        uint8_t bin = 0;
+        while(bin < USB_TELEMETRY_BINS - 1 && (ms >> bin))
+                bin++;
+        if(t->latency[bin] != 0xffff)
+                t->latency[bin]++;
+        return rcode;
+}
+
+bool USB::getTelemetry(uint8_t addr, uint8_t ep, UsbEpTelemetry *snapshot) {
+        UsbEpTelemetry *t = addrPool.GetEpTelemetry(addr, ep, false);
+
+        if(!t || !snapshot)
+                return false;
+
+        *snapshot = *t;
+        return true;
+}
+
+void USB::resetTelemetry(uint8_t addr) {
+        addrPool.ResetTelemetry(addr);
+}
+
+uint32_t USB::getTaskMaxTime(bool reset) {
+        uint32_t t = taskMaxTime;
+
+        if(reset)
+                taskMaxTime = 0;
+        return t;
+}
+#endif
+
+#if ENABLE_UHS_CAPTURE
+/* Bus capture. dispatchPkt(), OutTransfer() and the pipelined IN path record every transaction they see  */
+/* the result of, ctrlReq() and InTransfer() add the setup packet and the received data to the record.    */
+
+void USB::captureStart() {
+        captureHead = 0;
+        captureCount = 0;
+        captureSeq = 0;
+        captureOn = true;
+}
+
+void USB::captureStop() {
+        captureOn = false;
+}
+
+void USB::Capture(uint8_t token, uint8_t ep, uint8_t hrslt, const uint8_t *data, uint8_t len) {
+        if(!captureOn)
+                return;
+
+        // The oldest record makes room when the buffer is full
+        uint8_t i = (captureHead + captureCount) % USB_CAPTURE_RECORDS;
+        if(captureCount < USB_CAPTURE_RECORDS)
+                captureCount++;
+        else
+                captureHead = (captureHead + 1) % USB_CAPTURE_RECORDS;
+
+        USBCaptureRecord *r = &capture[i];
+        r->time = micros();
+        r->addr = captureAddr;
+        r->ep = ep;
+        r->token = token;
+        r->hrslt = hrslt;
+        r->len = 0;
+        captureSeq++;
+        CaptureData(data, len);
+}
+
+/* Adds the payload to the last record */
+void USB::CaptureData(const uint8_t *data, uint8_t len) {
+        if(!captureOn || !captureCount || !data)
+                return;
+
+        USBCaptureRecord *r = &capture[(captureHead + captureCount - 1) % USB_CAPTURE_RECORDS];
+        r->len = len;
+        memcpy(r->data, data, (len > USB_CAPTURE_SNAPLEN) ? USB_CAPTURE_SNAPLEN : len);
+}
+
+/* Writes 'n' bytes of 'val', least significant first */
+static void CaptureWrite(Print &out, uint32_t val, uint8_t n) {
+        while(n--) {
+                out.write((uint8_t)val);
+                val >>= 8;
+        }
+}
+
+/* usbmon URB status for a transaction result, negative Linux errno values */
+static int32_t CaptureStatus(uint8_t hrslt) {
+        switch(hrslt) {
+                case hrSUCCESS:
+                        return 0;
+                case hrNAK:
+                        return -11; // EAGAIN
+                case hrSTALL:
+                        return -32; // EPIPE
+                case hrTIMEOUT:
+                case USB_ERROR_TRANSFER_TIMEOUT:
+                        return -62; // ETIME
+                case hrBABBLE:
+                        return -75; // EOVERFLOW
+                default:
+                        return -71; // EPROTO, toggle, CRC and PID errors
+        }
+}
+
+/* Writes the buffer as DLT_USB_LINUX (usbmon, 48 byte header) packets, oldest first. Bulk and interrupt */
+/* endpoints can't be told apart here, both show up as bulk. Returns the number of records written.    */
+uint8_t USB::captureFlush(Print &out, bool header) {
+        if(header) {
+                CaptureWrite(out, 0xa1b2c3d4UL, 4); // magic
+                CaptureWrite(out, 2, 2); // version 2.4
+                CaptureWrite(out, 4, 2);
+                CaptureWrite(out, 0, 4); // GMT
+                CaptureWrite(out, 0, 4); // accuracy
+                CaptureWrite(out, 48 + USB_CAPTURE_SNAPLEN, 4); // snaplen
+                CaptureWrite(out, 189, 4); // LINKTYPE_USB_LINUX
+        }
+
+        uint8_t n = captureCount;
+        uint32_t id = captureSeq - n;
+
+        for(uint8_t k = 0; k < n; k++, id++) {
+                USBCaptureRecord *r = &capture[(captureHead + k) % USB_CAPTURE_RECORDS];
+                bool setup = (r->token == tokSETUP);
+                bool in = (r->token == tokIN || r->token == tokINHS);
+                uint8_t caplen = (setup) ? 0 : (r->len > USB_CAPTURE_SNAPLEN) ? USB_CAPTURE_SNAPLEN : r->len;
+
+                // pcap record header
+                CaptureWrite(out, r->time / 1000000UL, 4);
+                CaptureWrite(out, r->time % 1000000UL, 4);
+                CaptureWrite(out, 48 + caplen, 4);
+                CaptureWrite(out, 48 + ((setup) ? 0 : r->len), 4);
+
+                // usbmon header, host to device data goes with the submission, the rest with the completion
+                CaptureWrite(out, id, 4);
+                CaptureWrite(out, 0, 4);
+                out.write((uint8_t)((setup || r->token == tokOUT) ? 'S' : 'C'));
+                out.write((uint8_t)((r->ep) ? 3 : 2)); // bulk or control
+                out.write((uint8_t)(r->ep | ((in) ? 0x80 : 0x00)));
+                out.write(r->addr);
+                CaptureWrite(out, 1, 2); // bus number
+                out.write((uint8_t)((setup) ? 0 : '-')); // setup packet present
+                out.write((uint8_t)((caplen) ? 0 : ((in) ? '<' : '>'))); // data present
+                CaptureWrite(out, r->time / 1000000UL, 4);
+                CaptureWrite(out, 0, 4);
+                CaptureWrite(out, r->time % 1000000UL, 4);
+                CaptureWrite(out, (uint32_t)CaptureStatus(r->hrslt), 4);
+                CaptureWrite(out, (setup) ? 0 : r->len, 4); // urb_len
+                CaptureWrite(out, caplen, 4);
+                for(uint8_t j = 0; j < 8; j++)
+                        out.write((uint8_t)((setup) ? r->data[j] : 0));
+
+                out.write(r->data, caplen);
+        }
+        captureHead = 0;
+        captureCount = 0;
+        return n;
+}
+#endif
+
 /* USB main task. Performs enumeration/cleanup */
-void USB::Task(void) //USB state machine
+void USB::Task(uint16_t budget) //USB state machine
 {
-        uint8_t rcode;
         uint8_t tmpdata;
-        static uint32_t delay = 0;
         //USB_DEVICE_DESCRIPTOR buf;
         bool lowspeed = false;
+#if ENABLE_UHS_TELEMETRY
+        uint32_t start = (uint32_t)micros();
+#endif
 
-        MAX3421E::Task();
+        taskDeadline = (uint32_t)micros() + budget;
+        taskBudget = (budget != 0);
+
+        // A remote wakeup resumes the bus, connection changes are picked up below
+        if((ChipTask() & bmRWUIRQ) && usb_task_state == USB_STATE_SUSPENDED)
+                resume();
 
         tmpdata = getVbusState();
 
@@ -476,8 +1605,10 @@ void USB::Task(void) //USB state machine
                         lowspeed = false;
                         break;
                 case SE0: //disconnected
-                        if((usb_task_state & USB_STATE_MASK) != USB_STATE_DETACHED)
+                        if((usb_task_state & USB_STATE_MASK) != USB_STATE_DETACHED) {
                                 usb_task_state = USB_DETACHED_SUBSTATE_INITIALIZE;
+                                QueueEvent(USB_EVENT_DETACHED, 0, 0, 0, 0, NULL);
+                        }
                         lowspeed = false;
                         break;
                 case LSHOST:
@@ -486,15 +1617,38 @@ void USB::Task(void) //USB state machine
                         //intentional fallthrough
                 case FSHOST: //attached
                         if((usb_task_state & USB_STATE_MASK) == USB_STATE_DETACHED) {
-                                delay = (uint32_t)millis() + USB_SETTLE_DELAY;
+                                taskDelay = (uint32_t)millis() + USB_SETTLE_DELAY;
                                 usb_task_state = USB_ATTACHED_SUBSTATE_SETTLE;
                         }
                         break;
         }// switch( tmpdata
 
-        for(uint8_t i = 0; i < USB_NUMDEVICES; i++)
-                if(devConfig[i])
-                        rcode = devConfig[i]->Poll();
+        // Isochronous streams first, then the interrupt pipes: the drivers the frame scheduler polls,
+        // then the queued transfers by class, then the drivers that poll on their own. Nothing is
+        // polled on a suspended bus
+        if(!isSuspended()) {
+                IsoTask();
+                PeriodicTask();
+                XferTask();
+
+#if USE_UHS_ACTIVE_POLL
+                ActiveTask();
+#else
+                // Round robin, so the drivers a budgeted call did not get to are polled first next time. At least
+                // one is polled even when the budget is gone, so a busy transfer queue cannot starve them
+                bool polled = false;
+
+                for(uint8_t n = 0; n < USB_NUMDEVICES && !(polled && TaskTimeUp()); n++) {
+                        uint8_t i = taskPollNext;
+
+                        taskPollNext = (taskPollNext + 1) % USB_NUMDEVICES;
+                        if(devConfig[i] && !IsPeriodic(devConfig[i])) {
+                                devConfig[i]->Poll();
+                                polled = true;
+                        }
+                }
+#endif
+        }
 
         switch(usb_task_state) {
                 case USB_DETACHED_SUBSTATE_INITIALIZE:
@@ -502,7 +1656,16 @@ void USB::Task(void) //USB state machine
 
                         for(uint8_t i = 0; i < USB_NUMDEVICES; i++)
                                 if(devConfig[i])
-                                        rcode = devConfig[i]->Release();
+                                        devConfig[i]->Release();
+
+                        AbortXfers();
+                        enumState.state = USB_ENUM_STATE_IDLE;
+#if USE_UHS_ISO
+                        isoList = NULL; // streams are stopped, their counters stay readable
+#endif
+#if USE_UHS_ACTIVE_POLL
+                        activeCount = 0;
+#endif
 
                         usb_task_state = USB_DETACHED_SUBSTATE_WAIT_FOR_DEVICE;
                         break;
@@ -510,8 +1673,12 @@ void USB::Task(void) //USB state machine
                         break;
                 case USB_DETACHED_SUBSTATE_ILLEGAL: //just sit here
                         break;
+                case USB_DETACHED_SUBSTATE_SUSPENDED:
+                        if(!isPoweredDown()) // woken up, but nothing was attached
+                                powerDown();
+                        break;
                 case USB_ATTACHED_SUBSTATE_SETTLE: //settle time for just attached device
-                        if((int32_t)((uint32_t)millis() - delay) >= 0L)
+                        if((int32_t)((uint32_t)millis() - taskDelay) >= 0L)
                                 usb_task_state = USB_ATTACHED_SUBSTATE_RESET_DEVICE;
                         else break; // don't fall through
                 case USB_ATTACHED_SUBSTATE_RESET_DEVICE:
@@ -534,35 +1701,167 @@ void USB::Task(void) //USB state machine
                                         usb_task_state = USB_STATE_CONFIGURING;
                                  */
                                 usb_task_state = USB_ATTACHED_SUBSTATE_WAIT_RESET;
-                                delay = (uint32_t)millis() + 20;
+                                taskDelay = (uint32_t)millis() + 20;
+                                frameBase = (uint32_t)millis(); // frame 0 for the frame scheduler
                         }
                         break;
                 case USB_ATTACHED_SUBSTATE_WAIT_RESET:
-                        if((int32_t)((uint32_t)millis() - delay) >= 0L) usb_task_state = USB_STATE_CONFIGURING;
+                        if((int32_t)((uint32_t)millis() - taskDelay) >= 0L) usb_task_state = USB_STATE_CONFIGURING;
                         else break; // don't fall through
                 case USB_STATE_CONFIGURING:
 
                         //Serial.print("\r\nConf.LS: ");
                         //Serial.println(lowspeed, HEX);
 
-                        rcode = Configuring(0, 0, lowspeed);
-
-                        if(rcode) {
-                                if(rcode != USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE) {
-                                        usb_error = rcode;
-                                        usb_task_state = USB_STATE_ERROR;
-                                }
-                        } else
-                                usb_task_state = USB_STATE_RUNNING;
+                        // EnumTask() moves on to USB_STATE_RUNNING or USB_STATE_ERROR when it is done
+                        if(!isEnumerating())
+                                Configuring(0, 0, lowspeed);
                         break;
                 case USB_STATE_RUNNING:
                         break;
                 case USB_STATE_ERROR:
                         //MAX3421E::Init();
                         break;
+                case USB_STATE_SUSPENDED:
+                        if(!isPoweredDown()) { // woken up by a connection change that left the device where it was
+                                regWr(rMODE, regRd(rMODE) & ~bmSOFKAENAB);
+                                powerDown();
+                        }
+                        break;
+                case USB_SUSPENDED_SUBSTATE_RESUME:
+                        if(regRd(rHCTL) & bmSIGRSM)
+                                break; // still signaling resume
+                        regWr(rMODE, regRd(rMODE) | bmSOFKAENAB);
+                        taskDelay = (uint32_t)millis() + USB_RESUME_RECOVERY;
+                        usb_task_state = USB_SUSPENDED_SUBSTATE_RECOVERY;
+                        break;
+                case USB_SUSPENDED_SUBSTATE_RECOVERY:
+                        if((int32_t)((uint32_t)millis() - taskDelay) < 0L)
+                                break;
+                        for(uint8_t i = 0; i < USB_NUMDEVICES; i++)
+                                if(devConfig[i])
+                                        devConfig[i]->Resume();
+
+                        usb_task_state = USB_STATE_RUNNING;
+                        break;
         } // switch( usb_task_state )
+
+        if(!TaskTimeUp())
+                EnumTask();
+        EventTask();
+        taskBudget = false; // transfers the sketch makes between calls are not limited
+#if ENABLE_UHS_TELEMETRY
+        uint32_t t = (uint32_t)micros() - start;
+        if(t > taskMaxTime)
+                taskMaxTime = t;
+#endif
+}
+
+#if USE_UHS_EVENTS
+uint8_t USB::RegisterEventHandler(USBEventHandler *handler) {
+        if(!handler)
+                return USB_ERROR_INVALID_ARGUMENT;
+
+        UnregisterEventHandler(handler);
+        for(uint8_t i = 0; i < USB_NUMEVENTHANDLERS; i++) {
+                if(!eventHandlers[i]) {
+                        eventHandlers[i] = handler;
+                        return 0;
+                }
+        }
+        return USB_ERROR_EVENT_TABLE_FULL;
+}
+
+void USB::UnregisterEventHandler(USBEventHandler *handler) {
+        for(uint8_t i = 0; i < USB_NUMEVENTHANDLERS; i++)
+                if(eventHandlers[i] == handler)
+                        eventHandlers[i] = NULL;
 }
 
+/* Queues an event for EventTask(), it is dropped if the queue is full */
+void USB::QueueEvent(uint8_t type, uint8_t addr, uint8_t parent, uint8_t port, uint8_t rcode, USBDeviceConfig *pdev) {
+        if(eventCount == USB_NUMEVENTS)
+                return;
+
+        USBEvent *ev = events + (eventHead + eventCount) % USB_NUMEVENTS;
+
+        ev->type = type;
+        ev->addr = addr;
+        ev->parent = parent;
+        ev->port = port;
+        ev->rcode = rcode;
+        ev->pdev = pdev;
+        eventCount++;
+}
+
+/* Delivers the queued events to the handlers and the drivers. A driver that let go of its device is  */
+/* found by its address, that covers a Release() after a transfer error as well as a detach. Nothing */
+/* but that check is done when no driver holds a device and nothing happened.                        */
+void USB::EventTask() {
+        for(uint8_t i = 0; i < USB_NUMDEVICES; i++) {
+                if(eventAddr[i] && (!devConfig[i] || devConfig[i]->GetAddress() != eventAddr[i])) {
+                        QueueEvent(USB_EVENT_RELEASED, eventAddr[i], 0, 0, 0, devConfig[i]);
+                        eventAddr[i] = 0;
+                }
+        }
+
+        while(eventCount) {
+                USBEvent ev = events[eventHead]; // a copy, handlers may cause new events
+
+                eventHead = (eventHead + 1) % USB_NUMEVENTS;
+                eventCount--;
+                for(uint8_t i = 0; i < USB_NUMEVENTHANDLERS; i++)
+                        if(eventHandlers[i])
+                                eventHandlers[i]->UsbEvent(&ev);
+                for(uint8_t i = 0; i < USB_NUMDEVICES; i++)
+                        if(devConfig[i])
+                                devConfig[i]->UsbEvent(&ev);
+        }
+}
+#endif
+
+#if USE_UHS_MULTI_HOST
+USBScheduler::USBScheduler() : numHosts(0), next(0) {
+}
+
+uint8_t USBScheduler::RegisterHost(USB *host) {
+        if(!host)
+                return USB_ERROR_INVALID_ARGUMENT;
+        if(numHosts == USB_NUMHOSTS)
+                return USB_ERROR_UNABLE_TO_REGISTER_DEVICE_CLASS;
+
+        hosts[numHosts++] = host;
+        return 0;
+}
+
+void USBScheduler::Task(uint16_t budget) {
+        uint32_t start = (uint32_t)micros();
+        uint8_t first = next;
+
+        if(!numHosts)
+                return;
+
+        next = (first + 1) % numHosts;
+        for(uint8_t i = 0; i < numHosts; i++) {
+                uint8_t h = (first + i) % numHosts;
+                uint16_t share = 0;
+
+                if(budget) {
+                        uint32_t used = (uint32_t)micros() - start;
+
+                        if(used >= budget) {
+                                next = h; // out of time, this one goes first next time
+                                break;
+                        }
+                        share = (budget - used) / (numHosts - i);
+                        if(!share)
+                                share = 1;
+                }
+                hosts[h]->Task(share);
+        }
+}
+#endif
+
 uint8_t USB::DefaultAddressing(uint8_t parent, uint8_t port, bool lowspeed) {
         //uint8_t                buf[12];
         uint8_t rcode;
@@ -592,8 +1891,8 @@ uint8_t USB::DefaultAddressing(uint8_t parent, uint8_t port, bool lowspeed) {
 
         p->lowspeed = lowspeed;
 
-        // Assign new address to the device
-        rcode = setAddr(0, 0, bAddress);
+        // Assign new address to the device, nothing else is done with it
+        rcode = setAddr(0, 0, bAddress, false);
 
         if(rcode) {
                 addrPool.FreeAddress(bAddress);
@@ -603,48 +1902,6 @@ uint8_t USB::DefaultAddressing(uint8_t parent, uint8_t port, bool lowspeed) {
         return 0;
 };
 
-uint8_t USB::AttemptConfig(uint8_t driver, uint8_t parent, uint8_t port, bool lowspeed) {
-        //printf("AttemptConfig: parent = %i, port = %i\r\n", parent, port);
-        uint8_t retries = 0;
-
-again:
-        uint8_t rcode = devConfig[driver]->ConfigureDevice(parent, port, lowspeed);
-        if(rcode == USB_ERROR_CONFIG_REQUIRES_ADDITIONAL_RESET) {
-                if(parent == 0) {
-                        // Send a bus reset on the root interface.
-                        regWr(rHCTL, bmBUSRST); //issue bus reset
-                        delay(102); // delay 102ms, compensate for clock inaccuracy.
-                } else {
-                        // reset parent port
-                        devConfig[parent]->ResetHubPort(port);
-                }
-        } else if(rcode == hrJERR && retries < 3) { // Some devices returns this when plugged in - trying to initialize the device again usually works
-                delay(100);
-                retries++;
-                goto again;
-        } else if(rcode)
-                return rcode;
-
-        rcode = devConfig[driver]->Init(parent, port, lowspeed);
-        if(rcode == hrJERR && retries < 3) { // Some devices returns this when plugged in - trying to initialize the device again usually works
-                delay(100);
-                retries++;
-                goto again;
-        }
-        if(rcode) {
-                // Issue a bus reset, because the device may be in a limbo state
-                if(parent == 0) {
-                        // Send a bus reset on the root interface.
-                        regWr(rHCTL, bmBUSRST); //issue bus reset
-                        delay(102); // delay 102ms, compensate for clock inaccuracy.
-                } else {
-                        // reset parent port
-                        devConfig[parent]->ResetHubPort(port);
-                }
-        }
-        return rcode;
-}
-
 /*
  * This is broken. We need to enumerate differently.
  * It causes major problems with several devices if detected in an unexpected order.
@@ -685,13 +1942,91 @@ again:
  * 8: if we get here, no driver likes the device plugged in, so exit failure.
  *
  */
+/* Queues the enumeration of a device, EnumTask() runs it from USB::Task(). Returns                  */
+/* USB_ERROR_ENUMERATION_BUSY while another device is being enumerated, the caller has to try again. */
 uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
-        //uint8_t bAddress = 0;
         //printf("Configuring: parent = %i, port = %i\r\n", parent, port);
-        uint8_t devConfigIndex;
-        uint8_t rcode = 0;
-        uint8_t buf[sizeof (USB_DEVICE_DESCRIPTOR)];
-        USB_DEVICE_DESCRIPTOR *udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR *>(buf);
+        if(isEnumerating())
+                return USB_ERROR_ENUMERATION_BUSY;
+
+        enumState.parent = parent;
+        enumState.port = port;
+        enumState.lowspeed = lowspeed;
+        enumState.wait = (uint32_t)millis() + ((parent) ? USB_PORT_SETTLE_DELAY : 0); // the root port has settled in Task()
+        enumState.state = USB_ENUM_STATE_DESCRIPTOR;
+        QueueEvent(USB_EVENT_ATTACHED, 0, parent, port, 0, NULL);
+        return 0;
+}
+
+/* Enumeration engine. Every Task() call runs one step, waits are deadlines so the devices */
+/* that are already running keep being polled while a new one is set up.                  */
+void USB::EnumTask() {
+        uint8_t rcode;
+
+        if(!isEnumerating() || (int32_t)((uint32_t)millis() - enumState.wait) < 0L)
+                return;
+
+        switch(enumState.state) {
+                case USB_ENUM_STATE_DESCRIPTOR:
+                        rcode = EnumDescriptor();
+                        if(rcode) {
+                                //printf("Configuring error: Can't get USB_DEVICE_DESCRIPTOR\r\n");
+                                EnumDone(rcode);
+                                break;
+                        }
+#if USE_UHS_BIND_CACHE
+                        enumState.pass = USB_ENUM_PASS_CACHED;
+#else
+                        enumState.pass = USB_ENUM_PASS_MATCH;
+#endif
+                        enumState.driver = 0;
+                        enumState.state = USB_ENUM_STATE_SELECT;
+                        break;
+                case USB_ENUM_STATE_SELECT:
+                        EnumSelect();
+                        break;
+                case USB_ENUM_STATE_CONFIGURE:
+                        rcode = devConfig[enumState.driver]->ConfigureDevice(enumState.parent, enumState.port, enumState.lowspeed);
+                        if(rcode == USB_ERROR_CONFIG_REQUIRES_ADDITIONAL_RESET) {
+                                EnumReset();
+                                enumState.state = USB_ENUM_STATE_INIT;
+                        } else if(rcode == hrJERR && enumState.retries < 3) { // Some devices returns this when plugged in - trying to initialize the device again usually works
+                                enumState.retries++;
+                                enumState.wait = (uint32_t)millis() + USB_RETRY_DELAY;
+                        } else if(rcode)
+                                EnumResult(rcode);
+                        else
+                                enumState.state = USB_ENUM_STATE_INIT;
+                        break;
+                case USB_ENUM_STATE_INIT:
+                        rcode = devConfig[enumState.driver]->Init(enumState.parent, enumState.port, enumState.lowspeed);
+                        if(rcode == USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE)
+                                break; // the driver is waiting for something, call it again
+                        if(rcode == hrJERR && enumState.retries < 3) {
+                                enumState.retries++;
+                                enumState.wait = (uint32_t)millis() + USB_RETRY_DELAY;
+                                enumState.state = USB_ENUM_STATE_CONFIGURE;
+                        } else if(rcode == USB_ERROR_CONFIG_REQUIRES_ADDITIONAL_RESET && enumState.retries < 3) {
+                                // The driver switched the device to another mode, it comes back with new descriptors
+                                enumState.retries++;
+                                EnumReset();
+                                enumState.state = USB_ENUM_STATE_CONFIGURE;
+                        } else if(rcode) {
+                                // Issue a bus reset, because the device may be in a limbo state
+                                EnumReset();
+                                enumState.rcode = rcode;
+                                enumState.state = USB_ENUM_STATE_FAILED;
+                        } else
+                                EnumResult(0);
+                        break;
+                case USB_ENUM_STATE_FAILED:
+                        EnumResult(enumState.rcode);
+                        break;
+        }
+}
+
+uint8_t USB::EnumDescriptor() {
+        uint8_t rcode;
         UsbDevice *p = NULL;
         EpInfo *oldep_ptr = NULL;
         EpInfo epInfo;
@@ -702,7 +2037,6 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
         epInfo.bmRcvToggle = 0;
         epInfo.bmNakPower = USB_NAK_MAX_POWER;
 
-        //delay(2000);
         AddressPool &addrPool = GetAddressPool();
         // Get pointer to pseudo device with address 0 assigned
         p = addrPool.GetUsbDevicePtr(0);
@@ -719,74 +2053,174 @@ uint8_t USB::Configuring(uint8_t parent, uint8_t port, bool lowspeed) {
 
         p->epinfo = &epInfo;
 
-        p->lowspeed = lowspeed;
+        p->lowspeed = enumState.lowspeed;
         // Get device descriptor
-        rcode = getDevDescr(0, 0, sizeof (USB_DEVICE_DESCRIPTOR), (uint8_t*)buf);
+        rcode = getDevDescr(0, 0, sizeof (USB_DEVICE_DESCRIPTOR), (uint8_t*)&enumState.udd);
 
         // Restore p->epinfo
         p->epinfo = oldep_ptr;
 
-        if(rcode) {
-                //printf("Configuring error: Can't get USB_DEVICE_DESCRIPTOR\r\n");
-                return rcode;
-        }
+        return rcode;
+}
 
-        // to-do?
-        // Allocate new address according to device class
-        //bAddress = addrPool.AllocAddress(parent, false, port);
-
-        uint16_t vid = udd->idVendor;
-        uint16_t pid = udd->idProduct;
-        uint8_t klass = udd->bDeviceClass;
-        uint8_t subklass = udd->bDeviceSubClass;
-        // Attempt to configure if VID/PID or device class matches with a driver
-        // Qualify with subclass too.
-        //
-        // VID/PID & class tests default to false for drivers not yet ported
-        // subclass defaults to true, so you don't have to define it if you don't have to.
-        //
-        for(devConfigIndex = 0; devConfigIndex < USB_NUMDEVICES; devConfigIndex++) {
-                if(!devConfig[devConfigIndex]) continue; // no driver
-                if(devConfig[devConfigIndex]->GetAddress()) continue; // consumed
-                if(devConfig[devConfigIndex]->DEVSUBCLASSOK(subklass) && (devConfig[devConfigIndex]->VIDPIDOK(vid, pid) || devConfig[devConfigIndex]->DEVCLASSOK(klass))) {
-                        rcode = AttemptConfig(devConfigIndex, parent, port, lowspeed);
-                        if(rcode != USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED)
-                                break;
+/* Picks the next driver of the current pass. Attempt to configure if VID/PID or device class matches  */
+/* with a driver, qualify with subclass too. VID/PID & class tests default to false for drivers not    */
+/* yet ported, subclass defaults to true, so you don't have to define it if you don't have to. The    */
+/* drivers that did not match are tried blindly after that.                                           */
+void USB::EnumSelect() {
+        uint16_t vid = enumState.udd.idVendor;
+        uint16_t pid = enumState.udd.idProduct;
+        uint8_t klass = enumState.udd.bDeviceClass;
+        uint8_t subklass = enumState.udd.bDeviceSubClass;
+
+#if USE_UHS_BIND_CACHE
+        if(enumState.pass == USB_ENUM_PASS_CACHED) {
+                // A device seen before goes straight to the driver that took it, as long as that driver is free
+                USBBindEntry *bind = BindCacheEntry(&enumState.udd, false);
+                if(bind && devConfig[bind->driver] && !devConfig[bind->driver]->GetAddress()) {
+                        enumState.driver = bind->driver;
+                        enumState.retries = 0;
+                        enumState.state = USB_ENUM_STATE_CONFIGURE;
+                        return;
                 }
+                enumState.pass = USB_ENUM_PASS_MATCH;
+        }
+#endif
+        for(; enumState.driver < USB_NUMDEVICES; enumState.driver++) {
+                USBDeviceConfig *pdev = devConfig[enumState.driver];
+
+                if(!pdev) continue; // no driver
+                if(pdev->GetAddress()) continue; // consumed
+                if((pdev->DEVSUBCLASSOK(subklass) && (pdev->VIDPIDOK(vid, pid) || pdev->DEVCLASSOK(klass))) != (enumState.pass == USB_ENUM_PASS_MATCH)) continue;
+                enumState.retries = 0;
+                enumState.state = USB_ENUM_STATE_CONFIGURE;
+                return;
         }
 
-        if(devConfigIndex < USB_NUMDEVICES) {
-                return rcode;
+        if(enumState.pass == USB_ENUM_PASS_MATCH) {
+                enumState.pass = USB_ENUM_PASS_BLIND;
+                enumState.driver = 0;
+                return;
         }
 
+        // if we get here that means that the device class is not supported by any of registered classes
+        EnumDone(DefaultAddressing(enumState.parent, enumState.port, enumState.lowspeed));
+}
+
+/* Result of the driver being tried, either the enumeration is done or the next driver gets the device */
+void USB::EnumResult(uint8_t rcode) {
+        bool next;
 
-        // blindly attempt to configure
-        for(devConfigIndex = 0; devConfigIndex < USB_NUMDEVICES; devConfigIndex++) {
-                if(!devConfig[devConfigIndex]) continue;
-                if(devConfig[devConfigIndex]->GetAddress()) continue; // consumed
-                if(devConfig[devConfigIndex]->DEVSUBCLASSOK(subklass) && (devConfig[devConfigIndex]->VIDPIDOK(vid, pid) || devConfig[devConfigIndex]->DEVCLASSOK(klass))) continue; // If this is true it means it must have returned USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED above
-                rcode = AttemptConfig(devConfigIndex, parent, port, lowspeed);
+        // A driver that matched the device and is already in use ends the enumeration, a blind one does not
+        if(enumState.pass == USB_ENUM_PASS_MATCH)
+                next = (rcode == USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED);
+        else
+                next = (rcode == USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED || rcode == USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE);
 
+        if(!next) {
                 //printf("ERROR ENUMERATING %2.2x\r\n", rcode);
-                if(!(rcode == USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED || rcode == USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE)) {
-                        // in case of an error dev_index should be reset to 0
-                        //                in order to start from the very beginning the
-                        //                next time the program gets here
-                        //if (rcode != USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE)
-                        //        devConfigIndex = 0;
-                        return rcode;
+                if(!rcode) {
+#if USE_UHS_BIND_CACHE
+                        BindCacheEntry(&enumState.udd, true)->driver = enumState.driver;
+#endif
+#if USE_UHS_EVENTS
+                        eventAddr[enumState.driver] = devConfig[enumState.driver]->GetAddress();
+#endif
+                        ActiveAdd(enumState.driver);
+                        QueueEvent(USB_EVENT_CONFIGURED, devConfig[enumState.driver]->GetAddress(), enumState.parent, enumState.port, 0, devConfig[enumState.driver]);
                 }
+                EnumDone(rcode);
+                return;
         }
-        // if we get here that means that the device class is not supported by any of registered classes
-        rcode = DefaultAddressing(parent, port, lowspeed);
 
-        return rcode;
+#if USE_UHS_BIND_CACHE
+        if(enumState.pass == USB_ENUM_PASS_CACHED) {
+                USBBindEntry *bind = BindCacheEntry(&enumState.udd, false);
+
+                if(bind)
+                        bind->driver = USB_NUMDEVICES; // the driver changed its mind, find another one
+                enumState.pass = USB_ENUM_PASS_MATCH;
+                enumState.driver = 0;
+                enumState.state = USB_ENUM_STATE_SELECT;
+                return;
+        }
+#endif
+        enumState.driver++;
+        enumState.state = USB_ENUM_STATE_SELECT;
+}
+
+/* Resets the device, on the root port or through its hub, and waits for the reset to finish */
+void USB::EnumReset() {
+        if(enumState.parent == 0) {
+                // Send a bus reset on the root interface.
+                regWr(rHCTL, bmBUSRST); //issue bus reset
+        } else {
+                // reset parent port, 'parent' is the address of the hub without the hub bit
+                for(uint8_t i = 0; i < USB_NUMDEVICES; i++) {
+                        UsbDeviceAddress a;
+
+                        if(!devConfig[i]) continue;
+                        a.devAddress = devConfig[i]->GetAddress();
+                        if(a.bmHub && a.bmAddress == enumState.parent) {
+                                devConfig[i]->ResetHubPort(enumState.port);
+                                break;
+                        }
+                }
+        }
+        enumState.wait = (uint32_t)millis() + USB_RESET_DELAY;
 }
 
+void USB::EnumDone(uint8_t rcode) {
+        enumState.state = USB_ENUM_STATE_IDLE;
+        if(rcode)
+                QueueEvent(USB_EVENT_ERROR, 0, enumState.parent, enumState.port, rcode, NULL);
+
+        // The root device decides the state of the bus, a device behind a hub does not
+        if(enumState.parent == 0 && usb_task_state == USB_STATE_CONFIGURING) {
+                if(rcode) {
+                        usb_error = rcode;
+                        usb_task_state = USB_STATE_ERROR;
+                } else
+                        usb_task_state = USB_STATE_RUNNING;
+        }
+}
+
+#if USE_UHS_BIND_CACHE
+/* Driver binding cache. Only the binding is kept, the driver still reads the descriptors it needs */
+USBBindEntry* USB::BindCacheEntry(const USB_DEVICE_DESCRIPTOR *udd, bool alloc) {
+        USBBindEntry *b = NULL;
+
+        for(uint8_t i = 0; i < USB_NUMBINDCACHE; i++) {
+                if(bindCache[i].driver < USB_NUMDEVICES && bindCache[i].vid == udd->idVendor && bindCache[i].pid == udd->idProduct && bindCache[i].bcdDevice == udd->bcdDevice)
+                        return bindCache + i;
+        }
+
+        if(!alloc)
+                return NULL;
+
+        for(uint8_t i = 0; i < USB_NUMBINDCACHE; i++) {
+                if(bindCache[i].driver >= USB_NUMDEVICES) {
+                        b = bindCache + i;
+                        break;
+                }
+        }
+        if(!b) { // cache full, recycle the entries in turn
+                b = bindCache + bindCacheNext;
+                bindCacheNext = (bindCacheNext + 1) % USB_NUMBINDCACHE;
+        }
+        b->vid = udd->idVendor;
+        b->pid = udd->idProduct;
+        b->bcdDevice = udd->bcdDevice;
+        return b;
+}
+#endif
+
 uint8_t USB::ReleaseDevice(uint8_t addr) {
         if(!addr)
                 return 0;
 
+        QueueEvent(USB_EVENT_DETACHED, addr, 0, 0, 0, NULL);
+
         for(uint8_t i = 0; i < USB_NUMDEVICES; i++) {
                 if(!devConfig[i]) continue;
                 if(devConfig[i]->GetAddress() == addr)
@@ -810,19 +2244,28 @@ uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t con
 /* Requests Configuration Descriptor. Sends two Get Conf Descr requests. The first one gets the total length of all descriptors, then the second one requests this
  total length. The length of the first request can be shorter ( 4 bytes ), however, there are devices which won't work unless this length is set to 9 */
 uint8_t USB::getConfDescr(uint8_t addr, uint8_t ep, uint8_t conf, USBReadParser *p) {
-        const uint8_t bufSize = 64;
-        uint8_t buf[bufSize];
-        USB_CONFIGURATION_DESCRIPTOR *ucd = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR *>(buf);
+        USB_CONFIGURATION_DESCRIPTOR ucd;
 
-        uint8_t ret = getConfDescr(addr, ep, 9, conf, buf);
+        uint8_t ret = getConfDescr(addr, ep, 9, conf, (uint8_t*)&ucd);
 
         if(ret)
                 return ret;
 
-        uint16_t total = ucd->wTotalLength;
+        uint16_t total = ucd.wTotalLength;
 
         //USBTRACE2("\r\ntotal conf.size:", total);
 
+        // A streaming parser takes the descriptors straight from the FIFO, no buffer needed
+        if(p && p->Streams())
+                return ( ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, conf, USB_DESCRIPTOR_CONFIGURATION, 0x0000, total, total, NULL, p));
+        return getConfDescrBuffered(addr, ep, conf, total, p);
+}
+
+/* The rest of getConfDescr() for a parser that does not stream, the buffer is only on the stack for these */
+uint8_t USB::getConfDescrBuffered(uint8_t addr, uint8_t ep, uint8_t conf, uint16_t total, USBReadParser *p) {
+        const uint8_t bufSize = 64;
+        uint8_t buf[bufSize];
+
         return ( ctrlReq(addr, ep, bmREQ_GET_DESCR, USB_REQUEST_GET_DESCRIPTOR, conf, USB_DESCRIPTOR_CONFIGURATION, 0x0000, total, bufSize, buf, p));
 }
 
@@ -833,11 +2276,20 @@ uint8_t USB::getStrDescr(uint8_t addr, uint8_t ep, uint16_t ns, uint8_t index, u
 }
 //set address
 
-uint8_t USB::setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr) {
+/* The device gets setAddrRecovery() milliseconds before the next request. With 'wait' false the  */
+/* caller is a driver that returns from ConfigureDevice(), or from Init() with                     */
+/* USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE, right after; EnumTask() then holds the next step   */
+/* until the time is up instead of setAddr() blocking for it.                                       */
+uint8_t USB::setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr, bool wait) {
         uint8_t rcode = ctrlReq(oldaddr, ep, bmREQ_SET, USB_REQUEST_SET_ADDRESS, newaddr, 0x00, 0x0000, 0x0000, 0x0000, NULL, NULL);
         //delay(2); //per USB 2.0 sect.9.2.6.3
-        delay(300); // Older spec says you should wait at least 200ms
-        return rcode;
+        if(rcode)
+                return rcode;
+        if(wait)
+                delay(addrRecovery);
+        else if(isEnumerating())
+                enumState.wait = (uint32_t)millis() + addrRecovery;
+        return 0;
         //return ( ctrlReq(oldaddr, ep, bmREQ_SET, USB_REQUEST_SET_ADDRESS, newaddr, 0x00, 0x0000, 0x0000, 0x0000, NULL, NULL));
 }
 //set configuration
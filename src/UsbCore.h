@@ -60,6 +60,7 @@ typedef MAX3421e<P10, P9> MAX3421E; // Official Arduinos (UNO, Duemilanove, Mega
 #define bmREQ_GET_DESCR     USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_STANDARD|USB_SETUP_RECIPIENT_DEVICE     //get descriptor request type
 #define bmREQ_SET           USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_STANDARD|USB_SETUP_RECIPIENT_DEVICE     //set request type for all but 'set feature' and 'set interface'
 #define bmREQ_CL_GET_INTF   USB_SETUP_DEVICE_TO_HOST|USB_SETUP_TYPE_CLASS|USB_SETUP_RECIPIENT_INTERFACE     //get interface request type
+#define bmREQ_SET_EP        USB_SETUP_HOST_TO_DEVICE|USB_SETUP_TYPE_STANDARD|USB_SETUP_RECIPIENT_ENDPOINT   //set/clear feature request type for an endpoint
 
 // D7           data transfer direction (0 - host-to-device, 1 - device-to-host)
 // D6-5         Type (0- standard, 1 - class, 2 - vendor, 3 - reserved)
@@ -98,18 +99,54 @@ typedef MAX3421e<P10, P9> MAX3421E; // Official Arduinos (UNO, Duemilanove, Mega
 #define USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE         0xD9
 #define USB_ERROR_INVALID_MAX_PKT_SIZE                  0xDA
 #define USB_ERROR_EP_NOT_FOUND_IN_TBL                   0xDB
+#define USB_ERROR_TRANSFER_ABORTED                      0xDC
+#define USB_ERROR_TRANSFER_IN_PROGRESS                  0xDD
+#define USB_ERROR_PERIODIC_TABLE_FULL                   0xDE
+#define USB_ERROR_ENUMERATION_BUSY                      0xDF
 #define USB_ERROR_CONFIG_REQUIRES_ADDITIONAL_RESET      0xE0
 #define USB_ERROR_FailGetDevDescr                       0xE1
 #define USB_ERROR_FailSetDevTblEntry                    0xE2
 #define USB_ERROR_FailGetConfDescr                      0xE3
+#define USB_ERROR_INVALID_BUS_STATE                     0xE4
+#define USB_ERROR_EVENT_TABLE_FULL                      0xE5
 #define USB_ERROR_TRANSFER_TIMEOUT                      0xFF
 
 #define USB_XFER_TIMEOUT        5000    // (5000) USB transfer timeout in milliseconds, per section 9.2.6.1 of USB 2.0 spec
 //#define USB_NAK_LIMIT         32000   // NAK limit for a transfer. 0 means NAKs are not counted
 #define USB_RETRY_LIMIT         3       // 3 retry limit for a transfer
+#define USB_STALL_RETRY_LIMIT   1       // times a transfer is tried again after the halt of its endpoint was cleared
 #define USB_SETTLE_DELAY        200     // settle delay in milliseconds
+#define USB_PORT_SETTLE_DELAY   20      // settle delay after a hub port reset in milliseconds
+#define USB_RESET_DELAY         102     // bus reset and recovery in milliseconds, 100ms compensated for clock inaccuracy
+#define USB_RETRY_DELAY         100     // delay before a device that answered with a J state error is tried again
+#define USB_RESUME_RECOVERY     10      // time a device gets after the resume signaling, in milliseconds
+#ifndef USB_SET_ADDRESS_DELAY
+#define USB_SET_ADDRESS_DELAY   300     // SET_ADDRESS recovery in milliseconds. USB 2.0 asks for 2ms, the older spec for at least 200ms, see USB::setAddrRecovery()
+#endif
 
 #define USB_NUMDEVICES          16      //number of USB devices
+#define USB_NUMHOSTS            4       //number of hosts a USBScheduler runs
+#define USB_NUMPERIODIC         8       //number of drivers the frame scheduler can poll
+#define USB_PERIODIC_FRAMES     128     //frame scheduler period, the longest polling interval in frames (power of two)
+#define USB_NUMNAKSTATS         8       //number of endpoints the adaptive NAK limit keeps history for
+#define USB_NAK_ADAPT_MIN_POWER 2       //smallest learned NAK power, 3 NAKs
+#define USB_NAK_ADAPT_BUSY      128     //data ratio above which an endpoint keeps its full NAK limit
+#define USB_NUMBINDCACHE        4       //number of devices the driver binding cache remembers
+#define USB_NUMEVENTS           8       //number of device events queued for the next Task() call
+#define USB_POLL_NEVER          0x40000000UL    //NextPollTime() offset of a driver that has nothing to poll, about 12 days
+#define USB_NUMEVENTHANDLERS    4       //number of event handlers that can be registered
+#define USB_XFER_SHARE_INTR     1000    //default microseconds per frame for asynchronous interrupt transfers
+#define USB_XFER_SHARE_CTRL     500     //default microseconds per frame for asynchronous control requests
+#define USB_XFER_SHARE_BULK     250     //default microseconds per frame for asynchronous bulk transfers
+#ifndef USB_CAPTURE_RECORDS
+#define USB_CAPTURE_RECORDS     16      //number of transactions the capture buffer holds
+#endif
+#ifndef USB_CAPTURE_SNAPLEN
+#define USB_CAPTURE_SNAPLEN     16      //payload bytes kept per captured transaction
+#endif
+#if USB_CAPTURE_SNAPLEN < 8
+#error "USB_CAPTURE_SNAPLEN has to hold a setup packet"
+#endif
 //#define HUB_MAX_HUBS          7       // maximum number of hubs that can be attached to the host controller
 #define HUB_PORT_RESET_DELAY    20      // hub port reset delay 10 ms recomended, can be up to 20 ms
 
@@ -120,6 +157,7 @@ typedef MAX3421e<P10, P9> MAX3421E; // Official Arduinos (UNO, Duemilanove, Mega
 #define USB_DETACHED_SUBSTATE_INITIALIZE                    0x11
 #define USB_DETACHED_SUBSTATE_WAIT_FOR_DEVICE               0x12
 #define USB_DETACHED_SUBSTATE_ILLEGAL                       0x13
+#define USB_DETACHED_SUBSTATE_SUSPENDED                     0x14
 #define USB_ATTACHED_SUBSTATE_SETTLE                        0x20
 #define USB_ATTACHED_SUBSTATE_RESET_DEVICE                  0x30
 #define USB_ATTACHED_SUBSTATE_WAIT_RESET_COMPLETE           0x40
@@ -130,6 +168,27 @@ typedef MAX3421e<P10, P9> MAX3421E; // Official Arduinos (UNO, Duemilanove, Mega
 #define USB_STATE_CONFIGURING                               0x80
 #define USB_STATE_RUNNING                                   0x90
 #define USB_STATE_ERROR                                     0xa0
+#define USB_STATE_SUSPENDED                                 0xb0
+#define USB_SUSPENDED_SUBSTATE_RESUME                       0xb1
+#define USB_SUSPENDED_SUBSTATE_RECOVERY                     0xb2
+
+/* Device events, see USBEventHandler */
+#define USB_EVENT_ATTACHED              0x01    // a device at 'parent'/'port' is being enumerated
+#define USB_EVENT_DETACHED              0x02    // the device at 'addr' was disconnected, 0 for the root port
+#define USB_EVENT_CONFIGURED            0x03    // 'pdev' took the device at 'addr'
+#define USB_EVENT_RELEASED              0x04    // 'pdev' let go of the device at 'addr'
+#define USB_EVENT_ERROR                 0x05    // the enumeration of the device at 'parent'/'port' failed with 'rcode'
+
+class USBDeviceConfig;
+
+struct USBEvent {
+        uint8_t type; // USB_EVENT_xxx
+        uint8_t addr; // device address
+        uint8_t parent; // address of the hub the device is on, 0 for the root port, not set for DETACHED and RELEASED
+        uint8_t port; // hub port, not set for DETACHED and RELEASED
+        uint8_t rcode; // USB_EVENT_ERROR only
+        USBDeviceConfig *pdev; // driver, USB_EVENT_CONFIGURED and USB_EVENT_RELEASED only
+};
 
 class USBDeviceConfig {
 public:
@@ -158,6 +217,22 @@ public:
                 return;
         } // Note used for hubs only!
 
+        virtual void Suspend() {
+                return;
+        } // The bus is about to be suspended, Poll() is not called until Resume()
+
+        virtual void Resume() {
+                return;
+        } // The bus is running again, after a remote wakeup or USB::resume()
+
+        virtual void UsbEvent(const USBEvent *ev __attribute__((unused))) {
+                return;
+        } // A device event, delivered from Task() to every driver with USE_UHS_EVENTS
+
+        virtual uint32_t NextPollTime() {
+                return (uint32_t)millis();
+        } // millis() when Poll() has work to do next, with USE_UHS_ACTIVE_POLL. The default is every frame
+
         virtual bool VIDPIDOK(uint16_t vid __attribute__((unused)), uint16_t pid __attribute__((unused))) {
                 return false;
         }
@@ -205,12 +280,279 @@ typedef struct {
 class USBReadParser {
 public:
         virtual void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset) = 0;
+
+        /* Streaming. A parser that overrides these gets the IN data stage of ctrlReq() read out of the */
+        /* FIFO straight into its own buffers instead of a caller buffer and Parse(). StreamBuffer()    */
+        /* returns where the next bytes go, or NULL to skip them, and lowers '*len' (at most what is    */
+        /* left of the packet) to the number of bytes that go there. It must not change the state of    */
+        /* the parser, StreamDone() is called once those bytes are in. That is in the middle of the     */
+        /* FIFO read, so neither may touch the USB. Setting '*len' to 0 means the parser does not       */
+        /* stream, or is done, which is what the default does.                                          */
+        virtual uint8_t* StreamBuffer(uint16_t *len) {
+                *len = 0;
+                return NULL;
+        };
+
+        virtual void StreamDone(uint16_t len __attribute__((unused))) {
+        };
+
+        bool Streams() {
+                uint16_t len = 1;
+
+                StreamBuffer(&len);
+                return (len != 0);
+        };
+};
+
+/* Asynchronous transfers */
+#define USB_XFER_TYPE_IN                0x01
+#define USB_XFER_TYPE_OUT               0x02
+#define USB_XFER_TYPE_CTRL              0x03
+
+#define USB_XFER_STATE_IDLE             0x00    // not queued, 'rcode' holds the result of the last transfer
+#define USB_XFER_STATE_SETUP            0x01    // control transfer setup stage
+#define USB_XFER_STATE_DATA             0x02    // data stage
+#define USB_XFER_STATE_STATUS           0x03    // control transfer status stage
+
+/* Priority classes of the asynchronous transfers, served in this order, see USB::setXferShare() */
+#define USB_XFER_CLASS_INTR             0x00    // interrupt pipes, HID reports, HCI events
+#define USB_XFER_CLASS_CTRL             0x01    // control requests
+#define USB_XFER_CLASS_BULK             0x02    // bulk pipes
+#define USB_XFER_CLASSES                3
+
+struct USBXferReq;
+
+// Base class for asynchronous transfer completion handlers
+
+class USBXferHandler {
+public:
+        virtual void XferDone(USBXferReq *req) = 0;
+};
+
+// Base class for device event handlers, see USB::RegisterEventHandler()
+
+class USBEventHandler {
+public:
+        virtual void UsbEvent(const USBEvent *ev) = 0;
+};
+
+/* Request block of an asynchronous transfer. The memory is owned by the caller and has to stay valid */
+/* until XferDone() is called or the request is cancelled. Do not modify it while it is queued.      */
+struct USBXferReq {
+        USBXferReq *next; // queue link, used by the USB class
+        USBXferHandler *handler; // called from USB::Task() when the transfer is finished
+        uint8_t *data; // data buffer
+        uint16_t nbytes; // number of bytes requested
+        uint16_t count; // number of bytes transferred
+        uint16_t nakCount; // NAKs received so far
+        uint32_t timeout; // millis() deadline
+        uint8_t addr; // device address
+        uint8_t ep; // endpoint address
+        uint8_t type; // USB_XFER_TYPE_IN, USB_XFER_TYPE_OUT or USB_XFER_TYPE_CTRL
+        uint8_t state; // USB_XFER_STATE_xxx
+        uint8_t xclass; // USB_XFER_CLASS_xxx
+        uint8_t rcode; // result, valid in XferDone()
+        SETUP_PKT setup; // control transfers only
+};
+
+/* Counters of an isochronous stream, see USB::isoStartIn() */
+struct USBIsoStats {
+        uint32_t packets; // packets moved, zero-length ones included
+        uint32_t bytes; // payload bytes moved
+        uint16_t missed; // intervals that went by without a transaction, Task() was not called in time
+        uint16_t overruns; // IN intervals skipped because the ring was full
+        uint16_t underruns; // OUT intervals with no packet queued
+        uint16_t errors; // transactions that failed, e.g. no answer from the device or a CRC error
+};
+
+/* Isochronous stream. The ring of 'slots' packet buffers, maxPktSize of the endpoint each, and the */
+/* array of their lengths are owned by the caller and have to stay valid until isoStop() is called. */
+/* The sketch takes IN packets with Front()/Pop() and queues OUT packets with Back()/Push().        */
+struct USBIsoStream {
+        USBIsoStream *next; // list link, used by the USB class
+        uint8_t *ring; // packet buffers
+        uint8_t *lens; // length of the packet in each buffer
+        uint8_t slots; // number of packet buffers
+        uint8_t pktSize; // size of a packet buffer
+        uint8_t head; // oldest packet
+        uint8_t count; // packets in the ring
+        uint8_t addr; // device address
+        uint8_t ep; // endpoint address
+        bool in; // IN endpoint
+        uint8_t interval; // frames between transactions, a power of two
+        uint16_t nextFrame; // frame number of the next transaction
+        USBIsoStats stats;
+
+        /* Oldest packet and its length, NULL if the ring is empty */
+        uint8_t* Front(uint8_t *len) {
+                if(!count)
+                        return NULL;
+                *len = lens[head];
+                return ring + (uint16_t)head * pktSize;
+        };
+
+        void Pop() {
+                if(!count)
+                        return;
+                head = (head + 1) % slots;
+                count--;
+        };
+
+        /* Free packet buffer, NULL if the ring is full */
+        uint8_t* Back() {
+                if(count == slots)
+                        return NULL;
+                return ring + (uint16_t)((head + count) % slots) * pktSize;
+        };
+
+        /* Adds the packet in the buffer Back() returned, 'len' is at most pktSize */
+        void Push(uint8_t len) {
+                if(count == slots)
+                        return;
+                lens[(head + count) % slots] = (len > pktSize) ? pktSize : len;
+                count++;
+        };
+};
+
+/* Poll heap entry, see USE_UHS_ACTIVE_POLL */
+struct USBActiveEntry {
+        uint32_t due; // millis() of the next poll
+        uint8_t driver; // devConfig index
+};
+
+/* Frame scheduler entry, see USB::RegisterPeriodic() */
+struct USBPeriodicEntry {
+        USBDeviceConfig *pdev; // driver to poll, NULL if the entry is free
+        uint16_t nextFrame; // frame number of the next poll
+        uint8_t interval; // polling interval in frames, a power of two
+        uint8_t phase; // frame offset within the interval
+};
+
+/* Counters of the STALL recovery, see USB::getRecoveryStats() */
+struct USBRecoveryStats {
+        uint16_t stalls; // STALLs that ended an inTransfer() or outTransfer()
+        uint16_t cleared; // endpoint halts cleared, by the recovery or clearEpHalt()
+        uint16_t retried; // transfers tried again after the halt was cleared
+        uint16_t togResyncs; // hrTOGERR data toggle resyncs
+};
+
+/* Learned NAK behaviour of an endpoint, see USB::getNakStats() */
+struct USBNakStats {
+        uint8_t addr; // device address, 0 if the entry is free
+        uint8_t ep; // endpoint address
+        uint8_t nakPower; // learned NAK power, never above bmNakPower of the endpoint
+        uint8_t dataRatio; // running share of transfers that moved data, 255 means all of them
+        uint16_t avgNaks; // running average of NAKs before data moved
+        uint16_t avgLatency; // running average time of a transfer that moved data, in ms
+};
+
+/* Driver that accepted a device, see USB::Configuring() */
+struct USBBindEntry {
+        uint16_t vid; // idVendor
+        uint16_t pid; // idProduct
+        uint16_t bcdDevice; // device release, a firmware update may change the driver
+        uint8_t driver; // index into devConfig[], USB_NUMDEVICES if the entry is free
+};
+
+/* Enumeration engine states, see USB::Configuring() */
+#define USB_ENUM_STATE_IDLE             0x00    // no device is being enumerated
+#define USB_ENUM_STATE_DESCRIPTOR       0x01    // read the device descriptor at address 0
+#define USB_ENUM_STATE_SELECT           0x02    // pick the next driver to offer the device to
+#define USB_ENUM_STATE_CONFIGURE        0x03    // driver ConfigureDevice()
+#define USB_ENUM_STATE_INIT             0x04    // driver Init(), called again while it returns USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE
+#define USB_ENUM_STATE_FAILED           0x05    // driver failed, the device is reset before the result counts
+
+#define USB_ENUM_PASS_CACHED            0x00    // driver from the binding cache
+#define USB_ENUM_PASS_MATCH             0x01    // drivers that claim the VID/PID or class
+#define USB_ENUM_PASS_BLIND             0x02    // all other drivers
+
+/* Device being enumerated */
+struct USBEnumState {
+        uint32_t wait; // millis() deadline, nothing is done before it
+        uint8_t state; // USB_ENUM_STATE_xxx
+        uint8_t parent; // hub the device is attached to, 0 for the root port
+        uint8_t port;
+        bool lowspeed;
+        uint8_t pass; // USB_ENUM_PASS_xxx
+        uint8_t driver; // index into devConfig[] of the driver being tried
+        uint8_t retries; // J state error retries of the driver
+        uint8_t rcode; // result of the failed driver
+        USB_DEVICE_DESCRIPTOR udd;
+};
+
+/* One bus transaction in the capture buffer, see USB::captureFlush() */
+struct USBCaptureRecord {
+        uint32_t time; // micros() when the transaction ended
+        uint8_t addr; // device address
+        uint8_t ep; // endpoint number
+        uint8_t token; // tokSETUP, tokIN, tokOUT, tokINHS or tokOUTHS
+        uint8_t hrslt; // transaction result, hrSUCCESS, hrNAK, hrSTALL etc.
+        uint8_t len; // payload length on the wire
+        uint8_t data[USB_CAPTURE_SNAPLEN]; // first bytes of the payload
 };
 
 class USB : public MAX3421E {
         AddressPoolImpl<USB_NUMDEVICES> addrPool;
         USBDeviceConfig* devConfig[USB_NUMDEVICES];
         uint8_t bmHubPre;
+        USBXferReq *xferQueue[USB_XFER_CLASSES]; // pending asynchronous transfers of each class
+        USBXferReq *xferRun; // requests XferTask() or AbortXfers() took off the queue and has not served yet
+        USBXferReq *xferKeep; // requests XferTask() served in this call that stay queued
+        USBXferReq **xferKeepTail; // end of xferKeep
+        uint16_t xferShare[USB_XFER_CLASSES]; // microseconds per frame each class may use
+        uint32_t xferUsed[USB_XFER_CLASSES]; // microseconds used in the current frame
+        uint16_t xferFrame; // frame xferUsed[] belongs to
+        USBPeriodicEntry periodic[USB_NUMPERIODIC]; // drivers polled by the frame scheduler
+        uint32_t frameBase; // millis() at the first SOF after the bus reset
+        USBEnumState enumState; // enumeration in progress
+        uint32_t taskDeadline; // micros() at which a budgeted Task() call stops starting new work
+        bool taskBudget; // the running Task() call has a time budget
+        uint8_t taskPollNext; // driver the next Task() call polls first
+        uint8_t usb_task_state;
+        uint8_t usb_error;
+        uint32_t taskDelay; // end of the settle, reset and resume waits in Task()
+        uint16_t addrRecovery; // SET_ADDRESS recovery in milliseconds
+#if USE_UHS_ADAPTIVE_NAK
+        USBNakStats nakStats[USB_NUMNAKSTATS];
+        uint8_t nakStatsNext; // entry to recycle when the table is full
+        uint16_t xferNaks; // NAKs received in the current transfer
+        bool nakAdapted; // the current transfer started with a learned NAK limit
+        bool xferCut; // the current transfer gave up on the Task() budget, not on the NAK limit
+#endif
+#if USE_UHS_STALL_RECOVERY
+        USBRecoveryStats recoveryStats;
+#endif
+#if ENABLE_UHS_TELEMETRY
+        UsbEpTelemetry *xferTelemetry; // counters of the endpoint set up by SetAddress()
+        uint32_t xferStart; // millis() when the current transfer started
+        uint32_t taskMaxTime; // longest Task() call in microseconds
+#endif
+#if USE_UHS_ISO
+        USBIsoStream *isoList; // running isochronous streams
+#endif
+#if USE_UHS_ACTIVE_POLL
+        USBActiveEntry active[USB_NUMDEVICES]; // drivers that hold a device, a min-heap on 'due'
+        uint8_t activeCount;
+#endif
+#if USE_UHS_EVENTS
+        USBEvent events[USB_NUMEVENTS];
+        uint8_t eventHead; // oldest queued event
+        uint8_t eventCount; // events queued
+        uint8_t eventAddr[USB_NUMDEVICES]; // address each driver was reported configured with, 0 if none
+        USBEventHandler *eventHandlers[USB_NUMEVENTHANDLERS];
+#endif
+#if USE_UHS_BIND_CACHE
+        USBBindEntry bindCache[USB_NUMBINDCACHE];
+        uint8_t bindCacheNext; // entry to recycle when the cache is full
+#endif
+#if ENABLE_UHS_CAPTURE
+        USBCaptureRecord capture[USB_CAPTURE_RECORDS];
+        uint8_t captureHead; // oldest record
+        uint8_t captureCount; // records in the buffer
+        uint8_t captureAddr; // address set up by SetAddress()
+        bool captureOn;
+        uint32_t captureSeq; // transactions recorded since captureStart()
+#endif
 
 public:
         USB(void);
@@ -253,7 +595,7 @@ public:
         uint8_t getConfDescr(uint8_t addr, uint8_t ep, uint8_t conf, USBReadParser *p);
 
         uint8_t getStrDescr(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t index, uint16_t langid, uint8_t* dataptr);
-        uint8_t setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr);
+        uint8_t setAddr(uint8_t oldaddr, uint8_t ep, uint8_t newaddr, bool wait = true);
         uint8_t setConf(uint8_t addr, uint8_t ep, uint8_t conf_value);
         /**/
         uint8_t ctrlData(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* dataptr, bool direction);
@@ -262,23 +604,402 @@ public:
         uint8_t outTransfer(uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data);
         uint8_t dispatchPkt(uint8_t token, uint8_t ep, uint16_t nak_limit);
 
-        void Task(void);
+        /* 'budget' limits the call to that many microseconds, 0 runs all pending work. Work that is    */
+        /* left over is picked up by the next call. A driver Poll() or enumeration step that is started */
+        /* runs to its end, but transfers to a NAKing endpoint other than 0 give up when time runs out. */
+        void Task(uint16_t budget = 0);
 
         uint8_t DefaultAddressing(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Configuring(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t ReleaseDevice(uint8_t addr);
 
+        bool isEnumerating() {
+                return enumState.state != USB_ENUM_STATE_IDLE;
+        };
+
+        /* Time the devices get after SET_ADDRESS, USB_SET_ADDRESS_DELAY by default. Most devices */
+        /* are fine with a lot less, the 2ms of USB 2.0 or the 10ms Linux gives them.            */
+        void setAddrRecovery(uint16_t ms) {
+                addrRecovery = ms;
+        };
+
+        /* Low power idle. suspend() stops the SOFs, so the devices go to suspend, and powers the MAX3421E */
+        /* down; with nothing attached only the chip is powered down. A device being attached or removed, */
+        /* or a remote wakeup, wakes the stack up again from Task(). resume() does it from the sketch.    */
+        uint8_t suspend();
+        uint8_t resume();
+        bool isSuspended();
+
+#if USE_UHS_MULTI_HOST
+        /* Chip access. USBHost<> overrides these with the MAX3421E on its own pins */
+        virtual int8_t Init() {
+                return MAX3421E::Init();
+        };
+
+        virtual int8_t Init(int mseconds) {
+                return MAX3421E::Init(mseconds);
+        };
+
+        virtual void regWr(uint8_t reg, uint8_t data) {
+                MAX3421E::regWr(reg, data);
+        };
+
+        virtual uint8_t* bytesWr(uint8_t reg, uint8_t nbytes, uint8_t* data_p) {
+                return MAX3421E::bytesWr(reg, nbytes, data_p);
+        };
+
+        virtual uint8_t regRd(uint8_t reg) {
+                return MAX3421E::regRd(reg);
+        };
+
+        virtual uint8_t* bytesRd(uint8_t reg, uint8_t nbytes, uint8_t* data_p) {
+                return MAX3421E::bytesRd(reg, nbytes, data_p);
+        };
+
+        virtual void regBatch(MAX3421eRegOp *ops, uint8_t nops) {
+                MAX3421E::regBatch(ops, nops);
+        };
+
+        virtual void fifoRdBegin(uint8_t reg) {
+                MAX3421E::fifoRdBegin(reg);
+        };
+
+        virtual uint8_t* fifoRd(uint8_t nbytes, uint8_t* data_p) {
+                return MAX3421E::fifoRd(nbytes, data_p);
+        };
+
+        virtual void fifoRdEnd() {
+                MAX3421E::fifoRdEnd();
+        };
+
+        virtual void gpioWr(uint8_t data) {
+                MAX3421E::gpioWr(data);
+        };
+
+        virtual uint8_t gpioRd() {
+                return MAX3421E::gpioRd();
+        };
+
+        virtual void vbusPower(VBUS_t state) {
+                MAX3421E::vbusPower(state);
+        };
+
+        virtual uint8_t getVbusState(void) {
+                return MAX3421E::getVbusState();
+        };
+
+        virtual bool isPoweredDown(void) {
+                return MAX3421E::isPoweredDown();
+        };
+
+        virtual void powerDown() {
+                MAX3421E::powerDown();
+        };
+
+        virtual bool powerUp() {
+                return MAX3421E::powerUp();
+        };
+
+        virtual bool waitXfrDone(uint32_t timeout, uint8_t *hrsl = NULL) {
+                return MAX3421E::waitXfrDone(timeout, hrsl);
+        };
+
+protected:
+        virtual uint8_t ChipTask() {
+                return MAX3421E::Task();
+        };
+
+public:
+#endif
+
         uint8_t ctrlReq(uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
                 uint16_t wInd, uint16_t total, uint16_t nbytes, uint8_t* dataptr, USBReadParser *p);
 
+        /* Asynchronous transfers, advanced from Task(). Return 0 if the request was queued. IN and OUT */
+        /* transfers are bulk class unless 'xclass' says otherwise, control requests are control class  */
+        uint8_t submitInTransfer(USBXferReq *req, uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data, USBXferHandler *handler, uint8_t xclass = USB_XFER_CLASS_BULK);
+        uint8_t submitOutTransfer(USBXferReq *req, uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data, USBXferHandler *handler, uint8_t xclass = USB_XFER_CLASS_BULK);
+        uint8_t submitCtrlReq(USBXferReq *req, uint8_t addr, uint8_t ep, uint8_t bmReqType, uint8_t bRequest, uint8_t wValLo, uint8_t wValHi,
+                uint16_t wInd, uint16_t nbytes, uint8_t* dataptr, USBXferHandler *handler);
+        bool cancelTransfer(USBXferReq *req);
+        uint8_t setXferShare(uint8_t xclass, uint16_t us);
+
+        /* Frame scheduler. A registered driver gets its Poll() called from Task() every 'bInterval' frames */
+        uint16_t getFrameNumber(void);
+        uint8_t RegisterPeriodic(USBDeviceConfig *pdev, uint8_t bInterval);
+        void UnregisterPeriodic(USBDeviceConfig *pdev);
+#if USE_UHS_ISO
+
+        /* Isochronous streams, served from Task() before anything else. One packet is moved every      */
+        /* 2^(bInterval - 1) frames, 'bInterval' as in the endpoint descriptor, with no NAKs and no      */
+        /* retries. Task() has to be called at least that often or frames are missed, see USBIsoStats.   */
+        /* Packets are at most 64 bytes, the size of the MAX3421E FIFOs, and low-speed devices have none. */
+        uint8_t isoStartIn(USBIsoStream *s, uint8_t addr, uint8_t ep, uint8_t bInterval, uint8_t *ring, uint8_t *lens, uint8_t slots);
+        uint8_t isoStartOut(USBIsoStream *s, uint8_t addr, uint8_t ep, uint8_t bInterval, uint8_t *ring, uint8_t *lens, uint8_t slots);
+        bool isoStop(USBIsoStream *s);
+#endif
+#if USE_UHS_EVENTS
+
+        /* Device events are queued as they happen and delivered at the end of Task(), so a sketch can */
+        /* react to them instead of polling getUsbTaskState() and the drivers every loop.              */
+        uint8_t RegisterEventHandler(USBEventHandler *handler);
+        void UnregisterEventHandler(USBEventHandler *handler);
+#endif
+
+        /* Clears the halt of endpoint 'ep', bit 7 set for an IN endpoint, and puts its data toggle back to DATA0 */
+        uint8_t clearEpHalt(uint8_t addr, uint8_t ep);
+#if USE_UHS_STALL_RECOVERY
+
+        const USBRecoveryStats& getRecoveryStats() {
+                return recoveryStats;
+        };
+
+        void resetRecoveryStats() {
+                memset(&recoveryStats, 0, sizeof (recoveryStats));
+        };
+#endif
+
+#if USE_UHS_ADAPTIVE_NAK
+        /* Learned NAK limit of an endpoint, NULL if it has no history */
+        const USBNakStats* getNakStats(uint8_t addr, uint8_t ep);
+#endif
+
+#if ENABLE_UHS_TELEMETRY
+        /* Copies the counters of an endpoint into 'snapshot'. Returns false if the endpoint has none */
+        bool getTelemetry(uint8_t addr, uint8_t ep, UsbEpTelemetry *snapshot);
+        void resetTelemetry(uint8_t addr);
+        /* Longest time a single Task() call took, in microseconds */
+        uint32_t getTaskMaxTime(bool reset);
+#endif
+
+#if ENABLE_UHS_CAPTURE
+        /* Bus capture. The buffer keeps the last USB_CAPTURE_RECORDS transactions, NAKs included.  */
+        /* captureFlush() writes them in Linux usbmon pcap format and empties the buffer. Write the */
+        /* pcap file header with the first flush only, the output can be saved as a .pcap file.     */
+        void captureStart();
+        void captureStop();
+        uint8_t captureFlush(Print &out, bool header);
+#endif
+
 private:
         void init();
+#if !USE_UHS_MULTI_HOST
+
+        uint8_t ChipTask() {
+                return MAX3421E::Task();
+        };
+#endif
+        USBXferReq **FindXfer(USBXferReq *req);
+        uint8_t SubmitXfer(USBXferReq *req, uint8_t type, uint8_t xclass, uint8_t addr, uint8_t ep, uint16_t nbytes, uint8_t* data, USBXferHandler *handler);
+        bool XferStep(USBXferReq *req);
+        void XferTask();
+        void AbortXfers();
+        bool IsPeriodic(USBDeviceConfig *pdev);
+        void PeriodicTask();
+#if USE_UHS_ISO
+        uint8_t IsoStart(USBIsoStream *s, bool in, uint8_t addr, uint8_t ep, uint8_t bInterval, uint8_t *ring, uint8_t *lens, uint8_t slots);
+        void IsoTask();
+        void IsoStep(USBIsoStream *s);
+#else
+
+        void IsoTask() {
+        };
+#endif
+#if USE_UHS_ACTIVE_POLL
+        void ActiveAdd(uint8_t driver);
+        void ActiveTask();
+        uint8_t ActiveSiftUp(uint8_t k);
+        void ActiveSiftDown(uint8_t k);
+#else
+
+        void ActiveAdd(uint8_t driver __attribute__((unused))) {
+        };
+#endif
+
+#if USE_UHS_EVENTS
+        void QueueEvent(uint8_t type, uint8_t addr, uint8_t parent, uint8_t port, uint8_t rcode, USBDeviceConfig *pdev);
+        void EventTask();
+#else
+
+        void QueueEvent(uint8_t type __attribute__((unused)), uint8_t addr __attribute__((unused)), uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), uint8_t rcode __attribute__((unused)), USBDeviceConfig *pdev __attribute__((unused))) {
+        };
+
+        void EventTask() {
+        };
+#endif
+
+        bool TaskTimeUp() {
+                return taskBudget && (int32_t)((uint32_t)micros() - taskDeadline) >= 0L;
+        };
+#if USE_UHS_ADAPTIVE_NAK
+        USBNakStats* NakStatsEntry(uint8_t addr, uint8_t ep, bool alloc);
+        void NakStatsClear(uint8_t addr);
+        uint16_t NakAdapt(uint8_t addr, EpInfo *pep, uint16_t nak_limit);
+        void NakLearn(uint8_t addr, EpInfo *pep, uint8_t rcode, uint32_t start);
+#endif
         uint8_t SetAddress(uint8_t addr, uint8_t ep, EpInfo **ppep, uint16_t *nak_limit);
+        void ToggleResync(EpInfo *pep, bool in);
+#if USE_UHS_STALL_RECOVERY
+        bool StallRecover(uint8_t addr, uint8_t ep, bool in, bool retry, EpInfo **ppep, uint16_t *nak_limit);
+#else
+
+        bool StallRecover(uint8_t addr __attribute__((unused)), uint8_t ep __attribute__((unused)), bool in __attribute__((unused)), bool retry __attribute__((unused)), EpInfo **ppep __attribute__((unused)), uint16_t *nak_limit __attribute__((unused))) {
+                return false;
+        };
+#endif
+        void StreamRd(USBReadParser *p, uint8_t nbytes);
+        uint8_t getConfDescrBuffered(uint8_t addr, uint8_t ep, uint8_t conf, uint16_t total, USBReadParser *p);
+#if ENABLE_UHS_TELEMETRY
+        uint8_t XferResult(uint8_t rcode, uint16_t nbytes);
+#else
+
+        uint8_t XferResult(uint8_t rcode, uint16_t nbytes __attribute__((unused))) {
+                return rcode;
+        };
+#endif
+#if ENABLE_UHS_CAPTURE
+        void Capture(uint8_t token, uint8_t ep, uint8_t hrslt, const uint8_t *data, uint8_t len);
+        void CaptureData(const uint8_t *data, uint8_t len);
+#else
+
+        void Capture(uint8_t token __attribute__((unused)), uint8_t ep __attribute__((unused)), uint8_t hrslt __attribute__((unused)), const uint8_t *data __attribute__((unused)), uint8_t len __attribute__((unused))) {
+        };
+
+        void CaptureData(const uint8_t *data __attribute__((unused)), uint8_t len __attribute__((unused))) {
+        };
+#endif
         uint8_t OutTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t nbytes, uint8_t *data);
-        uint8_t InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, uint8_t *data, uint8_t bInterval = 0);
-        uint8_t AttemptConfig(uint8_t driver, uint8_t parent, uint8_t port, bool lowspeed);
+        uint8_t InTransfer(EpInfo *pep, uint16_t nak_limit, uint16_t *nbytesptr, uint8_t *data, uint8_t bInterval = 0, USBReadParser *stream = NULL);
+        void EnumTask();
+        uint8_t EnumDescriptor();
+        void EnumSelect();
+        void EnumResult(uint8_t rcode);
+        void EnumReset();
+        void EnumDone(uint8_t rcode);
+#if USE_UHS_BIND_CACHE
+        USBBindEntry* BindCacheEntry(const USB_DEVICE_DESCRIPTOR *udd, bool alloc);
+#endif
 };
 
+#if USE_UHS_MULTI_HOST
+/* A USB on a MAX3421E of its own, e.g. USBHost<P7, P6> Usb2; for a second shield with SS on 7 and INT */
+/* on 6. Drivers take it like any USB. Each host has its own address pool and device tree. The SPI    */
+/* settings of the chip are the third argument, see MAX3421eSpiDefault.                              */
+template< typename SPI_SS, typename INTR, typename SPI_CFG = MAX3421eSpiDefault > class USBHost : public USB {
+        MAX3421e< SPI_SS, INTR, SPI_CFG > chip;
+
+public:
+
+        int8_t Init() {
+                return chip.Init();
+        };
+
+        int8_t Init(int mseconds) {
+                return chip.Init(mseconds);
+        };
+
+        void regWr(uint8_t reg, uint8_t data) {
+                chip.regWr(reg, data);
+        };
+
+        uint8_t* bytesWr(uint8_t reg, uint8_t nbytes, uint8_t* data_p) {
+                return chip.bytesWr(reg, nbytes, data_p);
+        };
+
+        uint8_t regRd(uint8_t reg) {
+                return chip.regRd(reg);
+        };
+
+        uint8_t* bytesRd(uint8_t reg, uint8_t nbytes, uint8_t* data_p) {
+                return chip.bytesRd(reg, nbytes, data_p);
+        };
+
+        void regBatch(MAX3421eRegOp *ops, uint8_t nops) {
+                chip.regBatch(ops, nops);
+        };
+
+        void fifoRdBegin(uint8_t reg) {
+                chip.fifoRdBegin(reg);
+        };
+
+        uint8_t* fifoRd(uint8_t nbytes, uint8_t* data_p) {
+                return chip.fifoRd(nbytes, data_p);
+        };
+
+        void fifoRdEnd() {
+                chip.fifoRdEnd();
+        };
+
+        void gpioWr(uint8_t data) {
+                chip.gpioWr(data);
+        };
+
+        uint8_t gpioRd() {
+                return chip.gpioRd();
+        };
+
+        void vbusPower(VBUS_t state) {
+                chip.vbusPower(state);
+        };
+
+        uint8_t getVbusState(void) {
+                return chip.getVbusState();
+        };
+
+        bool isPoweredDown(void) {
+                return chip.isPoweredDown();
+        };
+
+        void powerDown() {
+                chip.powerDown();
+        };
+
+        bool powerUp() {
+                return chip.powerUp();
+        };
+
+        bool waitXfrDone(uint32_t timeout, uint8_t *hrsl = NULL) {
+                return chip.waitXfrDone(timeout, hrsl);
+        };
+#if ENABLE_UHS_SPI_STATS
+
+        const MAX3421eSpiStats& getSpiStats() {
+                return chip.getSpiStats();
+        };
+
+        void resetSpiStats() {
+                chip.resetSpiStats();
+        };
+#endif
+#if USE_UHS_SPI_DMA
+
+        void setSpiDma(MAX3421eSpiDma *dma) {
+                chip.setSpiDma(dma);
+        };
+#endif
+
+protected:
+
+        uint8_t ChipTask() {
+                return chip.Task();
+        };
+};
+
+/* Runs the Task() of several hosts. Every call starts with the host after the one that went first */
+/* last time, or with the first one a budgeted call did not get to. A budget is shared out evenly, */
+/* what a host leaves over goes to the hosts after it.                                             */
+class USBScheduler {
+        USB *hosts[USB_NUMHOSTS];
+        uint8_t numHosts;
+        uint8_t next; // host that goes first in the next Task()
+
+public:
+        USBScheduler();
+        uint8_t RegisterHost(USB *host);
+        void Task(uint16_t budget = 0);
+};
+#endif
+
 #if 0 //defined(USB_METHODS_INLINE)
 //get device descriptor
 
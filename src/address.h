@@ -79,6 +79,28 @@ struct UsbDeviceAddress {
 #define bmUSB_DEV_ADDR_PARENT           0x38
 #define bmUSB_DEV_ADDR_HUB              0x40
 
+#define USB_ADDRESS_MAP_SIZE            0x80            //address map entries, one for every address with bmReserved clear
+#define USB_EP_MAP_SIZE                 16              //endpoint map entries per device, one for every endpoint number
+
+#if ENABLE_UHS_TELEMETRY
+#define USB_TELEMETRY_EPS               4               //endpoints tracked per device, the control endpoint included
+#define USB_TELEMETRY_BINS              8               //latency histogram bins: 0ms, 1ms, 2-3ms, 4-7ms ... 64ms and above
+
+/* Transfer counters of an endpoint, see USB::getTelemetry() */
+struct UsbEpTelemetry {
+        uint8_t inUse; // entry is assigned to 'epAddr'
+        uint8_t epAddr; // Endpoint address
+        uint32_t transfers; // transfers started through ctrlReq(), inTransfer() or outTransfer()
+        uint32_t bytes; // data bytes moved
+        uint32_t naks; // NAKs received, including the ones of transfers that did move data
+        uint16_t nakLimits; // transfers that gave up on their NAK limit
+        uint16_t togErrors; // hrTOGERR toggle resyncs
+        uint16_t retries; // hrTIMEOUT retries
+        uint16_t errors; // transfers that failed for any other reason
+        uint16_t latency[USB_TELEMETRY_BINS]; // transfer time histogram, the counters stop at 0xffff
+};
+#endif
+
 struct UsbDevice {
         EpInfo *epinfo; // endpoint info pointer
         UsbDeviceAddress address;
@@ -107,19 +129,40 @@ class AddressPoolImpl : public AddressPool {
         // in order to avoid hub address duplication
 
         UsbDevice thePool[MAX_DEVICES_ALLOWED];
+#if ENABLE_UHS_TELEMETRY
+        UsbEpTelemetry theTelemetry[MAX_DEVICES_ALLOWED][USB_TELEMETRY_EPS];
+#endif
+#if USE_UHS_ADDRESS_MAP
+        uint8_t theIndex[USB_ADDRESS_MAP_SIZE]; // thePool index of each address, 0 if the address is free
+        uint8_t theEpIndex[MAX_DEVICES_ALLOWED][USB_EP_MAP_SIZE]; // epinfo index of each endpoint number, checked on use
+#endif
 
         // Initializes address pool entry
 
         void InitEntry(uint8_t index) {
+#if USE_UHS_ADDRESS_MAP
+                uint8_t old = thePool[index].address.devAddress & (USB_ADDRESS_MAP_SIZE - 1);
+
+                if(theIndex[old] == index)
+                        theIndex[old] = 0;
+                memset(theEpIndex[index], 0, sizeof(theEpIndex[index]));
+#endif
                 thePool[index].address.devAddress = 0;
                 thePool[index].epcount = 1;
                 thePool[index].lowspeed = 0;
                 thePool[index].epinfo = &dev0ep;
+#if ENABLE_UHS_TELEMETRY
+                memset(theTelemetry[index], 0, sizeof(theTelemetry[index]));
+#endif
         };
 
         // Returns thePool index for a given address
 
         uint8_t FindAddressIndex(uint8_t address = 0) {
+#if USE_UHS_ADDRESS_MAP
+                if(address)
+                        return (address < USB_ADDRESS_MAP_SIZE) ? theIndex[address] : 0;
+#endif
                 for(uint8_t i = 1; i < MAX_DEVICES_ALLOWED; i++) {
                         if(thePool[i].address.devAddress == address)
                                 return i;
@@ -163,6 +206,9 @@ class AddressPoolImpl : public AddressPool {
                 for(uint8_t i = 1; i < MAX_DEVICES_ALLOWED; i++)
                         InitEntry(i);
 
+#if USE_UHS_ADDRESS_MAP
+                memset(theIndex, 0, sizeof(theIndex));
+#endif
                 hubCounter = 0;
         };
 
@@ -231,6 +277,9 @@ public:
                                 hubCounter++;
                         } else
                                 thePool[index].address.devAddress = 1;
+#if USE_UHS_ADDRESS_MAP
+                        theIndex[thePool[index].address.devAddress] = index;
+#endif
 
                         return thePool[index].address.devAddress;
                 }
@@ -246,6 +295,9 @@ public:
                         addr.bmAddress = port;
                 }
                 thePool[index].address = addr;
+#if USE_UHS_ADDRESS_MAP
+                theIndex[addr.devAddress] = index;
+#endif
                 /*
                                 USB_HOST_SERIAL.print("Addr:");
                                 USB_HOST_SERIAL.print(addr.bmHub, HEX);
@@ -269,6 +321,78 @@ public:
                 FreeAddressByIndex(index);
         };
 
+#if USE_UHS_ADDRESS_MAP
+        // Returns the endpoint record of an endpoint, NULL if the device does not have it
+        EpInfo* GetEpInfo(uint8_t addr, uint8_t ep) {
+                uint8_t index = (addr) ? FindAddressIndex(addr) : 0;
+
+                if(addr && !index)
+                        return NULL;
+
+                UsbDevice *p = thePool + index;
+
+                if(!p->epinfo)
+                        return NULL;
+
+                // Drivers point epinfo to their own records while they set up a device, so the map is only a hint
+                uint8_t *hint = theEpIndex[index] + (ep & (USB_EP_MAP_SIZE - 1));
+
+                if(*hint < p->epcount && p->epinfo[*hint].epAddr == ep)
+                        return p->epinfo + *hint;
+
+                for(uint8_t i = 0; i < p->epcount; i++) {
+                        if(p->epinfo[i].epAddr == ep) {
+                                *hint = i;
+                                return p->epinfo + i;
+                        }
+                }
+                return NULL;
+        };
+
+#endif
+#if ENABLE_UHS_TELEMETRY
+        // Returns the counters of an endpoint, assigning a free entry if 'alloc' is set
+
+        UsbEpTelemetry* GetEpTelemetry(uint8_t addr, uint8_t ep, bool alloc) {
+                uint8_t index = (addr) ? FindAddressIndex(addr) : 0;
+
+                if(addr && !index)
+                        return NULL;
+
+                UsbEpTelemetry *free = NULL;
+                for(uint8_t i = 0; i < USB_TELEMETRY_EPS; i++) {
+                        UsbEpTelemetry *t = theTelemetry[index] + i;
+                        if(t->inUse && t->epAddr == ep)
+                                return t;
+                        if(!t->inUse && !free)
+                                free = t;
+                }
+                if(!alloc || !free)
+                        return NULL;
+
+                free->inUse = 1;
+                free->epAddr = ep;
+                return free;
+        };
+
+        // Clears the counters of a device, the entries stay assigned
+
+        void ResetTelemetry(uint8_t addr) {
+                uint8_t index = (addr) ? FindAddressIndex(addr) : 0;
+
+                if(addr && !index)
+                        return;
+
+                for(uint8_t i = 0; i < USB_TELEMETRY_EPS; i++) {
+                        UsbEpTelemetry *t = theTelemetry[index] + i;
+                        uint8_t inUse = t->inUse, ep = t->epAddr;
+                        memset(t, 0, sizeof(UsbEpTelemetry));
+                        t->inUse = inUse;
+                        t->epAddr = ep;
+                }
+        };
+#endif
+
         // Returns number of hubs attached
         // It can be rather helpfull to find out if there are hubs attached than getting the exact number of hubs.
         //uint8_t GetNumHubs()
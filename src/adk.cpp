@@ -56,16 +56,12 @@ ready(false) {
         }
 }
 
+/* Reads the device descriptor at address 0 and gives the phone its address. USB::Task() calls */
+/* Init() once the phone has recovered from SET_ADDRESS.                                        */
 uint8_t ADK::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
-        return Init(parent, port, lowspeed); // Just call Init. Yes, really!
-}
-
-/* Connection initialization of an Android phone */
-uint8_t ADK::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         uint8_t buf[sizeof (USB_DEVICE_DESCRIPTOR)];
         USB_DEVICE_DESCRIPTOR * udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
         uint8_t rcode;
-        uint8_t num_of_conf; // number of configurations
         UsbDevice *p = NULL;
         EpInfo *oldep_ptr = NULL;
 
@@ -108,7 +104,11 @@ uint8_t ADK::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         p->epinfo = oldep_ptr;
 
         if(rcode) {
-                goto FailGetDevDescr;
+#ifdef DEBUG_USB_HOST
+                NotifyFailGetDevDescr(rcode);
+#endif
+                Release();
+                return rcode;
         }
 
         // Allocate new address according to device class
@@ -117,8 +117,8 @@ uint8_t ADK::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         // Extract Max Packet Size from device descriptor
         epInfo[0].maxPktSize = udd->bMaxPacketSize0;
 
-        // Assign new address to the device
-        rcode = pUsb->setAddr(0, 0, bAddress);
+        // Assign new address to the device, Init() is called after the recovery time
+        rcode = pUsb->setAddr(0, 0, bAddress, false);
         if(rcode) {
                 p->lowspeed = false;
                 addrPool.FreeAddress(bAddress);
@@ -128,8 +128,6 @@ uint8_t ADK::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         }//if (rcode...
 
         //USBTRACE2("\r\nAddr:", bAddress);
-        // Spec says you should wait at least 200ms.
-        //delay(300);
 
         p->lowspeed = false;
 
@@ -141,12 +139,28 @@ uint8_t ADK::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 
         p->lowspeed = lowspeed;
 
+        return 0;
+}
+
+/* Connection initialization of an Android phone */
+uint8_t ADK::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
+        uint8_t buf[sizeof (USB_DEVICE_DESCRIPTOR)];
+        USB_DEVICE_DESCRIPTOR * udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
+        uint8_t rcode;
+        uint8_t num_of_conf; // number of configurations
+
         // Assign epInfo to epinfo pointer - only EP0 is known
         rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo);
         if(rcode) {
                 goto FailSetDevTblEntry;
         }
 
+        // Device descriptor again, at the new address
+        rcode = pUsb->getDevDescr(bAddress, 0, sizeof (USB_DEVICE_DESCRIPTOR), (uint8_t*)buf);
+        if(rcode) {
+                goto FailGetDevDescr;
+        }
+
         //check if ADK device is already in accessory mode; if yes, configure and exit
         if(udd->idVendor == ADK_VID &&
                 (udd->idProduct == ADK_PID || udd->idProduct == ADB_PID)) {
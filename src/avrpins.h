@@ -1636,6 +1636,52 @@ MAKE_PIN(P17, 17); // INT
 #endif
 #define pgm_read_pointer(p) pgm_read_ptr(p)
 
+#elif defined(UHS_HOST_SIM) // Host build against the MAX3421E simulator, see extras/sim
+
+// Pointers are the native size, there is no separate program memory
+#ifdef pgm_read_pointer
+#undef pgm_read_pointer
+#endif
+#define pgm_read_pointer(p) (*(void * const *)(p))
+
+#define MAKE_PIN(className, pin) \
+class className { \
+public: \
+  static void Set() { \
+    digitalWrite(pin, HIGH);\
+  } \
+  static void Clear() { \
+    digitalWrite(pin, LOW); \
+  } \
+  static void SetDirRead() { \
+    pinMode(pin, INPUT); \
+  } \
+  static void SetDirWrite() { \
+    pinMode(pin, OUTPUT); \
+  } \
+  static uint8_t IsSet() { \
+    return digitalRead(pin); \
+  } \
+};
+
+MAKE_PIN(P0, 0);
+MAKE_PIN(P1, 1);
+MAKE_PIN(P2, 2);
+MAKE_PIN(P3, 3);
+MAKE_PIN(P4, 4);
+MAKE_PIN(P5, 5);
+MAKE_PIN(P6, 6);
+MAKE_PIN(P7, 7);
+MAKE_PIN(P8, 8);
+MAKE_PIN(P9, 9); // INT
+
+MAKE_PIN(P10, 10); // SS
+MAKE_PIN(P11, 11); // MOSI
+MAKE_PIN(P12, 12); // MISO
+MAKE_PIN(P13, 13); // SCK
+
+#undef MAKE_PIN
+
 #else
 #error "Please define board in avrpins.h"
 
@@ -22,94 +22,35 @@ ACM(p, pasync) {
         _enhanced_status = enhanced_features(); // Set up features
 }
 
-uint8_t XR21B1411::Init(uint8_t parent, uint8_t port, bool lowspeed) {
+/* ACM::ConfigureDevice() has given the device its address */
+uint8_t XR21B1411::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
         const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
 
         uint8_t buf[constBufSize];
         USB_DEVICE_DESCRIPTOR * udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
 
         uint8_t rcode;
-        UsbDevice *p = NULL;
-        EpInfo *oldep_ptr = NULL;
         uint8_t num_of_conf; // number of configurations
 
-        AddressPool &addrPool = pUsb->GetAddressPool();
-
         USBTRACE("XR Init\r\n");
 
-        if(bAddress)
-                return USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE;
-
-        // Get pointer to pseudo device with address 0 assigned
-        p = addrPool.GetUsbDevicePtr(0);
-
-        if(!p)
-                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
-
-        if(!p->epinfo) {
-                USBTRACE("epinfo\r\n");
-                return USB_ERROR_EPINFO_IS_NULL;
-        }
-
-        // Save old pointer to EP_RECORD of address 0
-        oldep_ptr = p->epinfo;
-
-        // Temporary assign new pointer to epInfo to p->epinfo in order to avoid toggle inconsistence
-        p->epinfo = epInfo;
-
-        p->lowspeed = lowspeed;
+        // Assign epInfo to epinfo pointer
+        rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo);
 
-        // Get device descriptor
-        rcode = pUsb->getDevDescr(0, 0, constBufSize, (uint8_t*)buf);
+        if(rcode)
+                goto FailSetDevTblEntry;
 
-        // Restore p->epinfo
-        p->epinfo = oldep_ptr;
+        // Device descriptor again, at the new address
+        rcode = pUsb->getDevDescr(bAddress, 0, constBufSize, (uint8_t*)buf);
 
         if(rcode)
                 goto FailGetDevDescr;
 
-        // Allocate new address according to device class
-        bAddress = addrPool.AllocAddress(parent, false, port);
-
-        if(!bAddress)
-                return USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL;
-
-        // Extract Max Packet Size from the device descriptor
-        epInfo[0].maxPktSize = udd->bMaxPacketSize0;
-
-        // Assign new address to the device
-        rcode = pUsb->setAddr(0, 0, bAddress);
-
-        if(rcode) {
-                p->lowspeed = false;
-                addrPool.FreeAddress(bAddress);
-                bAddress = 0;
-                USBTRACE2("setAddr:", rcode);
-                return rcode;
-        }
-
-        USBTRACE2("Addr:", bAddress);
-
-        p->lowspeed = false;
-
-        p = addrPool.GetUsbDevicePtr(bAddress);
-
-        if(!p)
-                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
-
-        p->lowspeed = lowspeed;
-
         num_of_conf = udd->bNumConfigurations;
 
         if((((udd->idVendor != 0x2890U) || (udd->idProduct != 0x0201U)) && ((udd->idVendor != 0x04e2U) || (udd->idProduct != 0x1411U))))
                 return USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
 
-        // Assign epInfo to epinfo pointer
-        rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo);
-
-        if(rcode)
-                goto FailSetDevTblEntry;
-
         USBTRACE2("NC:", num_of_conf);
 
         for(uint8_t i = 0; i < num_of_conf; i++) {
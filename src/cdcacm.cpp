@@ -43,7 +43,9 @@ ready(false) {
                 pUsb->RegisterDeviceClass(this);
 }
 
-uint8_t ACM::Init(uint8_t parent, uint8_t port, bool lowspeed) {
+/* Reads the device descriptor at address 0 and gives the device its address. USB::Task() calls */
+/* Init() once the device has recovered from SET_ADDRESS.                                        */
+uint8_t ACM::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
 
         const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
 
@@ -53,7 +55,6 @@ uint8_t ACM::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         uint8_t rcode;
         UsbDevice *p = NULL;
         EpInfo *oldep_ptr = NULL;
-        uint8_t num_of_conf; // number of configurations
 
         AddressPool &addrPool = pUsb->GetAddressPool();
 
@@ -87,8 +88,24 @@ uint8_t ACM::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         // Restore p->epinfo
         p->epinfo = oldep_ptr;
 
-        if(rcode)
-                goto FailGetDevDescr;
+        if(rcode) {
+#ifdef DEBUG_USB_HOST
+                NotifyFailGetDevDescr();
+                NotifyFail(rcode);
+#endif
+                Release();
+                return rcode;
+        }
+
+        return AssignAddress(parent, port, lowspeed, udd);
+}
+
+/* Gives the device the next free address, the descriptor is the one read at address 0. Init() is */
+/* called after the recovery time.                                                                */
+uint8_t ACM::AssignAddress(uint8_t parent, uint8_t port, bool lowspeed, const USB_DEVICE_DESCRIPTOR *udd) {
+        uint8_t rcode;
+        AddressPool &addrPool = pUsb->GetAddressPool();
+        UsbDevice *p = addrPool.GetUsbDevicePtr(0);
 
         // Allocate new address according to device class
         bAddress = addrPool.AllocAddress(parent, false, port);
@@ -100,7 +117,7 @@ uint8_t ACM::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         epInfo[0].maxPktSize = udd->bMaxPacketSize0;
 
         // Assign new address to the device
-        rcode = pUsb->setAddr(0, 0, bAddress);
+        rcode = pUsb->setAddr(0, 0, bAddress, false);
 
         if(rcode) {
                 p->lowspeed = false;
@@ -120,8 +137,18 @@ uint8_t ACM::Init(uint8_t parent, uint8_t port, bool lowspeed) {
                 return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
 
         p->lowspeed = lowspeed;
+        return 0;
+}
 
-        num_of_conf = udd->bNumConfigurations;
+uint8_t ACM::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
+
+        const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
+
+        uint8_t buf[constBufSize];
+        USB_DEVICE_DESCRIPTOR * udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
+
+        uint8_t rcode;
+        uint8_t num_of_conf; // number of configurations
 
         // Assign epInfo to epinfo pointer
         rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo);
@@ -129,6 +156,14 @@ uint8_t ACM::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         if(rcode)
                 goto FailSetDevTblEntry;
 
+        // Device descriptor again, at the new address
+        rcode = pUsb->getDevDescr(bAddress, 0, constBufSize, (uint8_t*)buf);
+
+        if(rcode)
+                goto FailGetDevDescr;
+
+        num_of_conf = udd->bNumConfigurations;
+
         USBTRACE2("NC:", num_of_conf);
 
         for(uint8_t i = 0; i < num_of_conf; i++) {
@@ -257,6 +292,7 @@ void ACM::EndpointXtract(uint8_t conf, uint8_t iface __attribute__((unused)), ui
 
 uint8_t ACM::Release() {
         ready = false;
+        CancelRcv();
         pUsb->GetAddressPool().FreeAddress(bAddress);
 
         bControlIface = 0;
@@ -285,6 +321,35 @@ uint8_t ACM::RcvData(uint16_t *bytes_rcvd, uint8_t *dataptr) {
         return rv;
 }
 
+uint8_t ACM::RcvDataAsync(uint16_t nbytes, uint8_t *dataptr) {
+        return pUsb->submitInTransfer(&rcvReq, bAddress, epInfo[epDataInIndex].epAddr, nbytes, dataptr, this);
+}
+
+bool ACM::CancelRcv() {
+        if(!pUsb->cancelTransfer(&rcvReq))
+                return false;
+
+        pAsync->OnDataRcvd(this, rcvReq.rcode, 0, rcvReq.data);
+        return true;
+}
+
+void ACM::XferDone(USBXferReq *req) {
+        uint8_t rv = req->rcode;
+
+        // The data IN endpoint does not wait for NAKs, so nothing there yet ends the turn; queue it again
+        if(rv == hrNAK && !req->count) {
+                rv = pUsb->submitInTransfer(req, bAddress, req->ep, req->nbytes, req->data, this);
+                if(!rv)
+                        return;
+        } else if(rv == hrNAK)
+                rv = 0; // the device had no more for now, what arrived is passed on
+
+        if(rv && rv != USB_ERROR_TRANSFER_ABORTED) {
+                Release();
+        }
+        pAsync->OnDataRcvd(this, rv, req->count, req->data);
+}
+
 uint8_t ACM::SndData(uint16_t nbytes, uint8_t *dataptr) {
         uint8_t rv = pUsb->outTransfer(bAddress, epInfo[epDataOutIndex].epAddr, nbytes, dataptr);
         if(rv && rv != hrNAK) {
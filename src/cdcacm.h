@@ -131,7 +131,9 @@ public:
         virtual uint8_t OnInit(ACM *pacm __attribute__((unused))) {
                 return 0;
         };
-        //virtual void OnDataRcvd(ACM *pacm, uint8_t nbytes, uint8_t *dataptr) = 0;
+        // Result of ACM::RcvDataAsync(), 'rcode' is USB_ERROR_TRANSFER_ABORTED after ACM::CancelRcv()
+        virtual void OnDataRcvd(ACM *pacm __attribute__((unused)), uint8_t rcode __attribute__((unused)), uint16_t nbytes __attribute__((unused)), uint8_t *dataptr __attribute__((unused))) {
+        };
         //virtual void OnDisconnected(ACM *pacm) = 0;
 };
 
@@ -160,7 +162,7 @@ typedef struct {
 
 #define ACM_MAX_ENDPOINTS               4
 
-class ACM : public USBDeviceConfig, public UsbConfigXtracter {
+class ACM : public USBDeviceConfig, public UsbConfigXtracter, public USBXferHandler {
 protected:
         USB *pUsb;
         CDCAsyncOper *pAsync;
@@ -173,8 +175,10 @@ protected:
         volatile bool bPollEnable; // poll enable flag
         volatile bool ready; //device ready indicator
         tty_features _enhanced_status; // current status
+        USBXferReq rcvReq; // bulk IN of RcvDataAsync()
 
         void PrintEndpointDescriptor(const USB_ENDPOINT_DESCRIPTOR* ep_ptr);
+        uint8_t AssignAddress(uint8_t parent, uint8_t port, bool lowspeed, const USB_DEVICE_DESCRIPTOR *udd);
 
 public:
         static const uint8_t epDataInIndex; // DataIn endpoint index
@@ -197,11 +201,21 @@ public:
         uint8_t RcvData(uint16_t *nbytesptr, uint8_t *dataptr);
         uint8_t SndData(uint16_t nbytes, uint8_t *dataptr);
 
+        /* Queues a bulk IN of up to 'nbytes' and returns, CDCAsyncOper::OnDataRcvd() is called from USB::Task() */
+        /* once data has arrived, the transfer failed or it was cancelled. Do not mix it with RcvData().          */
+        uint8_t RcvDataAsync(uint16_t nbytes, uint8_t *dataptr);
+        bool CancelRcv();
+
         // USBDeviceConfig implementation
+        uint8_t ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Release();
         uint8_t Poll();
 
+        uint32_t NextPollTime() {
+                return (uint32_t)millis() + USB_POLL_NEVER; // the sketch moves the data, Poll() has nothing to do
+        };
+
         bool available(void) {
                 return false;
         };
@@ -246,6 +260,9 @@ public:
 
         // UsbConfigXtracter implementation
         void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep);
+
+        // USBXferHandler implementation
+        void XferDone(USBXferReq *req);
 };
 
 #endif // __CDCACM_H__
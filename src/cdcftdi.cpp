@@ -38,7 +38,9 @@ wIdProduct(idProduct) {
                 pUsb->RegisterDeviceClass(this);
 }
 
-uint8_t FTDI::Init(uint8_t parent, uint8_t port, bool lowspeed) {
+/* Reads the device descriptor at address 0 and gives the device its address. USB::Task() calls */
+/* Init() once the device has recovered from SET_ADDRESS.                                        */
+uint8_t FTDI::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
         const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
 
         uint8_t buf[constBufSize];
@@ -47,8 +49,6 @@ uint8_t FTDI::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         UsbDevice *p = NULL;
         EpInfo *oldep_ptr = NULL;
 
-        uint8_t num_of_conf; // number of configurations
-
         AddressPool &addrPool = pUsb->GetAddressPool();
 
         USBTRACE("FTDI Init\r\n");
@@ -84,7 +84,12 @@ uint8_t FTDI::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         p->epinfo = oldep_ptr;
 
         if(rcode) {
-                goto FailGetDevDescr;
+#ifdef DEBUG_USB_HOST
+                NotifyFailGetDevDescr();
+                NotifyFail(rcode);
+#endif
+                Release();
+                return rcode;
         }
         if(udd->idVendor != FTDI_VID || udd->idProduct != wIdProduct) {
                 USBTRACE("FTDI Init: Product not supported\r\n");
@@ -111,8 +116,8 @@ uint8_t FTDI::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         // we should check them, and if zero, set them to 64.
         if(epInfo[0].maxPktSize == 0) epInfo[0].maxPktSize = 64;
 
-        // Assign new address to the device
-        rcode = pUsb->setAddr(0, 0, bAddress);
+        // Assign new address to the device, Init() is called after the recovery time
+        rcode = pUsb->setAddr(0, 0, bAddress, false);
 
         if(rcode) {
                 p->lowspeed = false;
@@ -133,7 +138,17 @@ uint8_t FTDI::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 
         p->lowspeed = lowspeed;
 
-        num_of_conf = udd->bNumConfigurations;
+        return 0;
+}
+
+uint8_t FTDI::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
+        const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
+
+        uint8_t buf[constBufSize];
+        USB_DEVICE_DESCRIPTOR * udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
+        uint8_t rcode;
+
+        uint8_t num_of_conf; // number of configurations
 
         // Assign epInfo to epinfo pointer
         rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo);
@@ -141,6 +156,14 @@ uint8_t FTDI::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         if(rcode)
                 goto FailSetDevTblEntry;
 
+        // Device descriptor again, at the new address
+        rcode = pUsb->getDevDescr(bAddress, 0, constBufSize, buf);
+
+        if(rcode)
+                goto FailGetDevDescr;
+
+        num_of_conf = udd->bNumConfigurations;
+
         USBTRACE2("NC:", num_of_conf);
 
         for(uint8_t i = 0; i < num_of_conf; i++) {
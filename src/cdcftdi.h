@@ -131,10 +131,15 @@ public:
         uint8_t SndData(uint16_t nbytes, uint8_t *dataptr);
 
         // USBDeviceConfig implementation
+        uint8_t ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Release();
         uint8_t Poll();
 
+        uint32_t NextPollTime() {
+                return (uint32_t)millis() + USB_POLL_NEVER; // the sketch moves the data, Poll() has nothing to do
+        };
+
         virtual uint8_t GetAddress() {
                 return bAddress;
         };
@@ -21,7 +21,9 @@ ACM(p, pasync),
 wPLType(0) {
 }
 
-uint8_t PL2303::Init(uint8_t parent, uint8_t port, bool lowspeed) {
+/* Reads the device descriptor at address 0 and gives the device its address. USB::Task() calls */
+/* Init() once the device has recovered from SET_ADDRESS.                                        */
+uint8_t PL2303::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
         const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
 
         uint8_t buf[constBufSize];
@@ -29,10 +31,6 @@ uint8_t PL2303::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         uint8_t rcode;
         UsbDevice *p = NULL;
         EpInfo *oldep_ptr = NULL;
-        uint8_t num_of_conf; // number of configurations
-#ifdef PL2303_COMPAT
-        enum pl2303_type pltype = unknown;
-#endif
 
         AddressPool &addrPool = pUsb->GetAddressPool();
 
@@ -66,12 +64,47 @@ uint8_t PL2303::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         // Restore p->epinfo
         p->epinfo = oldep_ptr;
 
-        if(rcode)
-                goto FailGetDevDescr;
+        if(rcode) {
+#ifdef DEBUG_USB_HOST
+                NotifyFailGetDevDescr();
+                NotifyFail(rcode);
+#endif
+                Release();
+                return rcode;
+        }
 
         if(udd->idVendor != PL_VID && CHECK_PID(udd->idProduct))
                 return USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
 
+        // Save type of PL chip
+        wPLType = udd->bcdDevice;
+
+        return AssignAddress(parent, port, lowspeed, udd);
+}
+
+uint8_t PL2303::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
+        const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
+
+        uint8_t buf[constBufSize];
+        USB_DEVICE_DESCRIPTOR * udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
+        uint8_t rcode;
+        uint8_t num_of_conf; // number of configurations
+#ifdef PL2303_COMPAT
+        enum pl2303_type pltype = unknown;
+#endif
+
+        // Assign epInfo to epinfo pointer
+        rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo);
+
+        if(rcode)
+                goto FailSetDevTblEntry;
+
+        // Device descriptor again, at the new address
+        rcode = pUsb->getDevDescr(bAddress, 0, constBufSize, (uint8_t*)buf);
+
+        if(rcode)
+                goto FailGetDevDescr;
+
         /* determine chip variant */
 #ifdef PL2303_COMPAT
         if(udd->bDeviceClass == 0x02 )
@@ -84,48 +117,8 @@ uint8_t PL2303::Init(uint8_t parent, uint8_t port, bool lowspeed) {
                 pltype = type_1;
 #endif
 
-        // Save type of PL chip
-        wPLType = udd->bcdDevice;
-
-        // Allocate new address according to device class
-        bAddress = addrPool.AllocAddress(parent, false, port);
-
-        if(!bAddress)
-                return USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL;
-
-        // Extract Max Packet Size from the device descriptor
-        epInfo[0].maxPktSize = udd->bMaxPacketSize0;
-
-        // Assign new address to the device
-        rcode = pUsb->setAddr(0, 0, bAddress);
-
-        if(rcode) {
-                p->lowspeed = false;
-                addrPool.FreeAddress(bAddress);
-                bAddress = 0;
-                USBTRACE2("setAddr:", rcode);
-                return rcode;
-        }
-
-        USBTRACE2("Addr:", bAddress);
-
-        p->lowspeed = false;
-
-        p = addrPool.GetUsbDevicePtr(bAddress);
-
-        if(!p)
-                return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
-
-        p->lowspeed = lowspeed;
-
         num_of_conf = udd->bNumConfigurations;
 
-        // Assign epInfo to epinfo pointer
-        rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo);
-
-        if(rcode)
-                goto FailSetDevTblEntry;
-
         USBTRACE2("NC:", num_of_conf);
 
         for(uint8_t i = 0; i < num_of_conf; i++) {
@@ -126,6 +126,7 @@ public:
         PL2303(USB *pusb, CDCAsyncOper *pasync);
 
         // USBDeviceConfig implementation
+        uint8_t ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
         //virtual uint8_t Release();
         //virtual uint8_t Poll();
@@ -61,9 +61,21 @@ class ConfigDescParser : public USBReadParser {
         uint8_t protoValue; // Protocol value
         uint8_t ifaceNumber; // Interface number
         uint8_t ifaceAltSet; // Interface alternate settings
+        uint8_t streamPos; // Bytes of the current header or descriptor body streamed so far
 
         bool UseOr;
         bool ParseDescriptor(uint8_t **pp, uint16_t *pcntdn);
+        void DescriptorParsed();
+
+        bool StreamKeep() {
+                switch(dscrType) {
+                        case USB_DESCRIPTOR_CONFIGURATION:
+                        case USB_DESCRIPTOR_INTERFACE:
+                        case USB_DESCRIPTOR_ENDPOINT:
+                                return (dscrLen > 2 && dscrLen <= sizeof (varBuffer));
+                }
+                return false;
+        };
         void PrintHidDescriptor(const USB_HID_DESCRIPTOR *pDesc);
 
 public:
@@ -73,6 +85,8 @@ public:
         }
         ConfigDescParser(UsbConfigXtracter *xtractor);
         void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset);
+        uint8_t* StreamBuffer(uint16_t *len);
+        void StreamDone(uint16_t len);
 };
 
 template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
@@ -81,6 +95,7 @@ theXtractor(xtractor),
 stateParseDescr(0),
 dscrLen(0),
 dscrType(0),
+streamPos(0),
 UseOr(false) {
         theBuffer.pValue = varBuffer;
         valParser.Initialize(&theBuffer);
@@ -97,12 +112,53 @@ void ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::Parse(const uin
                         return;
 }
 
+/* Streaming, see USBReadParser. The length and type of each descriptor go to the start of varBuffer, the */
+/* configuration, interface and endpoint descriptors follow them there, every other descriptor is skipped */
+template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
+uint8_t* ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::StreamBuffer(uint16_t *len) {
+        uint16_t n;
+        uint8_t *dst;
+
+        if(stateParseDescr == 0) {
+                n = 2 - streamPos;
+                dst = varBuffer + streamPos;
+        } else {
+                n = dscrLen - 2 - streamPos;
+                dst = (StreamKeep()) ? varBuffer + 2 + streamPos : NULL;
+        }
+        if(*len > n)
+                *len = n;
+        return dst;
+}
+
+template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
+void ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::StreamDone(uint16_t len) {
+        streamPos += len;
+
+        if(stateParseDescr == 0) {
+                if(streamPos < 2)
+                        return;
+                dscrLen = varBuffer[0];
+                dscrType = varBuffer[1];
+                if(dscrLen < 2)
+                        dscrLen = 2; // broken descriptor, step over its header and carry on
+                if(dscrType == USB_DESCRIPTOR_INTERFACE)
+                        isGoodInterface = false;
+                streamPos = 0;
+                stateParseDescr = 4;
+        }
+        if(streamPos < dscrLen - 2)
+                return;
+        if(StreamKeep())
+                DescriptorParsed();
+        streamPos = 0;
+        stateParseDescr = 0;
+}
+
 /* Parser for the configuration descriptor. Takes values for class, subclass, protocol fields in interface descriptor and
   compare masks for them. When the match is found, calls EndpointXtract passing buffer containing endpoint descriptor */
 template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
 bool ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::ParseDescriptor(uint8_t **pp, uint16_t *pcntdn) {
-        USB_CONFIGURATION_DESCRIPTOR* ucd = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR*>(varBuffer);
-        USB_INTERFACE_DESCRIPTOR* uid = reinterpret_cast<USB_INTERFACE_DESCRIPTOR*>(varBuffer);
         switch(stateParseDescr) {
                 case 0:
                         theBuffer.valueSize = 2;
@@ -142,35 +198,11 @@ bool ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::ParseDescriptor
                 case 4:
                         switch(dscrType) {
                                 case USB_DESCRIPTOR_CONFIGURATION:
-                                        if(!valParser.Parse(pp, pcntdn))
-                                                return false;
-                                        confValue = ucd->bConfigurationValue;
-                                        break;
                                 case USB_DESCRIPTOR_INTERFACE:
-                                        if(!valParser.Parse(pp, pcntdn))
-                                                return false;
-                                        if((MASK & CP_MASK_COMPARE_CLASS) && uid->bInterfaceClass != CLASS_ID)
-                                                break;
-                                        if((MASK & CP_MASK_COMPARE_SUBCLASS) && uid->bInterfaceSubClass != SUBCLASS_ID)
-                                                break;
-                                        if(UseOr) {
-                                                if((!((MASK & CP_MASK_COMPARE_PROTOCOL) && uid->bInterfaceProtocol)))
-                                                        break;
-                                        } else {
-                                                if((MASK & CP_MASK_COMPARE_PROTOCOL) && uid->bInterfaceProtocol != PROTOCOL_ID)
-                                                        break;
-                                        }
-                                        isGoodInterface = true;
-                                        ifaceNumber = uid->bInterfaceNumber;
-                                        ifaceAltSet = uid->bAlternateSetting;
-                                        protoValue = uid->bInterfaceProtocol;
-                                        break;
                                 case USB_DESCRIPTOR_ENDPOINT:
                                         if(!valParser.Parse(pp, pcntdn))
                                                 return false;
-                                        if(isGoodInterface)
-                                                if(theXtractor)
-                                                        theXtractor->EndpointXtract(confValue, ifaceNumber, ifaceAltSet, protoValue, (USB_ENDPOINT_DESCRIPTOR*)varBuffer);
+                                        DescriptorParsed();
                                         break;
                                         //case HID_DESCRIPTOR_HID:
                                         //      if (!valParser.Parse(pp, pcntdn))
@@ -187,6 +219,41 @@ bool ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::ParseDescriptor
         return true;
 }
 
+/* A configuration, interface or endpoint descriptor is complete in varBuffer */
+template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
+void ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::DescriptorParsed() {
+        USB_CONFIGURATION_DESCRIPTOR* ucd = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR*>(varBuffer);
+        USB_INTERFACE_DESCRIPTOR* uid = reinterpret_cast<USB_INTERFACE_DESCRIPTOR*>(varBuffer);
+
+        switch(dscrType) {
+                case USB_DESCRIPTOR_CONFIGURATION:
+                        confValue = ucd->bConfigurationValue;
+                        break;
+                case USB_DESCRIPTOR_INTERFACE:
+                        if((MASK & CP_MASK_COMPARE_CLASS) && uid->bInterfaceClass != CLASS_ID)
+                                break;
+                        if((MASK & CP_MASK_COMPARE_SUBCLASS) && uid->bInterfaceSubClass != SUBCLASS_ID)
+                                break;
+                        if(UseOr) {
+                                if((!((MASK & CP_MASK_COMPARE_PROTOCOL) && uid->bInterfaceProtocol)))
+                                        break;
+                        } else {
+                                if((MASK & CP_MASK_COMPARE_PROTOCOL) && uid->bInterfaceProtocol != PROTOCOL_ID)
+                                        break;
+                        }
+                        isGoodInterface = true;
+                        ifaceNumber = uid->bInterfaceNumber;
+                        ifaceAltSet = uid->bAlternateSetting;
+                        protoValue = uid->bInterfaceProtocol;
+                        break;
+                case USB_DESCRIPTOR_ENDPOINT:
+                        if(isGoodInterface)
+                                if(theXtractor)
+                                        theXtractor->EndpointXtract(confValue, ifaceNumber, ifaceAltSet, protoValue, (USB_ENDPOINT_DESCRIPTOR*)varBuffer);
+                        break;
+        }
+}
+
 template <const uint8_t CLASS_ID, const uint8_t SUBCLASS_ID, const uint8_t PROTOCOL_ID, const uint8_t MASK>
 void ConfigDescParser<CLASS_ID, SUBCLASS_ID, PROTOCOL_ID, MASK>::PrintHidDescriptor(const USB_HID_DESCRIPTOR *pDesc) {
         Notify(PSTR("\r\n\r\nHID Descriptor:\r\n"), 0x80);
@@ -198,7 +198,7 @@ protected:
 };
 
 template <const uint8_t BOOT_PROTOCOL>
-class HIDBoot : public USBHID //public USBDeviceConfig, public UsbConfigXtracter
+class HIDBoot : public USBHID, public USBXferHandler //public USBDeviceConfig, public UsbConfigXtracter
 {
         EpInfo epInfo[totalEndpoints(BOOT_PROTOCOL)];
         HIDReportParser *pRptParser[epMUL(BOOT_PROTOCOL)];
@@ -211,8 +211,18 @@ class HIDBoot : public USBHID //public USBDeviceConfig, public UsbConfigXtracter
         bool bPollEnable; // poll enable flag
         uint8_t bInterval; // largest interval
         bool bRptProtoEnable; // Report Protocol enable flag
+        uint8_t bInitState; // Init() step still to do, 0 if none
+        uint8_t bInitLeds; // LED pattern of the keyboard wake up
+
+        static const uint16_t constBuffLen = 64; // report buffer length
+        USBXferReq rptReq; // interrupt IN of the endpoint being read
+        uint8_t rptIndex; // endpoint of rptReq, 0 to epMUL(BOOT_PROTOCOL) - 1
+        uint8_t rptBuf[constBuffLen]; // report read by rptReq
 
         void Initialize();
+        uint8_t InitNext();
+        uint8_t InitFail(uint8_t rcode);
+        uint8_t SubmitRpt(uint8_t i);
 
         virtual HIDReportParser* GetReportParser(uint8_t id) {
                 return pRptParser[id];
@@ -227,10 +237,15 @@ public:
         };
 
         // USBDeviceConfig implementation
+        uint8_t ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Release();
         uint8_t Poll();
 
+        uint32_t NextPollTime() {
+                return qNextPollTime;
+        };
+
         virtual uint8_t GetAddress() {
                 return bAddress;
         };
@@ -239,6 +254,9 @@ public:
                 return bPollEnable;
         };
 
+        // USBXferHandler implementation
+        void XferDone(USBXferReq *req);
+
         // UsbConfigXtracter implementation
         // Method should be defined here if virtual.
         virtual void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep);
@@ -257,7 +275,9 @@ HIDBoot<BOOT_PROTOCOL>::HIDBoot(USB *p, bool bRptProtoEnable/* = false*/) :
 USBHID(p),
 qNextPollTime(0),
 bPollEnable(false),
-bRptProtoEnable(bRptProtoEnable) {
+bRptProtoEnable(bRptProtoEnable),
+bInitState(0),
+rptIndex(0) {
         Initialize();
 
         for(int i = 0; i < epMUL(BOOT_PROTOCOL); i++) {
@@ -281,20 +301,15 @@ void HIDBoot<BOOT_PROTOCOL>::Initialize() {
         bConfNum = 0;
 }
 
+/* Reads the device descriptor at address 0 and gives the device its address. USB::Task() calls */
+/* Init() once the device has recovered from SET_ADDRESS.                                        */
 template <const uint8_t BOOT_PROTOCOL>
-uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed) {
-        const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
-
-        uint8_t buf[constBufSize];
-        USB_DEVICE_DESCRIPTOR* device;
+uint8_t HIDBoot<BOOT_PROTOCOL>::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
+        uint8_t buf[8];
+        USB_DEVICE_DESCRIPTOR* device = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
         uint8_t rcode;
         UsbDevice *p = NULL;
         EpInfo *oldep_ptr = NULL;
-        uint8_t len = 0;
-        //uint16_t cd_len = 0;
-
-        uint8_t num_of_conf; // number of configurations
-        //uint8_t num_of_intf; // number of interfaces
 
         AddressPool &addrPool = pUsb->GetAddressPool();
 
@@ -305,7 +320,6 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
         if(bAddress)
                 return USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE;
 
-        bInterval = 0;
         // Get pointer to pseudo device with address 0 assigned
         p = addrPool.GetUsbDevicePtr(0);
 
@@ -328,21 +342,16 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
         // Get device descriptor
         rcode = pUsb->getDevDescr(0, 0, 8, (uint8_t*)buf);
 
-        if(!rcode)
-                len = (buf[0] > constBufSize) ? constBufSize : buf[0];
-
-        device = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
+        // Restore p->epinfo
+        p->epinfo = oldep_ptr;
 
         if(rcode) {
-                // Restore p->epinfo
-                p->epinfo = oldep_ptr;
-
-                goto FailGetDevDescr;
+#ifdef DEBUG_USB_HOST
+                NotifyFailGetDevDescr();
+#endif
+                return InitFail(rcode);
         }
 
-        // Restore p->epinfo
-        p->epinfo = oldep_ptr;
-
         // Allocate new address according to device class
         bAddress = addrPool.AllocAddress(parent, false, port);
 
@@ -352,8 +361,8 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
         // Extract Max Packet Size from the device descriptor
         epInfo[0].maxPktSize = (uint8_t)(device->bMaxPacketSize0);
 
-        // Assign new address to the device
-        rcode = pUsb->setAddr(0, 0, bAddress);
+        // Assign new address to the device, Init() is called after the recovery time
+        rcode = pUsb->setAddr(0, 0, bAddress, false);
 
         if(rcode) {
                 p->lowspeed = false;
@@ -362,7 +371,6 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
                 USBTRACE2("setAddr:", rcode);
                 return rcode;
         }
-        //delay(2); //per USB 2.0 sect.9.2.6.3
 
         USBTRACE2("Addr:", bAddress);
 
@@ -374,9 +382,27 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
                 return USB_ERROR_ADDRESS_NOT_FOUND_IN_POOL;
 
         p->lowspeed = lowspeed;
+        return 0;
+}
+
+template <const uint8_t BOOT_PROTOCOL>
+uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
+        const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
+
+        uint8_t buf[constBufSize];
+        USB_DEVICE_DESCRIPTOR* device = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
+        uint8_t rcode;
+        //uint16_t cd_len = 0;
+
+        uint8_t num_of_conf; // number of configurations
+        //uint8_t num_of_intf; // number of interfaces
+
+        if(bInitState)
+                return InitNext();
 
-        if(len)
-                rcode = pUsb->getDevDescr(bAddress, 0, len, (uint8_t*)buf);
+        bInterval = 0;
+
+        rcode = pUsb->getDevDescr(bAddress, 0, constBufSize, (uint8_t*)buf);
 
         if(rcode)
                 goto FailGetDevDescr;
@@ -445,51 +471,10 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Init(uint8_t parent, uint8_t port, bool lowspeed
         //USBTRACE2("setEpInfoEntry returned ", rcode);
         USBTRACE2("Cnf:", bConfNum);
 
-        delay(1000);
-
-        // Set Configuration Value
-        rcode = pUsb->setConf(bAddress, 0, bConfNum);
-
-        if(rcode)
-                goto FailSetConfDescr;
-
-        delay(1000);
-
-        USBTRACE2("bIfaceNum:", bIfaceNum);
-        USBTRACE2("bNumIface:", bNumIface);
-
-        // Yes, mouse wants SetProtocol and SetIdle too!
-        for(uint8_t i = 0; i < epMUL(BOOT_PROTOCOL); i++) {
-                USBTRACE2("\r\nInterface:", i);
-                rcode = SetProtocol(i, bRptProtoEnable ? HID_RPT_PROTOCOL : USB_HID_BOOT_PROTOCOL);
-                if(rcode) goto FailSetProtocol;
-                USBTRACE2("PROTOCOL SET HID_BOOT rcode:", rcode);
-                rcode = SetIdle(i, 0, 0);
-                USBTRACE2("SET_IDLE rcode:", rcode);
-                // if(rcode) goto FailSetIdle; This can fail.
-                // Get the RPIPE and just throw it away.
-                SinkParser<USBReadParser, uint16_t, uint16_t> sink;
-                rcode = GetReportDescr(i, &sink);
-                USBTRACE2("RPIPE rcode:", rcode);
-        }
-
-        // Get RPIPE and throw it away.
-
-        if(BOOT_PROTOCOL & USB_HID_PROTOCOL_KEYBOARD) {
-                // Wake keyboard interface by twinkling up to 5 LEDs that are in the spec.
-                // kana, compose, scroll, caps, num
-                rcode = 0x20; // Reuse rcode.
-                while(rcode) {
-                        rcode >>= 1;
-                        // Ignore any error returned, we don't care if LED is not supported
-                        SetReport(0, 0, 2, 0, 1, &rcode); // Eventually becomes zero (All off)
-                        delay(25);
-                }
-        }
-        USBTRACE("BM configured\r\n");
-
-        bPollEnable = true;
-        return 0;
+        // The device wants time before and after SET_CONFIGURATION, InitNext() does the rest
+        bInitState = 1;
+        qNextPollTime = (uint32_t)millis() + 1000;
+        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
 
 FailGetDevDescr:
 #ifdef DEBUG_USB_HOST
@@ -509,24 +494,90 @@ FailGetDevDescr:
         //        goto Fail;
         //#endif
 
+Fail:
+        return InitFail(rcode);
+}
+
+/* Rest of Init(), one step per call. USB::Task() calls Init() again while it returns INIT_INCOMPLETE */
+template <const uint8_t BOOT_PROTOCOL>
+uint8_t HIDBoot<BOOT_PROTOCOL>::InitNext() {
+        uint8_t rcode;
+
+        if((int32_t)((uint32_t)millis() - qNextPollTime) < 0L)
+                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+
+        switch(bInitState) {
+                case 1:
+                        // Set Configuration Value
+                        rcode = pUsb->setConf(bAddress, 0, bConfNum);
+
+                        if(rcode)
+                                goto FailSetConfDescr;
+
+                        bInitState = 2;
+                        qNextPollTime = (uint32_t)millis() + 1000;
+                        return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+                case 2:
+                        USBTRACE2("bIfaceNum:", bIfaceNum);
+                        USBTRACE2("bNumIface:", bNumIface);
+
+                        // Yes, mouse wants SetProtocol and SetIdle too!
+                        for(uint8_t i = 0; i < epMUL(BOOT_PROTOCOL); i++) {
+                                USBTRACE2("\r\nInterface:", i);
+                                rcode = SetProtocol(i, bRptProtoEnable ? HID_RPT_PROTOCOL : USB_HID_BOOT_PROTOCOL);
+                                if(rcode) goto FailSetProtocol;
+                                USBTRACE2("PROTOCOL SET HID_BOOT rcode:", rcode);
+                                rcode = SetIdle(i, 0, 0);
+                                USBTRACE2("SET_IDLE rcode:", rcode);
+                                // if(rcode) goto FailSetIdle; This can fail.
+                                // Get the RPIPE and just throw it away.
+                                SinkParser<USBReadParser, uint16_t, uint16_t> sink;
+                                rcode = GetReportDescr(i, &sink);
+                                USBTRACE2("RPIPE rcode:", rcode);
+                        }
+
+                        // Wake keyboard interface by twinkling up to 5 LEDs that are in the spec.
+                        // kana, compose, scroll, caps, num
+                        bInitLeds = (BOOT_PROTOCOL & USB_HID_PROTOCOL_KEYBOARD) ? 0x20 : 0;
+                        bInitState = 3;
+                        // fall through
+                case 3:
+                        if(bInitLeds) {
+                                bInitLeds >>= 1;
+                                // Ignore any error returned, we don't care if LED is not supported
+                                SetReport(0, 0, 2, 0, 1, &bInitLeds); // Eventually becomes zero (All off)
+                                qNextPollTime = (uint32_t)millis() + 25;
+                                return USB_DEV_CONFIG_ERROR_DEVICE_INIT_INCOMPLETE;
+                        }
+                        break;
+        }
+        USBTRACE("BM configured\r\n");
+
+        bInitState = 0;
+        bPollEnable = true;
+        return 0;
+
 FailSetConfDescr:
 #ifdef DEBUG_USB_HOST
         NotifyFailSetConfDescr();
-        goto Fail;
 #endif
+        return InitFail(rcode);
 
 FailSetProtocol:
 #ifdef DEBUG_USB_HOST
         USBTRACE("SetProto:");
-        goto Fail;
 #endif
+        return InitFail(rcode);
 
         //FailSetIdle:
         //#ifdef DEBUG_USB_HOST
         //        USBTRACE("SetIdle:");
         //#endif
+}
 
-Fail:
+/* End of ConfigureDevice(), Init() and InitNext() when something failed */
+template <const uint8_t BOOT_PROTOCOL>
+uint8_t HIDBoot<BOOT_PROTOCOL>::InitFail(uint8_t rcode) {
 #ifdef DEBUG_USB_HOST
         NotifyFail(rcode);
 #endif
@@ -562,6 +613,7 @@ void HIDBoot<BOOT_PROTOCOL>::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t
 
 template <const uint8_t BOOT_PROTOCOL>
 uint8_t HIDBoot<BOOT_PROTOCOL>::Release() {
+        pUsb->cancelTransfer(&rptReq);
         pUsb->GetAddressPool().FreeAddress(bAddress);
 
         bConfNum = 0;
@@ -570,62 +622,81 @@ uint8_t HIDBoot<BOOT_PROTOCOL>::Release() {
         bAddress = 0;
         qNextPollTime = 0;
         bPollEnable = false;
+        bInitState = 0;
 
         return 0;
 }
 
+/* The interrupt IN endpoints are read with a queued request of the interrupt class, one after the other, */
+/* so the reports go ahead of the control and bulk transfers in USB::Task(). A round that is still going  */
+/* when the next poll is due is left to finish.                                                            */
 template <const uint8_t BOOT_PROTOCOL>
 uint8_t HIDBoot<BOOT_PROTOCOL>::Poll() {
-        uint8_t rcode = 0;
-
         if(bPollEnable && ((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L)) {
+                qNextPollTime = (uint32_t)millis() + bInterval;
+                SubmitRpt(0);
+        }
+        return 0;
+}
 
-                // To-do: optimize manually, using the for loop only if needed.
-                for(int i = 0; i < epMUL(BOOT_PROTOCOL); i++) {
-                        const uint16_t const_buff_len = 64;
+template <const uint8_t BOOT_PROTOCOL>
+uint8_t HIDBoot<BOOT_PROTOCOL>::SubmitRpt(uint8_t i) {
+        if(i >= epMUL(BOOT_PROTOCOL))
+                return 0;
 
-                        USBTRACE3("(hidboot.h) i=", i, 0x81);
-                        USBTRACE3("(hidboot.h) epInfo[epInterruptInIndex + i].epAddr=", epInfo[epInterruptInIndex + i].epAddr, 0x81);
-                        USBTRACE3("(hidboot.h) epInfo[epInterruptInIndex + i].maxPktSize=", epInfo[epInterruptInIndex + i].maxPktSize, 0x81);
-                        uint16_t read = (uint16_t)epInfo[epInterruptInIndex + i].maxPktSize;
+        USBTRACE3("(hidboot.h) i=", i, 0x81);
+        USBTRACE3("(hidboot.h) epInfo[epInterruptInIndex + i].epAddr=", epInfo[epInterruptInIndex + i].epAddr, 0x81);
+        USBTRACE3("(hidboot.h) epInfo[epInterruptInIndex + i].maxPktSize=", epInfo[epInterruptInIndex + i].maxPktSize, 0x81);
+        uint16_t read = (uint16_t)epInfo[epInterruptInIndex + i].maxPktSize;
 
-                        if (read > const_buff_len)
-                            read = const_buff_len;
+        if (read > constBuffLen)
+            read = constBuffLen;
 
-                        uint8_t buf[read];
+        uint8_t rcode = pUsb->submitInTransfer(&rptReq, bAddress, epInfo[epInterruptInIndex + i].epAddr, read, rptBuf, this, USB_XFER_CLASS_INTR);
 
-                        rcode = pUsb->inTransfer(bAddress, epInfo[epInterruptInIndex + i].epAddr, &read, buf);
-                        // SOME buggy dongles report extra keys (like sleep) using a 2 byte packet on the wrong endpoint.
-                        // Since keyboard and mice must report at least 3 bytes, we ignore the extra data.
-                        if(!rcode && read > 2) {
-                                if(pRptParser[i])
-                                        pRptParser[i]->Parse((USBHID*)this, 0, (uint8_t)read, buf);
-#ifdef DEBUG_USB_HOST
-                                // We really don't care about errors and anomalies unless we are debugging.
-                        } else {
-                                if(rcode != hrNAK) {
-                                        USBTRACE3("(hidboot.h) Poll:", rcode, 0x81);
-                                }
-                                if(!rcode && read) {
-                                        USBTRACE3("(hidboot.h) Strange read count: ", read, 0x80);
-                                        USBTRACE3("(hidboot.h) Interface:", i, 0x80);
-                                }
-                        }
+        if(!rcode)
+                rptIndex = i;
+        return rcode;
+}
 
-                        if(!rcode && read && (UsbDEBUGlvl > 0x7f)) {
-                                for(uint8_t i = 0; i < read; i++) {
-                                        PrintHex<uint8_t > (buf[i], 0x80);
-                                        USBTRACE1(" ", 0x80);
-                                }
-                                if(read)
-                                        USBTRACE1("\r\n", 0x80);
-#endif
-                        }
+template <const uint8_t BOOT_PROTOCOL>
+void HIDBoot<BOOT_PROTOCOL>::XferDone(USBXferReq *req) {
+        uint8_t rcode = req->rcode;
+        uint16_t read = req->count;
+        uint8_t i = rptIndex;
 
+        if(rcode == USB_ERROR_TRANSFER_ABORTED)
+                return;
+
+        // SOME buggy dongles report extra keys (like sleep) using a 2 byte packet on the wrong endpoint.
+        // Since keyboard and mice must report at least 3 bytes, we ignore the extra data.
+        if(!rcode && read > 2) {
+                if(pRptParser[i])
+                        pRptParser[i]->Parse((USBHID*)this, 0, (uint8_t)read, rptBuf);
+#ifdef DEBUG_USB_HOST
+                // We really don't care about errors and anomalies unless we are debugging.
+        } else {
+                if(rcode != hrNAK) {
+                        USBTRACE3("(hidboot.h) Poll:", rcode, 0x81);
+                }
+                if(!rcode && read) {
+                        USBTRACE3("(hidboot.h) Strange read count: ", read, 0x80);
+                        USBTRACE3("(hidboot.h) Interface:", i, 0x80);
                 }
-                qNextPollTime = (uint32_t)millis() + bInterval;
         }
-        return rcode;
+
+        if(!rcode && read && (UsbDEBUGlvl > 0x7f)) {
+                for(uint8_t i = 0; i < read; i++) {
+                        PrintHex<uint8_t > (rptBuf[i], 0x80);
+                        USBTRACE1(" ", 0x80);
+                }
+                if(read)
+                        USBTRACE1("\r\n", 0x80);
+#endif
+        }
+
+        if(bPollEnable)
+                SubmitRpt(i + 1);
 }
 
 #endif // __HIDBOOTMOUSE_H__
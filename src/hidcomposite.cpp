@@ -22,6 +22,8 @@ USBHID(p),
 qNextPollTime(0),
 pollInterval(0),
 bPollEnable(false),
+bPollScheduled(false),
+rptIface(0),
 bHasReportId(false) {
         Initialize();
 
@@ -91,7 +93,9 @@ HIDReportParser* HIDComposite::GetReportParser(uint8_t id) {
         return NULL;
 }
 
-uint8_t HIDComposite::Init(uint8_t parent, uint8_t port, bool lowspeed) {
+/* Reads the device descriptor at address 0 and gives the device its address. USB::Task() calls */
+/* Init() once the device has recovered from SET_ADDRESS.                                        */
+uint8_t HIDComposite::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
         const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
 
         uint8_t buf[constBufSize];
@@ -99,10 +103,6 @@ uint8_t HIDComposite::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         uint8_t rcode;
         UsbDevice *p = NULL;
         EpInfo *oldep_ptr = NULL;
-        uint8_t len = 0;
-
-        uint8_t num_of_conf; // number of configurations
-        //uint8_t num_of_intf; // number of interfaces
 
         AddressPool &addrPool = pUsb->GetAddressPool();
 
@@ -133,14 +133,16 @@ uint8_t HIDComposite::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         // Get device descriptor
         rcode = pUsb->getDevDescr(0, 0, 8, (uint8_t*)buf);
 
-        if(!rcode)
-                len = (buf[0] > constBufSize) ? constBufSize : buf[0];
-
         if(rcode) {
                 // Restore p->epinfo
                 p->epinfo = oldep_ptr;
 
-                goto FailGetDevDescr;
+#ifdef DEBUG_USB_HOST
+                NotifyFailGetDevDescr();
+                NotifyFail(rcode);
+#endif
+                Release();
+                return rcode;
         }
 
         // Restore p->epinfo
@@ -155,8 +157,8 @@ uint8_t HIDComposite::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         // Extract Max Packet Size from the device descriptor
         epInfo[0].maxPktSize = udd->bMaxPacketSize0;
 
-        // Assign new address to the device
-        rcode = pUsb->setAddr(0, 0, bAddress);
+        // Assign new address to the device, Init() is called after the recovery time
+        rcode = pUsb->setAddr(0, 0, bAddress, false);
 
         if(rcode) {
                 p->lowspeed = false;
@@ -179,16 +181,18 @@ uint8_t HIDComposite::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 
         p->lowspeed = lowspeed;
 
-        if(len)
-                rcode = pUsb->getDevDescr(bAddress, 0, len, (uint8_t*)buf);
+        return 0;
+}
 
-        if(rcode)
-                goto FailGetDevDescr;
+uint8_t HIDComposite::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
+        const uint8_t constBufSize = sizeof (USB_DEVICE_DESCRIPTOR);
 
-        VID = udd->idVendor; // Can be used by classes that inherits this class to check the VID and PID of the connected device
-        PID = udd->idProduct;
+        uint8_t buf[constBufSize];
+        USB_DEVICE_DESCRIPTOR * udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
+        uint8_t rcode;
 
-        num_of_conf = udd->bNumConfigurations;
+        uint8_t num_of_conf; // number of configurations
+        //uint8_t num_of_intf; // number of interfaces
 
         // Assign epInfo to epinfo pointer
         rcode = pUsb->setEpInfoEntry(bAddress, 1, epInfo);
@@ -196,6 +200,17 @@ uint8_t HIDComposite::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         if(rcode)
                 goto FailSetDevTblEntry;
 
+        // Device descriptor again, at the new address
+        rcode = pUsb->getDevDescr(bAddress, 0, constBufSize, (uint8_t*)buf);
+
+        if(rcode)
+                goto FailGetDevDescr;
+
+        VID = udd->idVendor; // Can be used by classes that inherits this class to check the VID and PID of the connected device
+        PID = udd->idProduct;
+
+        num_of_conf = udd->bNumConfigurations;
+
         USBTRACE2("NC:", num_of_conf);
 
         for(uint8_t i = 0; i < num_of_conf; i++) {
@@ -246,6 +261,7 @@ uint8_t HIDComposite::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         OnInitSuccessful();
 
         bPollEnable = true;
+        bPollScheduled = !pUsb->RegisterPeriodic(this, pollInterval);
         return 0;
 
 FailGetDevDescr:
@@ -352,12 +368,15 @@ void HIDComposite::EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint
 }
 
 uint8_t HIDComposite::Release() {
+        pUsb->UnregisterPeriodic(this);
+        pUsb->cancelTransfer(&rptReq);
         pUsb->GetAddressPool().FreeAddress(bAddress);
 
         bNumEP = 1;
         bAddress = 0;
         qNextPollTime = 0;
         bPollEnable = false;
+        bPollScheduled = false;
         return 0;
 }
 
@@ -366,61 +385,74 @@ void HIDComposite::ZeroMemory(uint8_t len, uint8_t *buf) {
                 buf[i] = 0;
 }
 
+/* The interrupt IN endpoints are read with a queued request of the interrupt class, one interface after   */
+/* the other, so a NAKing or slow device does not hold up USB::Task(). A round that is still going when the */
+/* next poll is due is left to finish.                                                                      */
 uint8_t HIDComposite::Poll() {
-        uint8_t rcode = 0;
-
         if(!bPollEnable)
                 return 0;
 
-        if((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L) {
+        if(bPollScheduled || (int32_t)((uint32_t)millis() - qNextPollTime) >= 0L) {
                 qNextPollTime = (uint32_t)millis() + pollInterval;
+                SubmitRpt(0);
+        }
+        return 0;
+}
 
-                uint8_t buf[constBuffLen];
+// Queues the read of the first interface from 'iface' on that has an interrupt IN endpoint
+uint8_t HIDComposite::SubmitRpt(uint8_t iface) {
+        for(; iface < bNumIface; iface++) {
+                uint8_t index = hidInterfaces[iface].epIndex[epInterruptInIndex];
 
-                for(uint8_t i = 0; i < bNumIface; i++) {
-                        uint8_t index = hidInterfaces[i].epIndex[epInterruptInIndex];
+                if(index == 0)
+                        continue;
 
-                        if (index == 0)
-                            continue;
+                uint16_t read = (uint16_t)epInfo[index].maxPktSize;
 
-                        uint16_t read = (uint16_t)epInfo[index].maxPktSize;
+                if(read > constBuffLen)
+                        read = constBuffLen;
 
-                        ZeroMemory(constBuffLen, buf);
+                ZeroMemory(constBuffLen, rptBuf);
 
-                        uint8_t rcode = pUsb->inTransfer(bAddress, epInfo[index].epAddr, &read, buf);
+                uint8_t rcode = pUsb->submitInTransfer(&rptReq, bAddress, epInfo[index].epAddr, read, rptBuf, this, USB_XFER_CLASS_INTR);
 
-                        if(rcode) {
-                                if(rcode != hrNAK)
-                                        USBTRACE3("(hidcomposite.h) Poll:", rcode, 0x81);
-                                continue;
-                        }
+                if(!rcode)
+                        rptIface = iface;
+                return rcode;
+        }
+        return 0;
+}
 
-                        if(read == 0)
-                            continue;
+void HIDComposite::XferDone(USBXferReq *req) {
+        uint8_t read = (uint8_t)req->count;
 
-                        if(read > constBuffLen)
-                                read = constBuffLen;
+        if(req->rcode) {
+                if(req->rcode != hrNAK && req->rcode != USB_ERROR_TRANSFER_ABORTED)
+                        USBTRACE3("(hidcomposite.h) Poll:", req->rcode, 0x81);
+                read = 0;
+        }
 
+        if(read) {
 #if 0
-                        Notify(PSTR("\r\nBuf: "), 0x80);
+                Notify(PSTR("\r\nBuf: "), 0x80);
 
-                        for(uint8_t i = 0; i < read; i++) {
-                                D_PrintHex<uint8_t > (buf[i], 0x80);
-                                Notify(PSTR(" "), 0x80);
-                        }
+                for(uint8_t i = 0; i < read; i++) {
+                        D_PrintHex<uint8_t > (rptBuf[i], 0x80);
+                        Notify(PSTR(" "), 0x80);
+                }
 
-                        Notify(PSTR("\r\n"), 0x80);
+                Notify(PSTR("\r\n"), 0x80);
 #endif
-                        ParseHIDData(this, epInfo[index].epAddr, bHasReportId, (uint8_t)read, buf);
-
-                        HIDReportParser *prs = GetReportParser(((bHasReportId) ? *buf : 0));
+                ParseHIDData(this, req->ep, bHasReportId, read, rptBuf);
 
-                        if(prs)
-                                prs->Parse(this, bHasReportId, (uint8_t)read, buf);
-                    }
+                HIDReportParser *prs = GetReportParser(((bHasReportId) ? *rptBuf : 0));
 
+                if(prs)
+                        prs->Parse(this, bHasReportId, read, rptBuf);
         }
-        return rcode;
+
+        if(bPollEnable && req->rcode != USB_ERROR_TRANSFER_ABORTED)
+                SubmitRpt(rptIface + 1);
 }
 
 // Send a report to interrupt out endpoint. This is NOT SetReport() request!
@@ -21,7 +21,7 @@ e-mail   :  support@circuitsathome.com
 #include "usbhid.h"
 //#include "hidescriptorparser.h"
 
-class HIDComposite : public USBHID {
+class HIDComposite : public USBHID, public USBXferHandler {
 
 protected:
 
@@ -51,13 +51,19 @@ protected:
         uint32_t qNextPollTime; // next poll time
         uint8_t pollInterval;
         bool bPollEnable; // poll enable flag
+        bool bPollScheduled; // polled by the frame scheduler of the USB class
 
         static const uint16_t constBuffLen = 64; // event buffer length
 
+        USBXferReq rptReq; // interrupt IN of the interface being read
+        uint8_t rptIface; // index into hidInterfaces[] of rptReq
+        uint8_t rptBuf[constBuffLen]; // report read by rptReq
+
         void Initialize();
         HIDInterface* FindInterface(uint8_t iface, uint8_t alt, uint8_t proto);
 
         void ZeroMemory(uint8_t len, uint8_t *buf);
+        uint8_t SubmitRpt(uint8_t iface);
 
 
         EpInfo epInfo[totalEndpoints];
@@ -88,10 +94,15 @@ public:
         bool SetReportParser(uint8_t id, HIDReportParser *prs);
 
         // USBDeviceConfig implementation
+        uint8_t ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Release();
         uint8_t Poll();
 
+        uint32_t NextPollTime() {
+                return qNextPollTime;
+        };
+
         virtual uint8_t GetAddress() {
                 return bAddress;
         };
@@ -100,6 +111,9 @@ public:
                 return bPollEnable;
         };
 
+        // USBXferHandler implementation
+        void XferDone(USBXferReq *req);
+
         // UsbConfigXtracter implementation
         void EndpointXtract(uint8_t conf, uint8_t iface, uint8_t alt, uint8_t proto, const USB_ENDPOINT_DESCRIPTOR *ep);
 
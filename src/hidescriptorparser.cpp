@@ -1010,6 +1010,44 @@ void ReportDescParserBase::Parse(const uint16_t len, const uint8_t *pbuf, const
         //USBTRACE2("Total:", totalSize);
 }
 
+/* Streaming, see USBReadParser. The prefix of each item and then its data go to varBuffer, ParseItem() */
+/* takes the prefix from there and handles the item once its data is in. Data that does not fit into    */
+/* varBuffer is skipped along with its item. When streamed, totalSize adds up over the whole descriptor  */
+/* instead of starting again with every packet.                                                          */
+uint8_t* ReportDescParserBase::StreamBuffer(uint16_t *len) {
+        uint16_t n;
+        uint8_t *dst;
+
+        if(itemParseState == 0) {
+                n = 1;
+                dst = varBuffer;
+        } else {
+                n = itemSize - streamPos;
+                dst = (itemSize <= sizeof (varBuffer)) ? varBuffer + streamPos : NULL;
+        }
+        if(*len > n)
+                *len = n;
+        return dst;
+}
+
+void ReportDescParserBase::StreamDone(uint16_t len) {
+        uint8_t *p = varBuffer;
+        uint16_t cntdn = len;
+
+        if(itemParseState == 0) {
+                ParseItem(&p, &cntdn); // the prefix, leaves the state at 0 if the item has no data
+                return;
+        }
+        streamPos += len;
+        if(streamPos < itemSize)
+                return;
+        streamPos = 0;
+        cntdn = 0;
+        itemParseState = (itemSize <= sizeof (varBuffer)) ? 3 : 0;
+        if(itemParseState)
+                ParseItem(&p, &cntdn);
+}
+
 void ReportDescParserBase::PrintValue(uint8_t *p, uint8_t len) {
         E_Notify(PSTR("("), 0x80);
         for(; len; p++, len--)
@@ -106,6 +106,7 @@ protected:
         uint8_t itemParseState; // Item parser state variable
         uint8_t itemSize; // Item size
         uint8_t itemPrefix; // Item prefix (first byte)
+        uint8_t streamPos; // Bytes of the current item data streamed so far
         uint8_t rptSize; // Report Size
         uint8_t rptCount; // Report Count
 
@@ -125,8 +126,10 @@ public:
         itemParseState(0),
         itemSize(0),
         itemPrefix(0),
+        streamPos(0),
         rptSize(0),
         rptCount(0),
+        totalSize(0),
         pfUsage(NULL) {
                 theBuffer.pValue = varBuffer;
                 valParser.Initialize(&theBuffer);
@@ -134,6 +137,8 @@ public:
         };
 
         void Parse(const uint16_t len, const uint8_t *pbuf, const uint16_t &offset);
+        uint8_t* StreamBuffer(uint16_t *len);
+        void StreamDone(uint16_t len);
 
         enum {
                 enErrorSuccess = 0
@@ -23,7 +23,7 @@ uint8_t HIDUniversal::Poll() {
         if(!bPollEnable)
                 return 0;
 
-        if((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L) {
+        if(bPollScheduled || (int32_t)((uint32_t)millis() - qNextPollTime) >= 0L) {
                 qNextPollTime = (uint32_t)millis() + pollInterval;
 
                 uint8_t buf[constBuffLen];
@@ -28,8 +28,13 @@ bool MultiByteValueParser::Parse(uint8_t **pp, uint16_t *pcntdn) {
                 Notify(PSTR("Buffer pointer is NULL!\r\n"), 0x80);
                 return false;
         }
-        for(; countDown && (*pcntdn); countDown--, (*pcntdn)--, (*pp)++)
-                pBuf[valueSize - countDown] = (**pp);
+        // Take as much of the value as this chunk holds in one go
+        uint8_t n = (*pcntdn < countDown) ? (uint8_t)*pcntdn : countDown;
+
+        memcpy(pBuf + valueSize - countDown, *pp, n);
+        countDown -= n;
+        *pcntdn -= n;
+        *pp += n;
 
         if(countDown)
                 return false;
@@ -75,13 +75,18 @@ public:
         };
 
         bool Skip(uint8_t **pp, uint16_t *pcntdn, uint16_t bytes_to_skip) {
+                uint16_t n;
+
                 switch(nStage) {
                         case 0:
                                 countDown = bytes_to_skip;
                                 nStage++;
                                 // fall through
                         case 1:
-                                for(; countDown && (*pcntdn); countDown--, (*pp)++, (*pcntdn)--);
+                                n = (*pcntdn < countDown) ? *pcntdn : countDown;
+                                countDown -= n;
+                                *pcntdn -= n;
+                                *pp += n;
 
                                 if(!countDown)
                                         nStage = 0;
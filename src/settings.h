@@ -34,6 +34,26 @@ e-mail   :  support@circuitsathome.com
 //#define USB_SPI SPI1
 #endif
 
+/* SCK of the MAX3421E in Hz, the chip can handle up to 26MHz. Lower it for long wires
+ * or a board that does not run the bus reliably at the full rate. Only AVRs and cores
+ * with SPI transactions can change it, or the mode below
+ */
+#ifndef UHS_SPI_CLOCK
+#define UHS_SPI_CLOCK 26000000UL
+#endif
+
+/* SPI mode of the MAX3421E, 0 or 3 */
+#ifndef UHS_SPI_MODE
+#define UHS_SPI_MODE 0
+#endif
+
+/* Set this to 1 if the MAX3421E is the only device on the SPI bus. The SPI settings
+ * are then applied once in Init() instead of for every register access
+ */
+#ifndef USE_UHS_SPI_EXCLUSIVE
+#define USE_UHS_SPI_EXCLUSIVE 0
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // DEBUGGING
 ////////////////////////////////////////////////////////////////////////////////
@@ -62,6 +82,114 @@ e-mail   :  support@circuitsathome.com
 /* Set this to a one to use the xmem2 lock. This is needed for multitasking and threading */
 #define USE_XMEM_SPI_LOCK 0
 
+////////////////////////////////////////////////////////////////////////////////
+// Transfer engine
+////////////////////////////////////////////////////////////////////////////////
+
+/* Set this to 1 to wait on the MAX3421E INT pin for transfer completion instead
+ * of polling rHIRQ over SPI. The INT pin has to be connected.
+ */
+#ifndef USE_UHS_INT_XFER_DONE
+#define USE_UHS_INT_XFER_DONE 0
+#endif
+
+/* Set this to 1 to send the next IN token of a multi-packet IN transfer while the
+ * previous packet is still read out of the double-buffered receive FIFO
+ */
+#ifndef USE_UHS_PIPELINED_IN
+#define USE_UHS_PIPELINED_IN 0
+#endif
+
+/* Set this to 1 to load the next packet of a multi-packet OUT transfer into the
+ * second SNDFIFO buffer while the previous packet is on the wire
+ */
+#ifndef USE_UHS_PIPELINED_OUT
+#define USE_UHS_PIPELINED_OUT 0
+#endif
+
+/* Set this to 1 to hand FIFO transfers of UHS_SPI_DMA_MIN bytes or more to a DMA
+ * engine, see MAX3421e::setSpiDma()
+ */
+#ifndef USE_UHS_SPI_DMA
+#define USE_UHS_SPI_DMA 0
+#endif
+
+/* Set this to 1 to let the USB core learn a NAK limit for each bulk/interrupt
+ * endpoint from its traffic, see USB::getNakStats()
+ */
+#ifndef USE_UHS_ADAPTIVE_NAK
+#define USE_UHS_ADAPTIVE_NAK 0
+#endif
+
+/* Set this to 1 to have inTransfer() and outTransfer() clear a halted endpoint,
+ * reset its data toggle and try the transfer again, see USB::getRecoveryStats()
+ */
+#ifndef USE_UHS_STALL_RECOVERY
+#define USE_UHS_STALL_RECOVERY 0
+#endif
+
+/* Set this to 1 to poll only the drivers that hold a device, in the order their
+ * next poll is due, see USBDeviceConfig::NextPollTime()
+ */
+#ifndef USE_UHS_ACTIVE_POLL
+#define USE_UHS_ACTIVE_POLL 0
+#endif
+
+/* Set this to 1 to have USB::Task() report attach, detach, configured, released
+ * and enumeration error events, see USBEventHandler
+ */
+#ifndef USE_UHS_EVENTS
+#define USE_UHS_EVENTS 0
+#endif
+
+/* Set this to 1 to stream isochronous endpoints from USB::Task() through a ring
+ * of packet buffers, see USB::isoStartIn()
+ */
+#ifndef USE_UHS_ISO
+#define USE_UHS_ISO 0
+#endif
+
+/* Set this to 1 to keep per-endpoint transfer counters and a latency histogram,
+ * see USB::getTelemetry()
+ */
+#ifndef ENABLE_UHS_TELEMETRY
+#define ENABLE_UHS_TELEMETRY 0
+#endif
+
+/* Set this to 1 to record the bus transactions into a RAM ring buffer that can be
+ * written out as a pcap file for Wireshark, see USB::captureFlush()
+ */
+#ifndef ENABLE_UHS_CAPTURE
+#define ENABLE_UHS_CAPTURE 0
+#endif
+
+/* Set this to 1 to remember which driver took a device, so the device binds to
+ * it on the first attempt when it is connected again
+ */
+#ifndef USE_UHS_BIND_CACHE
+#define USE_UHS_BIND_CACHE 0
+#endif
+
+/* Set this to 1 to find devices and endpoints through lookup tables instead of
+ * searching the address pool on every transfer. Costs 128 bytes of RAM plus 16
+ * bytes per device.
+ */
+#ifndef USE_UHS_ADDRESS_MAP
+#define USE_UHS_ADDRESS_MAP 0
+#endif
+
+/* Set this to 1 to drive more than one MAX3421E. Each one is a USBHost<SS, INT>,
+ * the chip access of USB goes through virtual functions then. See USBScheduler
+ */
+#ifndef USE_UHS_MULTI_HOST
+#define USE_UHS_MULTI_HOST 0
+#endif
+
+/* Set this to 1 to count SPI register accesses, see MAX3421e::getSpiStats() */
+#ifndef ENABLE_UHS_SPI_STATS
+#define ENABLE_UHS_SPI_STATS 0
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 // Wii IR camera
 ////////////////////////////////////////////////////////////////////////////////
@@ -32,6 +32,15 @@ uint8_t USBHID::GetReportDescr(uint8_t ep, USBReadParser *parser) {
 }
  */
 uint8_t USBHID::GetReportDescr(uint16_t wIndex, USBReadParser *parser) {
+        // A streaming parser takes the descriptor straight from the FIFO, no buffer needed
+        if(parser && parser->Streams())
+                return pUsb->ctrlReq(bAddress, 0x00, bmREQ_HID_REPORT, USB_REQUEST_GET_DESCRIPTOR, 0x00,
+                        HID_DESCRIPTOR_REPORT, wIndex, 128, 128, NULL, parser);
+        return GetReportDescrBuffered(wIndex, parser);
+}
+
+/* The rest of GetReportDescr() for a parser that does not stream, the buffer is only on the stack for these */
+uint8_t USBHID::GetReportDescrBuffered(uint16_t wIndex, USBReadParser *parser) {
         const uint8_t constBufLen = 64;
         uint8_t buf[constBufLen];
 
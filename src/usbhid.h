@@ -155,6 +155,7 @@ protected:
 
         void PrintEndpointDescriptor(const USB_ENDPOINT_DESCRIPTOR* ep_ptr);
         void PrintHidDescriptor(const USB_HID_DESCRIPTOR *pDesc);
+        uint8_t GetReportDescrBuffered(uint16_t wIndex, USBReadParser *parser);
 
         virtual HIDReportParser* GetReportParser(uint8_t id __attribute__((unused))) {
                 return NULL;
@@ -34,11 +34,27 @@ e-mail   :  support@circuitsathome.com
 #include <sys/types.h>
 #endif
 
+/* SPI settings of a MAX3421e<>, from UHS_SPI_CLOCK, UHS_SPI_MODE and USE_UHS_SPI_EXCLUSIVE in      */
+/* settings.h. Derive from it to change a setting for one chip and pass the result as the third     */
+/* template argument, e.g.                                                                          */
+/*   struct SlowSpi : MAX3421eSpiDefault { static constexpr uint32_t clock = 8000000UL; };          */
+/* With 'shared' false the settings are applied once in Init() and every access skips               */
+/* beginTransaction() and endTransaction(), only do that if nothing else uses the bus.              */
+struct MAX3421eSpiDefault {
+        static constexpr uint32_t clock = UHS_SPI_CLOCK; // SCK in Hz, the MAX3421E can handle up to 26MHz
+        static constexpr uint8_t mode = UHS_SPI_MODE; // SPI mode 0 or 3, the MAX3421E supports both, MSB first
+        static constexpr bool shared = !USE_UHS_SPI_EXCLUSIVE; // other devices use the bus
+};
+
+#if defined(SPI_HAS_TRANSACTION)
+#define MAX3421E_SPI_SETTINGS(cfg) SPISettings(cfg::clock, MSBFIRST, (cfg::mode == 3) ? SPI_MODE3 : SPI_MODE0)
+#endif
+
 /* SPI initialization */
 template< typename SPI_CLK, typename SPI_MOSI, typename SPI_MISO, typename SPI_SS > class SPi {
 public:
 #if USING_SPI4TEENSY3
-        static void init() {
+        template< typename SPI_CFG = MAX3421eSpiDefault > static void init() {
                 // spi4teensy3 inits everything for us, except /SS
                 // CLK, MOSI and MISO are hard coded for now.
                 // spi4teensy3::init(0,0,0); // full speed, cpol 0, cpha 0
@@ -47,18 +63,26 @@ public:
                 SPI_SS::Set();
         }
 #elif defined(SPI_HAS_TRANSACTION)
-        static void init() {
+        template< typename SPI_CFG = MAX3421eSpiDefault > static void init() {
                 USB_SPI.begin(); // The SPI library with transaction will take care of setting up the pins - settings is set in beginTransaction()
+                if(!SPI_CFG::shared) {
+                        // The bus is ours, the settings stay after the transaction ends
+                        USB_SPI.beginTransaction(MAX3421E_SPI_SETTINGS(SPI_CFG));
+                        USB_SPI.endTransaction();
+                }
                 SPI_SS::SetDirWrite();
                 SPI_SS::Set();
         }
 #elif defined(STM32F4)
 #warning "You need to initialize the SPI interface manually when using the STM32F4 platform"
-        static void init() {
+        template< typename SPI_CFG = MAX3421eSpiDefault > static void init() {
                 // Should be initialized by the user manually for now
         }
 #elif !defined(SPDR)
-        static void init() {
+        template< typename SPI_CFG = MAX3421eSpiDefault > static void init() {
+                // Without transactions the clock divider is core specific, only the AVR encoding is computed below
+                static_assert(SPI_CFG::clock == 26000000UL, "UHS_SPI_CLOCK needs an AVR or a core with SPI transactions");
+                static_assert(SPI_CFG::mode == 0, "UHS_SPI_MODE needs an AVR or a core with SPI transactions");
                 SPI_SS::SetDirWrite();
                 SPI_SS::Set();
                 USB_SPI.begin();
@@ -75,19 +99,26 @@ public:
 #endif
         }
 #else
-        static void init() {
+        template< typename SPI_CFG = MAX3421eSpiDefault > static void init() {
                 //uint8_t tmp;
                 SPI_CLK::SetDirWrite();
                 SPI_MOSI::SetDirWrite();
                 SPI_MISO::SetDirRead();
                 SPI_SS::SetDirWrite();
-                /* mode 00 (CPOL=0, CPHA=0) master, fclk/2. Mode 11 (CPOL=11, CPHA=11) is also supported by MAX3421E */
-                SPCR = 0x50;
-                SPSR = 0x01; // 0x01
+                /* master, mode 00 (CPOL=0, CPHA=0) or mode 11 (CPOL=1, CPHA=1), fclk/2 at 0x50/0x01 */
+                const uint8_t n = ClockShift(SPI_CFG::clock);
+                SPCR = 0x50 | ((SPI_CFG::mode == 3) ? 0x0c : 0x00) | ((n == 7) ? 0x03 : (n - 1) / 2);
+                SPSR = ((n & 1) && n != 7) ? 0x01 : 0x00; // SPI2X
                 /**/
                 //tmp = SPSR;
                 //tmp = SPDR;
         }
+
+private:
+        /* fclk/2^n, the smallest n from 1 to 7 that does not go above 'clock' */
+        static constexpr uint8_t ClockShift(uint32_t clock, uint8_t n = 1) {
+                return (n == 7 || (uint32_t)(F_CPU >> n) <= clock) ? n : ClockShift(clock, n + 1);
+        };
 #endif
 };
 
@@ -110,7 +141,7 @@ typedef SPi< Pb1, Pb2, Pb3, Pb0 > spi;
 typedef SPi< Pb5, Pb3, Pb4, Pb2 > spi;
 #elif defined(__AVR_ATmega644__) || defined(__AVR_ATmega644P__) || defined(__AVR_ATmega1284__) || defined(__AVR_ATmega1284P__)
 typedef SPi< Pb7, Pb5, Pb6, Pb4 > spi;
-#elif (defined(CORE_TEENSY) && (defined(__MK20DX128__) || defined(__MK20DX256__) || defined(__MK64FX512__) || defined(__MK66FX1M0__) || defined(__MKL26Z64__))) || defined(__ARDUINO_ARC__) || defined(__ARDUINO_X86__) || defined(__MIPSEL__) || defined(STM32F4)
+#elif (defined(CORE_TEENSY) && (defined(__MK20DX128__) || defined(__MK20DX256__) || defined(__MK64FX512__) || defined(__MK66FX1M0__) || defined(__MKL26Z64__))) || defined(__ARDUINO_ARC__) || defined(__ARDUINO_X86__) || defined(__MIPSEL__) || defined(STM32F4) || defined(UHS_HOST_SIM)
 typedef SPi< P13, P11, P12, P10 > spi;
 #elif defined(ARDUINO_SAM_DUE) && defined(__SAM3X8E__)
 typedef SPi< P76, P75, P74, P10 > spi;
@@ -126,13 +157,161 @@ typedef SPi< P26, P25, P24, P5 > spi;
 #error "No SPI entry in usbhost.h"
 #endif
 
+#if USE_UHS_SPI_DMA
+#ifndef UHS_SPI_DMA_MIN
+#define UHS_SPI_DMA_MIN 64 // smallest FIFO transfer handed to the DMA engine
+#endif
+
+/* DMA engine for FIFO transfers, see MAX3421e::setSpiDma()                          */
+/* Start() is called with SS asserted and has to clock out the command byte 'cmd'    */
+/* followed by 'len' data bytes. 'tx' is NULL for reads, 'rx' is NULL for writes.    */
+/* Return false without touching the bus to use the byte-by-byte loop instead.       */
+class MAX3421eSpiDma {
+public:
+        virtual bool Start(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint8_t len) = 0;
+
+        // true while the transfer started by Start() is running
+        virtual bool Busy() {
+                return false;
+        };
+
+        // Called repeatedly until Busy() is false, the CPU is free for other work here
+        virtual void Pending() {
+        };
+};
+
+/* Software reference engine, moves the bytes one at a time. Used to check the DMA   */
+/* path on boards without a DMA engine and on host builds with a simulated SPI bus   */
+class MAX3421eSpiSoftDma : public MAX3421eSpiDma {
+public:
+        bool Start(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint8_t len) {
+                USB_SPI.transfer(cmd);
+                while(len--) {
+                        uint8_t c = USB_SPI.transfer(tx ? *tx++ : 0);
+                        if(rx)
+                                *rx++ = c;
+                }
+                return true;
+        };
+};
+
+#if defined(STM32F4)
+/* Uses the DMA streams linked to SPI_Handle, these have to be set up in your main.cpp */
+class MAX3421eSpiHwDma : public MAX3421eSpiDma {
+public:
+        bool Start(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint8_t len) {
+                if(!SPI_Handle.hdmatx || (rx && !SPI_Handle.hdmarx) || HAL_SPI_GetState(&SPI_Handle) != HAL_SPI_STATE_READY)
+                        return false;
+                if(HAL_DMA_GetState(SPI_Handle.hdmatx) != HAL_DMA_STATE_READY || (rx && HAL_DMA_GetState(SPI_Handle.hdmarx) != HAL_DMA_STATE_READY))
+                        return false;
+                HAL_SPI_Transmit(&SPI_Handle, &cmd, 1, HAL_MAX_DELAY);
+                // The command byte is out already, so a transfer the DMA does not take is finished by hand
+                if(rx) {
+                        memset(rx, 0, len); // Make sure we send out empty bytes
+                        if(HAL_SPI_Receive_DMA(&SPI_Handle, rx, len) != HAL_OK)
+                                HAL_SPI_Receive(&SPI_Handle, rx, len, HAL_MAX_DELAY);
+                } else if(HAL_SPI_Transmit_DMA(&SPI_Handle, (uint8_t*)tx, len) != HAL_OK)
+                        HAL_SPI_Transmit(&SPI_Handle, (uint8_t*)tx, len, HAL_MAX_DELAY);
+                return true;
+        };
+
+        bool Busy() {
+                return HAL_SPI_GetState(&SPI_Handle) != HAL_SPI_STATE_READY;
+        };
+};
+#elif defined(SPI_HAS_TRANSFER_ASYNC) // Teensy 3.x and 4.x
+class MAX3421eSpiHwDma : public MAX3421eSpiDma {
+        EventResponder event;
+        volatile bool busy;
+
+        static void onDone(EventResponderRef ev) {
+                ((MAX3421eSpiHwDma*)ev.getContext())->busy = false;
+        };
+
+public:
+        MAX3421eSpiHwDma() : busy(false) {
+                event.setContext(this);
+                event.attachImmediate(onDone);
+        };
+
+        bool Start(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint8_t len) {
+                USB_SPI.transfer(cmd);
+                busy = true;
+                if(!USB_SPI.transfer(tx, rx, len, event)) {
+                        busy = false;
+                        while(len--) { // the command byte is out already, so finish by hand
+                                uint8_t c = USB_SPI.transfer(tx ? *tx++ : 0);
+                                if(rx)
+                                        *rx++ = c;
+                        }
+                }
+                return true;
+        };
+
+        bool Busy() {
+                return busy;
+        };
+};
+#elif defined(ESP32)
+/* The SPI peripheral moves the whole block from its hardware buffer, the CPU only waits once */
+class MAX3421eSpiHwDma : public MAX3421eSpiDma {
+public:
+        bool Start(uint8_t cmd, const uint8_t *tx, uint8_t *rx, uint8_t len) {
+                USB_SPI.transfer(cmd);
+                if(rx) {
+                        memset(rx, 0, len); // Make sure we send out empty bytes
+                        USB_SPI.transferBytes(rx, rx, len);
+                } else
+                        USB_SPI.writeBytes(tx, len);
+                return true;
+        };
+};
+#endif
+#endif
+
 typedef enum {
         vbus_on = 0,
         vbus_off = GPX_VBDET
 } VBUS_t;
 
-template< typename SPI_SS, typename INTR > class MAX3421e /* : public spi */ {
+#if ENABLE_UHS_SPI_STATS
+/* SPI access counters, see MAX3421e::getSpiStats() */
+struct MAX3421eSpiStats {
+        uint32_t regRd; // single register reads
+        uint32_t regWr; // single register writes
+        uint32_t bytesRd; // multiple-byte reads
+        uint32_t bytesWr; // multiple-byte writes
+        uint32_t regBatch; // batches of register accesses
+};
+#endif
+
+/* One register access of a batch, see MAX3421e::regBatch() */
+struct MAX3421eRegOp {
+        uint8_t reg; // register, use MAX3421E_RD() or MAX3421E_WR()
+        uint8_t data; // value to write, or the value read
+};
+
+#define MAX3421E_RD(reg) (reg)
+#define MAX3421E_WR(reg) ((reg) | 0x02)
+
+#if USE_UHS_INT_XFER_DONE
+#define MAX3421E_HIEN (bmCONDETIE | bmHXFRDNIE) // INT pin signals connection changes and transfer completion
+#else
+#define MAX3421E_HIEN (bmCONDETIE | bmFRAMEIE)
+#endif
+
+template< typename SPI_SS, typename INTR, typename SPI_CFG = MAX3421eSpiDefault > class MAX3421e /* : public spi */ {
+        static_assert(SPI_CFG::clock <= 26000000UL, "The MAX3421E can handle up to 26MHz");
+        static_assert(SPI_CFG::mode == 0 || SPI_CFG::mode == 3, "The MAX3421E supports SPI mode 0 and 3");
+
         static uint8_t vbusState;
+        static bool pwrDown; // oscillator stopped by powerDown()
+#if ENABLE_UHS_SPI_STATS
+        static MAX3421eSpiStats spiStats;
+#endif
+#if USE_UHS_SPI_DMA
+        static MAX3421eSpiDma *spiDma;
+#endif
 
 public:
         MAX3421e();
@@ -141,6 +320,10 @@ public:
         void gpioWr(uint8_t data);
         uint8_t regRd(uint8_t reg);
         uint8_t* bytesRd(uint8_t reg, uint8_t nbytes, uint8_t* data_p);
+        void regBatch(MAX3421eRegOp *ops, uint8_t nops);
+        void fifoRdBegin(uint8_t reg);
+        uint8_t* fifoRd(uint8_t nbytes, uint8_t* data_p);
+        void fifoRdEnd();
         uint8_t gpioRd();
         uint8_t gpioRdOutput();
         uint16_t reset();
@@ -154,18 +337,58 @@ public:
         uint8_t getVbusState(void) {
                 return vbusState;
         };
+
+        bool isPoweredDown(void) {
+                return pwrDown;
+        };
+        void powerDown();
+        bool powerUp();
         void busprobe();
         uint8_t GpxHandler();
         uint8_t IntHandler();
         uint8_t Task();
+        bool waitXfrDone(uint32_t timeout, uint8_t *hrsl = NULL);
+
+#if ENABLE_UHS_SPI_STATS
+        const MAX3421eSpiStats& getSpiStats() {
+                return spiStats;
+        };
+
+        void resetSpiStats() {
+                memset(&spiStats, 0, sizeof(spiStats));
+        };
+#endif
+#if USE_UHS_SPI_DMA
+        // Pass NULL to go back to the byte-by-byte loop
+        void setSpiDma(MAX3421eSpiDma *dma) {
+                spiDma = dma;
+        };
+#endif
 };
 
-template< typename SPI_SS, typename INTR >
-        uint8_t MAX3421e< SPI_SS, INTR >::vbusState = 0;
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+        uint8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::vbusState = 0;
+
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+        bool MAX3421e< SPI_SS, INTR, SPI_CFG >::pwrDown = false;
+
+#if ENABLE_UHS_SPI_STATS
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+        MAX3421eSpiStats MAX3421e< SPI_SS, INTR, SPI_CFG >::spiStats;
+
+#define MAX3421E_SPI_STAT(x) (spiStats.x++)
+#else
+#define MAX3421E_SPI_STAT(x) ((void)0)
+#endif
+
+#if USE_UHS_SPI_DMA
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+        MAX3421eSpiDma *MAX3421e< SPI_SS, INTR, SPI_CFG >::spiDma = NULL;
+#endif
 
 /* constructor */
-template< typename SPI_SS, typename INTR >
-MAX3421e< SPI_SS, INTR >::MAX3421e() {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+MAX3421e< SPI_SS, INTR, SPI_CFG >::MAX3421e() {
         // Leaving ADK hardware setup in here, for now. This really belongs with the other parts.
 #ifdef BOARD_MEGA_ADK
         // For Mega ADK, which has a Max3421e on-board, set MAX_RESET to output mode, and then set it to HIGH
@@ -175,11 +398,13 @@ MAX3421e< SPI_SS, INTR >::MAX3421e() {
 };
 
 /* write single byte into MAX3421 register */
-template< typename SPI_SS, typename INTR >
-void MAX3421e< SPI_SS, INTR >::regWr(uint8_t reg, uint8_t data) {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+void MAX3421e< SPI_SS, INTR, SPI_CFG >::regWr(uint8_t reg, uint8_t data) {
+        MAX3421E_SPI_STAT(regWr);
         XMEM_ACQUIRE_SPI();
 #if defined(SPI_HAS_TRANSACTION)
-        USB_SPI.beginTransaction(SPISettings(26000000, MSBFIRST, SPI_MODE0)); // The MAX3421E can handle up to 26MHz, use MSB First and SPI mode 0
+        if(SPI_CFG::shared)
+                USB_SPI.beginTransaction(MAX3421E_SPI_SETTINGS(SPI_CFG));
 #endif
         SPI_SS::Clear();
 
@@ -210,7 +435,8 @@ void MAX3421e< SPI_SS, INTR >::regWr(uint8_t reg, uint8_t data) {
 
         SPI_SS::Set();
 #if defined(SPI_HAS_TRANSACTION)
-        USB_SPI.endTransaction();
+        if(SPI_CFG::shared)
+                USB_SPI.endTransaction();
 #endif
         XMEM_RELEASE_SPI();
         return;
@@ -218,14 +444,23 @@ void MAX3421e< SPI_SS, INTR >::regWr(uint8_t reg, uint8_t data) {
 /* multiple-byte write                            */
 
 /* returns a pointer to memory position after last written */
-template< typename SPI_SS, typename INTR >
-uint8_t* MAX3421e< SPI_SS, INTR >::bytesWr(uint8_t reg, uint8_t nbytes, uint8_t* data_p) {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint8_t* MAX3421e< SPI_SS, INTR, SPI_CFG >::bytesWr(uint8_t reg, uint8_t nbytes, uint8_t* data_p) {
+        MAX3421E_SPI_STAT(bytesWr);
         XMEM_ACQUIRE_SPI();
 #if defined(SPI_HAS_TRANSACTION)
-        USB_SPI.beginTransaction(SPISettings(26000000, MSBFIRST, SPI_MODE0)); // The MAX3421E can handle up to 26MHz, use MSB First and SPI mode 0
+        if(SPI_CFG::shared)
+                USB_SPI.beginTransaction(MAX3421E_SPI_SETTINGS(SPI_CFG));
 #endif
         SPI_SS::Clear();
 
+#if USE_UHS_SPI_DMA
+        if(spiDma && nbytes >= UHS_SPI_DMA_MIN && spiDma->Start(reg | 0x02, data_p, NULL, nbytes)) {
+                while(spiDma->Busy())
+                        spiDma->Pending();
+                data_p += nbytes;
+        } else {
+#endif
 #if USING_SPI4TEENSY3
         spi4teensy3::send(reg | 0x02);
         spi4teensy3::send(data_p, nbytes);
@@ -255,10 +490,14 @@ uint8_t* MAX3421e< SPI_SS, INTR >::bytesWr(uint8_t reg, uint8_t nbytes, uint8_t*
         }
         while(!(SPSR & (1 << SPIF)));
 #endif
+#if USE_UHS_SPI_DMA
+        }
+#endif
 
         SPI_SS::Set();
 #if defined(SPI_HAS_TRANSACTION)
-        USB_SPI.endTransaction();
+        if(SPI_CFG::shared)
+                USB_SPI.endTransaction();
 #endif
         XMEM_RELEASE_SPI();
         return ( data_p);
@@ -267,8 +506,8 @@ uint8_t* MAX3421e< SPI_SS, INTR >::bytesWr(uint8_t reg, uint8_t nbytes, uint8_t*
 /*GPIO byte is split between 2 registers, so two writes are needed to write one byte */
 
 /* GPOUT bits are in the low nibble. 0-3 in IOPINS1, 4-7 in IOPINS2 */
-template< typename SPI_SS, typename INTR >
-void MAX3421e< SPI_SS, INTR >::gpioWr(uint8_t data) {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+void MAX3421e< SPI_SS, INTR, SPI_CFG >::gpioWr(uint8_t data) {
         regWr(rIOPINS1, data);
         data >>= 4;
         regWr(rIOPINS2, data);
@@ -276,11 +515,13 @@ void MAX3421e< SPI_SS, INTR >::gpioWr(uint8_t data) {
 }
 
 /* single host register read    */
-template< typename SPI_SS, typename INTR >
-uint8_t MAX3421e< SPI_SS, INTR >::regRd(uint8_t reg) {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::regRd(uint8_t reg) {
+        MAX3421E_SPI_STAT(regRd);
         XMEM_ACQUIRE_SPI();
 #if defined(SPI_HAS_TRANSACTION)
-        USB_SPI.beginTransaction(SPISettings(26000000, MSBFIRST, SPI_MODE0)); // The MAX3421E can handle up to 26MHz, use MSB First and SPI mode 0
+        if(SPI_CFG::shared)
+                USB_SPI.beginTransaction(MAX3421E_SPI_SETTINGS(SPI_CFG));
 #endif
         SPI_SS::Clear();
 
@@ -307,7 +548,8 @@ uint8_t MAX3421e< SPI_SS, INTR >::regRd(uint8_t reg) {
 #endif
 
 #if defined(SPI_HAS_TRANSACTION)
-        USB_SPI.endTransaction();
+        if(SPI_CFG::shared)
+                USB_SPI.endTransaction();
 #endif
         XMEM_RELEASE_SPI();
         return (rv);
@@ -315,14 +557,23 @@ uint8_t MAX3421e< SPI_SS, INTR >::regRd(uint8_t reg) {
 /* multiple-byte register read  */
 
 /* returns a pointer to a memory position after last read   */
-template< typename SPI_SS, typename INTR >
-uint8_t* MAX3421e< SPI_SS, INTR >::bytesRd(uint8_t reg, uint8_t nbytes, uint8_t* data_p) {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint8_t* MAX3421e< SPI_SS, INTR, SPI_CFG >::bytesRd(uint8_t reg, uint8_t nbytes, uint8_t* data_p) {
+        MAX3421E_SPI_STAT(bytesRd);
         XMEM_ACQUIRE_SPI();
 #if defined(SPI_HAS_TRANSACTION)
-        USB_SPI.beginTransaction(SPISettings(26000000, MSBFIRST, SPI_MODE0)); // The MAX3421E can handle up to 26MHz, use MSB First and SPI mode 0
+        if(SPI_CFG::shared)
+                USB_SPI.beginTransaction(MAX3421E_SPI_SETTINGS(SPI_CFG));
 #endif
         SPI_SS::Clear();
 
+#if USE_UHS_SPI_DMA
+        if(spiDma && nbytes >= UHS_SPI_DMA_MIN && spiDma->Start(reg, NULL, data_p, nbytes)) {
+                while(spiDma->Busy())
+                        spiDma->Pending();
+                data_p += nbytes;
+        } else {
+#endif
 #if USING_SPI4TEENSY3
         spi4teensy3::send(reg);
         spi4teensy3::receive(data_p, nbytes);
@@ -367,23 +618,143 @@ uint8_t* MAX3421e< SPI_SS, INTR >::bytesRd(uint8_t reg, uint8_t nbytes, uint8_t*
                 *data_p++ = SPDR;
         }
 #endif
+#endif
+#if USE_UHS_SPI_DMA
+        }
 #endif
 
         SPI_SS::Set();
 #if defined(SPI_HAS_TRANSACTION)
-        USB_SPI.endTransaction();
+        if(SPI_CFG::shared)
+                USB_SPI.endTransaction();
+#endif
+        XMEM_RELEASE_SPI();
+        return ( data_p);
+}
+/* batch of register accesses                                                      */
+/* The MAX3421E takes one register per SS cycle, so SS is still toggled for every  */
+/* access, but the bus is acquired and configured only once for the whole batch.   */
+/* Ops are run in order; reads store the register value in 'data'                  */
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+void MAX3421e< SPI_SS, INTR, SPI_CFG >::regBatch(MAX3421eRegOp *ops, uint8_t nops) {
+        MAX3421E_SPI_STAT(regBatch);
+        XMEM_ACQUIRE_SPI();
+#if defined(SPI_HAS_TRANSACTION)
+        if(SPI_CFG::shared)
+                USB_SPI.beginTransaction(MAX3421E_SPI_SETTINGS(SPI_CFG));
+#endif
+        for(; nops; nops--, ops++) {
+                SPI_SS::Clear();
+#if USING_SPI4TEENSY3
+                if(ops->reg & 0x02) {
+                        uint8_t c[2];
+                        c[0] = ops->reg;
+                        c[1] = ops->data;
+                        spi4teensy3::send(c, 2);
+                } else {
+                        spi4teensy3::send(ops->reg);
+                        ops->data = spi4teensy3::receive();
+                }
+#elif defined(STM32F4)
+                if(ops->reg & 0x02) {
+                        uint8_t c[2];
+                        c[0] = ops->reg;
+                        c[1] = ops->data;
+                        HAL_SPI_Transmit(&SPI_Handle, c, 2, HAL_MAX_DELAY);
+                } else {
+                        HAL_SPI_Transmit(&SPI_Handle, &ops->reg, 1, HAL_MAX_DELAY);
+                        ops->data = 0;
+                        HAL_SPI_Receive(&SPI_Handle, &ops->data, 1, HAL_MAX_DELAY);
+                }
+#elif !defined(SPDR) || defined(SPI_HAS_TRANSACTION)
+                USB_SPI.transfer(ops->reg);
+                if(ops->reg & 0x02)
+                        USB_SPI.transfer(ops->data);
+                else
+                        ops->data = USB_SPI.transfer(0); // Send empty byte
+#else
+                SPDR = ops->reg;
+                while(!(SPSR & (1 << SPIF)));
+                SPDR = (ops->reg & 0x02) ? ops->data : 0;
+                while(!(SPSR & (1 << SPIF)));
+                if(!(ops->reg & 0x02))
+                        ops->data = SPDR;
+#endif
+                SPI_SS::Set();
+        }
+#if defined(SPI_HAS_TRANSACTION)
+        if(SPI_CFG::shared)
+                USB_SPI.endTransaction();
 #endif
         XMEM_RELEASE_SPI();
+}
+
+/* scattered multiple-byte register read                                             */
+/* fifoRdBegin() selects the chip and sends the register, each fifoRd() then clocks  */
+/* the next bytes into 'data_p', or drops them if it is NULL, and fifoRdEnd() ends   */
+/* the access. The caller can decide where the next bytes go from the ones already   */
+/* read, the whole read still takes a single SS cycle.                               */
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+void MAX3421e< SPI_SS, INTR, SPI_CFG >::fifoRdBegin(uint8_t reg) {
+        MAX3421E_SPI_STAT(bytesRd);
+        XMEM_ACQUIRE_SPI();
+#if defined(SPI_HAS_TRANSACTION)
+        if(SPI_CFG::shared)
+                USB_SPI.beginTransaction(MAX3421E_SPI_SETTINGS(SPI_CFG));
+#endif
+        SPI_SS::Clear();
+#if USING_SPI4TEENSY3
+        spi4teensy3::send(reg);
+#elif defined(STM32F4)
+        HAL_SPI_Transmit(&SPI_Handle, &reg, 1, HAL_MAX_DELAY);
+#elif !defined(SPDR) || defined(SPI_HAS_TRANSACTION)
+        USB_SPI.transfer(reg);
+#else
+        SPDR = reg;
+        while(!(SPSR & (1 << SPIF)));
+#endif
+}
+
+/* returns a pointer to a memory position after last read   */
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint8_t* MAX3421e< SPI_SS, INTR, SPI_CFG >::fifoRd(uint8_t nbytes, uint8_t* data_p) {
+        for(; nbytes; nbytes--) {
+#if USING_SPI4TEENSY3
+                uint8_t rv = spi4teensy3::receive();
+#elif defined(STM32F4)
+                uint8_t rv = 0;
+                HAL_SPI_Receive(&SPI_Handle, &rv, 1, HAL_MAX_DELAY);
+#elif !defined(SPDR) || defined(SPI_HAS_TRANSACTION)
+                uint8_t rv = USB_SPI.transfer(0); // Send empty byte
+#else
+                SPDR = 0; // Send empty byte
+                while(!(SPSR & (1 << SPIF)));
+                uint8_t rv = SPDR;
+#endif
+                if(data_p)
+                        *data_p++ = rv;
+        }
         return ( data_p);
 }
+
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+void MAX3421e< SPI_SS, INTR, SPI_CFG >::fifoRdEnd() {
+        SPI_SS::Set();
+#if defined(SPI_HAS_TRANSACTION)
+        if(SPI_CFG::shared)
+                USB_SPI.endTransaction();
+#endif
+        XMEM_RELEASE_SPI();
+}
+
 /* GPIO read. See gpioWr for explanation */
 
 /** @brief  Reads the current GPI input values
 *   @retval uint8_t Bitwise value of all 8 GPI inputs
 */
 /* GPIN pins are in high nibbles of IOPINS1, IOPINS2    */
-template< typename SPI_SS, typename INTR >
-uint8_t MAX3421e< SPI_SS, INTR >::gpioRd() {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::gpioRd() {
         uint8_t gpin = 0;
         gpin = regRd(rIOPINS2); //pins 4-7
         gpin &= 0xf0; //clean lower nibble
@@ -395,8 +766,8 @@ uint8_t MAX3421e< SPI_SS, INTR >::gpioRd() {
 *   @retval uint8_t Bitwise value of all 8 GPI outputs
 */
 /* GPOUT pins are in low nibbles of IOPINS1, IOPINS2    */
-template< typename SPI_SS, typename INTR >
-uint8_t MAX3421e< SPI_SS, INTR >::gpioRdOutput() {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::gpioRdOutput() {
         uint8_t gpout = 0;
         gpout = regRd(rIOPINS1); //pins 0-3
         gpout &= 0x0f; //clean upper nibble
@@ -406,11 +777,12 @@ uint8_t MAX3421e< SPI_SS, INTR >::gpioRdOutput() {
 
 /* reset MAX3421E. Returns number of cycles it took for PLL to stabilize after reset
   or zero if PLL haven't stabilized in 65535 cycles */
-template< typename SPI_SS, typename INTR >
-uint16_t MAX3421e< SPI_SS, INTR >::reset() {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint16_t MAX3421e< SPI_SS, INTR, SPI_CFG >::reset() {
         uint16_t i = 0;
         regWr(rUSBCTL, bmCHIPRES);
         regWr(rUSBCTL, 0x00);
+        pwrDown = false;
         while(++i) {
                 if((regRd(rUSBIRQ) & bmOSCOKIRQ)) {
                         break;
@@ -420,8 +792,8 @@ uint16_t MAX3421e< SPI_SS, INTR >::reset() {
 }
 
 /* initialize MAX3421E. Set Host mode, pullups, and stuff. Returns 0 if success, -1 if not */
-template< typename SPI_SS, typename INTR >
-int8_t MAX3421e< SPI_SS, INTR >::Init() {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+int8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::Init() {
         XMEM_ACQUIRE_SPI();
         // Moved here.
         // you really should not init hardware in the constructor when it involves locks.
@@ -429,7 +801,7 @@ int8_t MAX3421e< SPI_SS, INTR >::Init() {
         /* pin and peripheral setup */
         SPI_SS::SetDirWrite();
         SPI_SS::Set();
-        spi::init();
+        spi::init< SPI_CFG >();
         INTR::SetDirRead();
         XMEM_RELEASE_SPI();
         /* MAX3421E - full-duplex SPI, level interrupt */
@@ -442,7 +814,7 @@ int8_t MAX3421e< SPI_SS, INTR >::Init() {
 
         regWr(rMODE, bmDPPULLDN | bmDMPULLDN | bmHOST); // set pull-downs, Host
 
-        regWr(rHIEN, bmCONDETIE | bmFRAMEIE); //connection detection
+        regWr(rHIEN, MAX3421E_HIEN); //connection detection
 
         /* check if device is connected */
         regWr(rHCTL, bmSAMPLEBUS); // sample USB bus
@@ -457,8 +829,8 @@ int8_t MAX3421e< SPI_SS, INTR >::Init() {
 }
 
 /* initialize MAX3421E. Set Host mode, pullups, and stuff. Returns 0 if success, -1 if not */
-template< typename SPI_SS, typename INTR >
-int8_t MAX3421e< SPI_SS, INTR >::Init(int mseconds) {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+int8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::Init(int mseconds) {
         XMEM_ACQUIRE_SPI();
         // Moved here.
         // you really should not init hardware in the constructor when it involves locks.
@@ -466,7 +838,7 @@ int8_t MAX3421e< SPI_SS, INTR >::Init(int mseconds) {
         /* pin and peripheral setup */
         SPI_SS::SetDirWrite();
         SPI_SS::Set();
-        spi::init();
+        spi::init< SPI_CFG >();
         INTR::SetDirRead();
         XMEM_RELEASE_SPI();
         /* MAX3421E - full-duplex SPI, level interrupt, vbus off */
@@ -483,7 +855,7 @@ int8_t MAX3421e< SPI_SS, INTR >::Init(int mseconds) {
 
         regWr(rMODE, bmDPPULLDN | bmDMPULLDN | bmHOST); // set pull-downs, Host
 
-        regWr(rHIEN, bmCONDETIE | bmFRAMEIE); //connection detection
+        regWr(rHIEN, MAX3421E_HIEN); //connection detection
 
         /* check if device is connected */
         regWr(rHCTL, bmSAMPLEBUS); // sample USB bus
@@ -500,9 +872,36 @@ int8_t MAX3421e< SPI_SS, INTR >::Init(int mseconds) {
         return ( 0);
 }
 
+/* Stops the oscillator. Only a connection change or a remote wakeup asserts INT, Task() then powers the */
+/* chip up again. Stop the SOFs first, a bus with a device on it is suspended by that.                   */
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+void MAX3421e< SPI_SS, INTR, SPI_CFG >::powerDown() {
+        regWr(rHIRQ, bmCONDETIRQ | bmRWUIRQ); // only new events wake us up
+        regWr(rHIEN, bmCONDETIE | bmRWUIE);
+        regWr(rUSBCTL, bmPWRDOWN);
+        regWr(rUSBIRQ, bmOSCOKIRQ);
+        pwrDown = true;
+}
+
+/* Restarts the oscillator. Returns false if it did not get stable, see reset() */
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+bool MAX3421e< SPI_SS, INTR, SPI_CFG >::powerUp() {
+        uint16_t i = 0;
+
+        regWr(rUSBCTL, 0x00);
+        while(++i) {
+                if((regRd(rUSBIRQ) & bmOSCOKIRQ)) {
+                        break;
+                }
+        }
+        regWr(rHIEN, MAX3421E_HIEN);
+        pwrDown = false;
+        return (i != 0);
+}
+
 /* probe bus to determine device presence and speed and switch host to this speed */
-template< typename SPI_SS, typename INTR >
-void MAX3421e< SPI_SS, INTR >::busprobe() {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+void MAX3421e< SPI_SS, INTR, SPI_CFG >::busprobe() {
         uint8_t bus_sample;
         bus_sample = regRd(rHRSL); //Get J,K status
         bus_sample &= (bmJSTATUS | bmKSTATUS); //zero the rest of the byte
@@ -536,8 +935,8 @@ void MAX3421e< SPI_SS, INTR >::busprobe() {
 }
 
 /* MAX3421 state change task and interrupt handler */
-template< typename SPI_SS, typename INTR >
-uint8_t MAX3421e< SPI_SS, INTR >::Task(void) {
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::Task(void) {
         uint8_t rcode = 0;
         uint8_t pinvalue;
         //USB_HOST_SERIAL.print("Vbus state: ");
@@ -545,6 +944,8 @@ uint8_t MAX3421e< SPI_SS, INTR >::Task(void) {
         pinvalue = INTR::IsSet(); //Read();
         //pinvalue = digitalRead( MAX_INT );
         if(pinvalue == 0) {
+                if(pwrDown)
+                        powerUp();
                 rcode = IntHandler();
         }
         //    pinvalue = digitalRead( MAX_GPX );
@@ -555,8 +956,39 @@ uint8_t MAX3421e< SPI_SS, INTR >::Task(void) {
         return ( rcode);
 }
 
-template< typename SPI_SS, typename INTR >
-uint8_t MAX3421e< SPI_SS, INTR >::IntHandler() {
+/* Waits for the transfer complete IRQ and clears it. Returns false if 'timeout' (in millis()) expired first */
+/* With USE_UHS_INT_XFER_DONE set, rHIRQ is only read once the INT pin is asserted                        */
+/* If 'hrsl' is given, rHRSL is read along with clearing the IRQ                                          */
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+bool MAX3421e< SPI_SS, INTR, SPI_CFG >::waitXfrDone(uint32_t timeout, uint8_t *hrsl) {
+        while((int32_t)((uint32_t)millis() - timeout) < 0L) {
+#if defined(ESP8266) || defined(ESP32)
+                yield(); // needed in order to reset the watchdog timer on the ESP8266
+#endif
+#if USE_UHS_INT_XFER_DONE
+                if(INTR::IsSet()) // INT is active low, nothing pending yet
+                        continue;
+#endif
+                // If a connection change is pending as well, the pin stays asserted until Task() serves it, so we fall back to polling
+                if(regRd(rHIRQ) & bmHXFRDNIRQ) {
+                        if(hrsl) {
+                                // Clear the interrupt and fetch the transfer result in one go
+                                MAX3421eRegOp ops[2] = {
+                                        { MAX3421E_WR(rHIRQ), bmHXFRDNIRQ },
+                                        { MAX3421E_RD(rHRSL), 0 }
+                                };
+                                regBatch(ops, 2);
+                                *hrsl = ops[1].data;
+                        } else
+                                regWr(rHIRQ, bmHXFRDNIRQ); //clear the interrupt
+                        return true;
+                }
+        }
+        return false;
+}
+
+template< typename SPI_SS, typename INTR, typename SPI_CFG >
+uint8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::IntHandler() {
         uint8_t HIRQ;
         uint8_t HIRQ_sendback = 0x00;
         HIRQ = regRd(rHIRQ); //determine interrupt source
@@ -567,12 +999,15 @@ uint8_t MAX3421e< SPI_SS, INTR >::IntHandler() {
                 busprobe();
                 HIRQ_sendback |= bmCONDETIRQ;
         }
+        if(HIRQ & bmRWUIRQ) { // a device on the suspended bus wants to resume, see USB::Task()
+                HIRQ_sendback |= bmRWUIRQ;
+        }
         /* End HIRQ interrupts handling, clear serviced IRQs    */
         regWr(rHIRQ, HIRQ_sendback);
         return ( HIRQ_sendback);
 }
-//template< typename SPI_SS, typename INTR >
-//uint8_t MAX3421e< SPI_SS, INTR >::GpxHandler()
+//template< typename SPI_SS, typename INTR, typename SPI_CFG >
+//uint8_t MAX3421e< SPI_SS, INTR, SPI_CFG >::GpxHandler()
 //{
 //    uint8_t GPINIRQ = regRd( rGPINIRQ );          //read GPIN IRQ register
 ////    if( GPINIRQ & bmGPINIRQ7 ) {            //vbus overload
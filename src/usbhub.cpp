@@ -24,7 +24,8 @@ bAddress(0),
 bNbrPorts(0),
 //bInitState(0),
 qNextPollTime(0),
-bPollEnable(false) {
+bPollEnable(false),
+bPollScheduled(false) {
         epInfo[0].epAddr = 0;
         epInfo[0].maxPktSize = 8;
         epInfo[0].bmSndToggle = 0;
@@ -41,24 +42,17 @@ bPollEnable(false) {
                 pUsb->RegisterDeviceClass(this);
 }
 
-uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
-        uint8_t buf[32];
+/* Reads the device descriptor at address 0 and gives the hub its address. USB::Task() calls Init() */
+/* once the hub has recovered from SET_ADDRESS.                                                     */
+uint8_t USBHub::ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed) {
+        uint8_t buf[8];
         USB_DEVICE_DESCRIPTOR * udd = reinterpret_cast<USB_DEVICE_DESCRIPTOR*>(buf);
-        HubDescriptor* hd = reinterpret_cast<HubDescriptor*>(buf);
-        USB_CONFIGURATION_DESCRIPTOR * ucd = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR*>(buf);
         uint8_t rcode;
         UsbDevice *p = NULL;
         EpInfo *oldep_ptr = NULL;
-        uint8_t len = 0;
-        uint16_t cd_len = 0;
-
-        //USBTRACE("\r\nHub Init Start ");
-        //D_PrintHex<uint8_t > (bInitState, 0x80);
 
         AddressPool &addrPool = pUsb->GetAddressPool();
 
-        //switch (bInitState) {
-        //        case 0:
         if(bAddress)
                 return USB_ERROR_CLASS_INSTANCE_ALREADY_IN_USE;
 
@@ -84,9 +78,6 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 
         p->lowspeed = false;
 
-        if(!rcode)
-                len = (buf[0] > 32) ? 32 : buf[0];
-
         if(rcode) {
                 // Restore p->epinfo
                 p->epinfo = oldep_ptr;
@@ -95,36 +86,52 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 
         // Extract device class from device descriptor
         // If device class is not a hub return
-        if(udd->bDeviceClass != 0x09)
+        if(udd->bDeviceClass != 0x09) {
+                p->epinfo = oldep_ptr;
                 return USB_DEV_CONFIG_ERROR_DEVICE_NOT_SUPPORTED;
+        }
 
         // Allocate new address according to device class
         bAddress = addrPool.AllocAddress(parent, (udd->bDeviceClass == 0x09) ? true : false, port);
 
-        if(!bAddress)
+        if(!bAddress) {
+                p->epinfo = oldep_ptr;
                 return USB_ERROR_OUT_OF_ADDRESS_SPACE_IN_POOL;
+        }
 
         // Extract Max Packet Size from the device descriptor
         epInfo[0].maxPktSize = udd->bMaxPacketSize0;
 
-        // Assign new address to the device
-        rcode = pUsb->setAddr(0, 0, bAddress);
+        // Assign new address to the device, Init() is called after the recovery time
+        rcode = pUsb->setAddr(0, 0, bAddress, false);
+
+        // Restore p->epinfo
+        p->epinfo = oldep_ptr;
 
         if(rcode) {
-                // Restore p->epinfo
-                p->epinfo = oldep_ptr;
                 addrPool.FreeAddress(bAddress);
                 bAddress = 0;
                 return rcode;
         }
 
         //USBTRACE2("\r\nHub address: ", bAddress );
+        return 0;
+}
 
-        // Restore p->epinfo
-        p->epinfo = oldep_ptr;
+uint8_t USBHub::Init(uint8_t parent __attribute__((unused)), uint8_t port __attribute__((unused)), bool lowspeed __attribute__((unused))) {
+        uint8_t buf[32];
+        HubDescriptor* hd = reinterpret_cast<HubDescriptor*>(buf);
+        USB_CONFIGURATION_DESCRIPTOR * ucd = reinterpret_cast<USB_CONFIGURATION_DESCRIPTOR*>(buf);
+        uint8_t rcode;
+        uint16_t cd_len = 0;
+        uint8_t bInterval = 100; // used if the endpoint descriptor is not found
 
-        if(len)
-                rcode = pUsb->getDevDescr(bAddress, 0, len, (uint8_t*)buf);
+        //USBTRACE("\r\nHub Init Start ");
+        //D_PrintHex<uint8_t > (bInitState, 0x80);
+
+        //switch (bInitState) {
+        //        case 0:
+        rcode = pUsb->getDevDescr(bAddress, 0, sizeof (USB_DEVICE_DESCRIPTOR), (uint8_t*)buf);
 
         if(rcode)
                 goto FailGetDevDescr;
@@ -160,6 +167,10 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
         if(rcode)
                 goto FailGetConfDescr;
 
+        // Status change endpoint descriptor follows the configuration and interface descriptors
+        if(cd_len >= 25 && buf[19] == USB_DESCRIPTOR_ENDPOINT)
+                bInterval = buf[24];
+
         // The following code is of no practical use in real life applications.
         // It only intended for the usb protocol sniffer to properly parse hub-class requests.
         {
@@ -186,6 +197,7 @@ uint8_t USBHub::Init(uint8_t parent, uint8_t port, bool lowspeed) {
 
         pUsb->SetHubPreMask();
         bPollEnable = true;
+        bPollScheduled = !pUsb->RegisterPeriodic(this, bInterval);
         //                bInitState = 0;
         //}
         //bInitState = 0;
@@ -214,6 +226,7 @@ Fail:
 }
 
 uint8_t USBHub::Release() {
+        pUsb->UnregisterPeriodic(this);
         pUsb->GetAddressPool().FreeAddress(bAddress);
 
         if(bAddress == 0x41)
@@ -223,6 +236,7 @@ uint8_t USBHub::Release() {
         bNbrPorts = 0;
         qNextPollTime = 0;
         bPollEnable = false;
+        bPollScheduled = false;
         return 0;
 }
 
@@ -232,7 +246,7 @@ uint8_t USBHub::Poll() {
         if(!bPollEnable)
                 return 0;
 
-        if(((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L)) {
+        if(bPollScheduled || ((int32_t)((uint32_t)millis() - qNextPollTime) >= 0L)) {
                 rcode = CheckHubStatus();
                 qNextPollTime = (uint32_t)millis() + 100;
         }
@@ -306,27 +320,12 @@ uint8_t USBHub::CheckHubStatus() {
         return 0;
 }
 
+/* Starts a port reset for USB::Configuring() and returns, USB::Task() waits for it to finish. */
+/* The reset complete event is cleared in PortStatusChange().                                 */
 void USBHub::ResetHubPort(uint8_t port) {
-        HubEvent evt;
-        evt.bmEvent = 0;
-        uint8_t rcode;
-
         ClearPortFeature(HUB_FEATURE_C_PORT_ENABLE, port, 0);
         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
         SetPortFeature(HUB_FEATURE_PORT_RESET, port, 0);
-
-
-        for(int i = 0; i < 3; i++) {
-                rcode = GetPortStatus(port, 4, evt.evtBuff);
-                if(rcode) break; // Some kind of error, bail.
-                if(evt.bmEvent == bmHUB_PORT_EVENT_RESET_COMPLETE || evt.bmEvent == bmHUB_PORT_EVENT_LS_RESET_COMPLETE) {
-                        break;
-                }
-                delay(100); // simulate polling.
-        }
-        ClearPortFeature(HUB_FEATURE_C_PORT_RESET, port, 0);
-        ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
-        delay(20);
 }
 
 uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
@@ -334,7 +333,7 @@ uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
                         // Device connected event
                 case bmHUB_PORT_EVENT_CONNECT:
                 case bmHUB_PORT_EVENT_LS_CONNECT:
-                        if(bResetInitiated)
+                        if(bResetInitiated || pUsb->isEnumerating()) // one device at a time, the port is checked again on the next poll
                                 return 0;
 
                         ClearPortFeature(HUB_FEATURE_C_PORT_ENABLE, port, 0);
@@ -363,11 +362,14 @@ uint8_t USBHub::PortStatusChange(uint8_t port, HubEvent &evt) {
                         ClearPortFeature(HUB_FEATURE_C_PORT_RESET, port, 0);
                         ClearPortFeature(HUB_FEATURE_C_PORT_CONNECTION, port, 0);
 
-                        delay(20);
+                        if(!bResetInitiated)
+                                return 0; // reset by ResetHubPort(), the device is already being enumerated
 
                         a.devAddress = bAddress;
 
-                        pUsb->Configuring(a.bmAddress, port, (evt.bmStatus & bmHUB_PORT_STATUS_PORT_LOW_SPEED));
+                        // USB::Task() lets the device settle before it is enumerated
+                        if(pUsb->Configuring(a.bmAddress, port, (evt.bmStatus & bmHUB_PORT_STATUS_PORT_LOW_SPEED)) == USB_ERROR_ENUMERATION_BUSY)
+                                ClearPortFeature(HUB_FEATURE_PORT_ENABLE, port, 0); // disabled ports are connected again once the other device is done
                         bResetInitiated = false;
                         break;
 
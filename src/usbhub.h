@@ -173,6 +173,7 @@ class USBHub : USBDeviceConfig {
         //        uint8_t bInitState; // initialization state variable
         uint32_t qNextPollTime; // next poll time
         bool bPollEnable; // poll enable flag
+        bool bPollScheduled; // polled by the frame scheduler of the USB class
 
         uint8_t CheckHubStatus();
         uint8_t PortStatusChange(uint8_t port, HubEvent &evt);
@@ -191,11 +192,16 @@ public:
 
         void PrintHubStatus();
 
+        uint8_t ConfigureDevice(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Init(uint8_t parent, uint8_t port, bool lowspeed);
         uint8_t Release();
         uint8_t Poll();
         void ResetHubPort(uint8_t port);
 
+        uint32_t NextPollTime() {
+                return qNextPollTime;
+        };
+
         virtual uint8_t GetAddress() {
                 return bAddress;
         };